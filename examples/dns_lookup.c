@@ -0,0 +1,75 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * resolves the names given on the command line in parallel with the
+ * DNS stub resolver, driving all lookups from a single poll() loop.
+ *
+ * usage: dns_lookup [-s servers] name...
+ * servers is a comma separated list like 127.0.0.1:5353, by default the
+ * nameservers of /etc/resolv.conf are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "../rocksock.h"
+
+#define MAXNAMES 64
+
+int main(int argc, char** argv) {
+	static rs_dnsQuery q[MAXNAMES];
+	struct pollfd pfd[MAXNAMES];
+	int idx[MAXNAMES], ret[MAXNAMES];
+	char buf[INET6_ADDRSTRLEN];
+	const char* servers = 0;
+	int i, j, n, names, wait, t;
+
+	if(argc > 2 && !strcmp(argv[1], "-s")) {
+		servers = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
+	names = argc - 1;
+	if(names < 1 || names > MAXNAMES) {
+		dprintf(2, "usage: %s [-s servers] name...\n", argv[0]);
+		return 1;
+	}
+	if(rocksock_dns_init(servers)) {
+		dprintf(2, "no usable nameserver\n");
+		return 1;
+	}
+	for(i = 0; i < names; i++)
+		ret[i] = rocksock_dns_start(&q[i], argv[i + 1]);
+
+	for(;;) {
+		for(n = i = 0, wait = -1; i < names; i++) {
+			if(ret[i] || (t = rocksock_dns_timeout(&q[i])) == -1) continue;
+			if(wait == -1 || t < wait) wait = t;
+			pfd[n].fd = q[i].fd;
+			pfd[n].events = POLLIN;
+			idx[n++] = i;
+		}
+		if(!n) break;
+		poll(pfd, n, wait);
+		for(j = 0; j < n; j++)
+			ret[idx[j]] = rocksock_dns_step(&q[idx[j]]);
+	}
+
+	for(i = 0; i < names; i++) {
+		if(ret[i]) {
+			printf("%s: %s\n", argv[i + 1], gai_strerror(ret[i]));
+			continue;
+		}
+		for(j = 0; j < q[i].naddrs; j++) {
+			rs_sockaddr* a = &q[i].addrs[j];
+			if(a->sa.sa_family == AF_INET) inet_ntop(AF_INET, &a->v4.sin_addr, buf, sizeof buf);
+			else inet_ntop(AF_INET6, &a->v6.sin6_addr, buf, sizeof buf);
+			printf("%s: %s\n", argv[i + 1], buf);
+		}
+	}
+	return 0;
+}
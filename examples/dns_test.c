@@ -0,0 +1,193 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * tests the DNS stub resolver against a nameserver stand-in: forks a UDP
+ * server on 127.0.0.1 that listens on port and port+1 and answers from a
+ * fixed zone, then resolves its names and checks the results. port+2 is
+ * listed as the first nameserver with nobody listening, so every lookup
+ * starts with a port unreachable and has to move on without waiting for
+ * the timeout. the zone is
+ *   a.test    A 10.0.0.1, A 10.0.0.2, AAAA 2001:db8::1
+ *   v4.test   A 10.0.0.3, no AAAA records
+ *   nx.test   NXDOMAIN
+ *   fail.test SERVFAIL on port, A 10.0.0.4 on port+1
+ *   tc.test   truncated answer of 8 A records, only 3 of them fit
+ *
+ * usage: dns_test [port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../rocksock.h"
+
+#define TYPE_A 1
+#define TYPE_AAAA 28
+
+/* appends a record for the name of the question, pointed to at offset 12 */
+static size_t add_rr(unsigned char* p, int type, const char* addr) {
+	int len = type == TYPE_A ? 4 : 16;
+	p[0] = 0xc0;
+	p[1] = 12;
+	p[2] = 0;
+	p[3] = type;
+	p[4] = 0;
+	p[5] = 1;
+	memset(p + 6, 0, 4);
+	p[9] = 60;
+	p[10] = 0;
+	p[11] = len;
+	inet_pton(type == TYPE_A ? AF_INET : AF_INET6, addr, p + 12);
+	return 12 + len;
+}
+
+/* answers the query in buf in place, returns the length of the answer */
+static size_t answer(unsigned char* buf, size_t len, int secondary) {
+	char name[256];
+	size_t pos = 12, n = 0, l;
+	int type, an = 0, rcode = 0, i;
+	if(len < 17 || (buf[2] & 0x80)) return 0;
+	while(buf[pos] && pos + 1 + buf[pos] < len && n + buf[pos] + 1 < sizeof name) {
+		l = buf[pos];
+		memcpy(name + n, buf + pos + 1, l);
+		n += l;
+		name[n++] = '.';
+		pos += 1 + l;
+	}
+	if(!n || buf[pos] || pos + 5 > len) return 0;
+	name[n - 1] = 0;
+	type = buf[pos + 2];
+	pos += 5;
+	if(!strcmp(name, "a.test")) {
+		if(type == TYPE_A) {
+			pos += add_rr(buf + pos, TYPE_A, "10.0.0.1");
+			pos += add_rr(buf + pos, TYPE_A, "10.0.0.2");
+			an = 2;
+		} else {
+			pos += add_rr(buf + pos, TYPE_AAAA, "2001:db8::1");
+			an = 1;
+		}
+	} else if(!strcmp(name, "v4.test")) {
+		if(type == TYPE_A) pos += add_rr(buf + pos, TYPE_A, "10.0.0.3"), an = 1;
+	} else if(!strcmp(name, "fail.test")) {
+		if(!secondary) rcode = 2;
+		else if(type == TYPE_A) pos += add_rr(buf + pos, TYPE_A, "10.0.0.4"), an = 1;
+	} else if(!strcmp(name, "tc.test")) {
+		if(type == TYPE_A) {
+			for(i = 0; i < 3; i++) pos += add_rr(buf + pos, TYPE_A, "10.0.1.1");
+			/* the fourth record is cut off in the middle */
+			add_rr(buf + pos, TYPE_A, "10.0.1.1");
+			pos += 7;
+			an = 8;
+			buf[2] |= 2;
+		}
+	} else rcode = 3;
+	buf[2] |= 0x80;
+	buf[3] = 0x80 | rcode;
+	buf[6] = 0;
+	buf[7] = an;
+	memset(buf + 8, 0, 4);
+	return pos;
+}
+
+static void run_standin(int* fds) {
+	unsigned char buf[512];
+	struct pollfd pfd[2] = { { .fd = fds[0], .events = POLLIN }, { .fd = fds[1], .events = POLLIN } };
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	ssize_t n;
+	size_t len;
+	int i;
+	while(poll(pfd, 2, -1) > 0)
+		for(i = 0; i < 2; i++) {
+			if(!(pfd[i].revents & POLLIN)) continue;
+			fromlen = sizeof from;
+			/* leaves room for the answers behind the question */
+			if((n = recvfrom(fds[i], buf, 256, 0, (void*) &from, &fromlen)) <= 0) continue;
+			if((len = answer(buf, n, i)))
+				sendto(fds[i], buf, len, 0, (void*) &from, fromlen);
+		}
+	exit(0);
+}
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int resolve(const char* host, rs_dnsQuery* q) {
+	struct pollfd pfd;
+	int ret, wait;
+	if((ret = rocksock_dns_start(q, host))) return ret;
+	while((wait = rocksock_dns_timeout(q)) != -1) {
+		pfd.fd = q->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, wait);
+		if((ret = rocksock_dns_step(q))) return ret;
+	}
+	return 0;
+}
+
+/* resolves host and compares the result with want, the expected addresses
+   in order separated by spaces, or the expected error */
+static int check(const char* host, const char* want, int want_err) {
+	rs_dnsQuery q;
+	char got[512], buf[INET6_ADDRSTRLEN];
+	long long t = now_ms();
+	int ret = resolve(host, &q), i, ok;
+	rs_sockaddr* a;
+	*got = 0;
+	if(ret) snprintf(got, sizeof got, "%s", gai_strerror(ret));
+	else for(i = 0; i < q.naddrs; i++) {
+		a = &q.addrs[i];
+		if(a->sa.sa_family == AF_INET) inet_ntop(AF_INET, &a->v4.sin_addr, buf, sizeof buf);
+		else inet_ntop(AF_INET6, &a->v6.sin6_addr, buf, sizeof buf);
+		snprintf(got + strlen(got), sizeof got - strlen(got), "%s%s", i ? " " : "", buf);
+	}
+	t = now_ms() - t;
+	/* the timeout is 5 seconds, anything close to it means a lost query */
+	ok = (want_err ? ret == want_err : !ret && !strcmp(got, want)) && t < 1000;
+	printf("%-4s %-10s %4lld ms  %s\n", ok ? "ok" : "FAIL", host, t, got);
+	return !ok;
+}
+
+int main(int argc, char** argv) {
+	unsigned short port = argc > 1 ? atoi(argv[1]) : 9953;
+	struct sockaddr_in a = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	char servers[64];
+	int fds[2], i, fail = 0;
+	pid_t pid;
+
+	for(i = 0; i < 2; i++) {
+		a.sin_port = htons(port + i);
+		if((fds[i] = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || bind(fds[i], (void*) &a, sizeof a) == -1) {
+			perror("bind");
+			return 1;
+		}
+	}
+	if(!(pid = fork())) run_standin(fds);
+	close(fds[0]);
+	close(fds[1]);
+
+	snprintf(servers, sizeof servers, "127.0.0.1:%u,127.0.0.1:%u,127.0.0.1:%u", port + 2, port, port + 1);
+	if(rocksock_dns_init(servers)) return 1;
+	fail |= check("a.test", "2001:db8::1 10.0.0.1 10.0.0.2", 0);
+	fail |= check("v4.test", "10.0.0.3", 0);
+	fail |= check("nx.test", 0, EAI_NONAME);
+	fail |= check("fail.test", "10.0.0.4", 0);
+	fail |= check("tc.test", "10.0.1.1 10.0.1.1 10.0.1.1", 0);
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	return fail;
+}
@@ -0,0 +1,264 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * echo latency benchmark: forks a rocksockserver based echo server on
+ * 127.0.0.1 and measures the round trip time of small messages sent
+ * one at a time over a rocksock client connection.
+ *
+ * usage: echo_bench [port] [count] [workers] [clients] [engine]
+ * with clients > 1 the client side forks that many processes instead, each
+ * doing count round trips, and the total throughput is reported. run it
+ * with workers = 1, 2, 4, ... to see how the server scales over cores.
+ * engine picks the server's event engine, e.g. io_uring or epoll, to
+ * compare them. afterwards the server is started again traced with ptrace,
+ * and the syscalls it makes per round trip of a single client are counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include "../rocksock.h"
+#include "../rocksockserver.h"
+
+#define MSGSIZE 32
+
+static char srvbuf[4096];
+
+static rocksockserver srv;
+
+static int on_cread(void* userdata, int fd, size_t nread) {
+	rocksockserver_queue(&srv, fd, rocksockserver_buf(&srv), nread, 0);
+	return 0;
+}
+
+static int on_cdisconnect(void* userdata, int fd) {
+	return 0;
+}
+
+static void run_server(unsigned short port, int workers, const char* engine, int readyfd, int traced) {
+	int ret, tries = 0;
+	/* the io_uring instance of a server killed just before is torn down
+	   asynchronously and holds on to the port for a moment */
+	while((ret = rocksockserver_init_workers(&srv, "127.0.0.1", port, &srv, workers, 1)) == -2 && ++tries < 100)
+		usleep(10000);
+	if(ret) exit(1);
+	if(engine && rocksockserver_set_engine(&srv, engine)) {
+		fprintf(stderr, "engine %s not available\n", engine);
+		exit(1);
+	}
+	/* the socket is listening, the clients can connect */
+	if(write(readyfd, "", 1) != 1) exit(1);
+	close(readyfd);
+	if(traced) raise(SIGSTOP);
+	rocksockserver_loop(&srv, srvbuf, sizeof srvbuf, 0, on_cread, 0, on_cdisconnect);
+	exit(1);
+}
+
+/* forks the server and returns once it is ready, -1 if it failed. with
+   traced set it stops itself for the tracer before entering the loop. */
+static pid_t start_server(unsigned short port, int workers, const char* engine, int traced) {
+	int p[2];
+	char c;
+	pid_t pid;
+	if(pipe(p)) return -1;
+	if(!(pid = fork())) {
+		close(p[0]);
+		if(traced) ptrace(PTRACE_TRACEME, 0, 0, 0);
+		run_server(port, workers, engine, p[1], traced);
+	}
+	close(p[1]);
+	if(pid != -1 && read(p[0], &c, 1) != 1) {
+		waitpid(pid, 0, 0);
+		pid = -1;
+	}
+	close(p[0]);
+	return pid;
+}
+
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int cmp_ll(const void* a, const void* b) {
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* does count round trips, storing their latencies in lat if non-null */
+static int run_client(unsigned short port, size_t count, long long* lat) {
+	size_t i, got, n;
+	char msg[MSGSIZE], reply[MSGSIZE];
+	long long t;
+	rocksock sock;
+	int ret;
+
+	rocksock_init(&sock, 0);
+	rocksock_set_timeout(&sock, 5000);
+	if((ret = rocksock_connect(&sock, "127.0.0.1", port, 0))) goto out;
+	memset(msg, 'x', sizeof msg);
+	for(i = 0; i < count; i++) {
+		t = now_us();
+		if((ret = rocksock_send(&sock, msg, sizeof msg, 0, &n))) break;
+		for(got = 0; got < sizeof reply; got += n)
+			if((ret = rocksock_recv(&sock, reply + got, sizeof reply - got, 0, &n))) break;
+		if(ret) break;
+		if(lat) lat[i] = now_us() - t;
+	}
+out:
+	if(ret) rocksock_error_dprintf(2, &sock);
+	rocksock_disconnect(&sock);
+	return ret;
+}
+
+enum { SC_SEND, SC_RECV, SC_WAIT, SC_CTL, SC_URING, SC_OTHER, SC_MAX };
+static const char* sc_names[SC_MAX] = { "send", "recv", "wait", "epoll_ctl", "io_uring_enter", "other" };
+
+static int classify(long nr) {
+	switch(nr) {
+#ifdef SYS_sendto
+		case SYS_sendto:
+#endif
+#ifdef SYS_sendmsg
+		case SYS_sendmsg:
+#endif
+#ifdef SYS_write
+		case SYS_write:
+#endif
+			return SC_SEND;
+#ifdef SYS_recvfrom
+		case SYS_recvfrom:
+#endif
+#ifdef SYS_recvmsg
+		case SYS_recvmsg:
+#endif
+#ifdef SYS_read
+		case SYS_read:
+#endif
+			return SC_RECV;
+#ifdef SYS_epoll_wait
+		case SYS_epoll_wait:
+#endif
+#ifdef SYS_epoll_pwait
+		case SYS_epoll_pwait:
+#endif
+#ifdef SYS_select
+		case SYS_select:
+#endif
+#ifdef SYS_pselect6
+		case SYS_pselect6:
+#endif
+			return SC_WAIT;
+#ifdef SYS_epoll_ctl
+		case SYS_epoll_ctl:
+			return SC_CTL;
+#endif
+#ifdef SYS_io_uring_enter
+		case SYS_io_uring_enter:
+			return SC_URING;
+#endif
+		default:
+			return SC_OTHER;
+	}
+}
+
+/* runs the server in a traced child and counts the syscalls its threads
+   enter while a client does count round trips */
+static int count_syscalls(unsigned short port, size_t count, int workers, const char* engine, unsigned long* counts) {
+	struct __ptrace_syscall_info info;
+	int st, sig, ret = -1;
+	pid_t pid, client, tid;
+
+	if((pid = start_server(port, workers, engine, 1)) == -1) return -1;
+	if(waitpid(pid, &st, 0) == -1 || !WIFSTOPPED(st)) goto out;
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	if((client = fork()) == -1) goto out;
+	if(!client) exit(run_client(port, count, 0) != 0);
+	if(ptrace(PTRACE_SYSCALL, pid, 0, 0) == -1) goto out;
+	while((tid = waitpid(-1, &st, __WALL)) != -1) {
+		if(tid == client) {
+			ret = WIFEXITED(st) && !WEXITSTATUS(st) ? 0 : -1;
+			break;
+		}
+		if(!WIFSTOPPED(st)) continue;
+		sig = WSTOPSIG(st);
+		if(sig == (SIGTRAP | 0x80)) {
+			if(ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) > 0 &&
+			   info.op == PTRACE_SYSCALL_INFO_ENTRY)
+				counts[classify(info.entry.nr)]++;
+			sig = 0;
+		/* clone events, and the stop new threads start with */
+		} else if(sig == SIGTRAP || sig == SIGSTOP) sig = 0;
+		ptrace(PTRACE_SYSCALL, tid, 0, sig);
+	}
+out:
+	kill(pid, SIGKILL);
+	/* the traced threads have to be reaped before the process can be */
+	while((tid = waitpid(-1, 0, __WALL)) != -1 && tid != pid);
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	unsigned short port = argc > 1 ? atoi(argv[1]) : 9998;
+	size_t count = argc > 2 ? atoi(argv[2]) : 2000;
+	int workers = argc > 3 ? atoi(argv[3]) : 1;
+	int i, st, clients = argc > 4 ? atoi(argv[4]) : 1;
+	const char* engine = argc > 5 ? argv[5] : 0;
+	unsigned long counts[SC_MAX] = {0}, total = 0;
+	size_t traced = count < 1000 ? count : 1000;
+	long long *lat = 0, t;
+	pid_t pid;
+	int ret = 0;
+
+	if(!count || clients < 1) return 1;
+	if((pid = start_server(port, workers, engine, 0)) == -1) return 1;
+
+	if(clients == 1) {
+		if(!(lat = malloc(count * sizeof *lat)) || (ret = run_client(port, count, lat))) goto out;
+		qsort(lat, count, sizeof *lat, cmp_ll);
+		printf("%s: %zu round trips of %d bytes: p50 %lld us, p99 %lld us, max %lld us\n",
+		       engine ? engine : "default", count, MSGSIZE, lat[count / 2], lat[count * 99 / 100], lat[count - 1]);
+		goto trace;
+	}
+	t = now_us();
+	for(i = 0; i < clients; i++)
+		if(!fork()) exit(run_client(port, count, 0) != 0);
+	for(i = 0; i < clients; i++)
+		if(wait(&st) == -1 || !WIFEXITED(st) || WEXITSTATUS(st)) ret = 1;
+	t = now_us() - t;
+	printf("%s: %d workers, %d clients x %zu round trips of %d bytes: %.0f round trips/s\n",
+	       engine ? engine : "default", workers, clients, count, MSGSIZE, (double) clients * count * 1000000. / t);
+	if(ret) goto out;
+trace:
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	pid = -1;
+	/* the traced children would flush the buffered output again */
+	fflush(stdout);
+	if((ret = count_syscalls(port, traced, workers, engine, counts))) {
+		fprintf(stderr, "tracing the server failed\n");
+		goto out;
+	}
+	printf("%s: server syscalls per round trip (%zu traced):", engine ? engine : "default", traced);
+	for(i = 0; i < SC_MAX; i++) {
+		printf(" %s %.2f,", sc_names[i], (double) counts[i] / traced);
+		total += counts[i];
+	}
+	printf(" total %.2f\n", (double) total / traced);
+out:
+	if(pid != -1) {
+		kill(pid, SIGTERM);
+		waitpid(pid, 0, 0);
+	}
+	free(lat);
+	return ret != 0;
+}
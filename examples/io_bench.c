@@ -0,0 +1,190 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * data path microbenchmark: forks a rocksockserver based echo server on
+ * 127.0.0.1 and does round trips of 1KB messages with rocksock_send/recv.
+ * it reports the time per round trip, then repeats the run in a child
+ * traced with ptrace to count the syscalls the client makes per round trip.
+ *
+ * usage: io_bench [port] [count] [timeout]
+ * timeout is the rocksock timeout in ms, 0 to wait forever.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include "../rocksock.h"
+#include "../rocksockserver.h"
+
+#define MSGSIZE 1024
+
+static char srvbuf[4096];
+
+static rocksockserver srv;
+
+static int on_cread(void* userdata, int fd, size_t nread) {
+	rocksockserver_queue(&srv, fd, rocksockserver_buf(&srv), nread, 0);
+	return 0;
+}
+
+static int on_cdisconnect(void* userdata, int fd) {
+	return 0;
+}
+
+static void run_server(unsigned short port) {
+	if(rocksockserver_init(&srv, "127.0.0.1", port, &srv)) exit(1);
+	rocksockserver_loop(&srv, srvbuf, sizeof srvbuf, 0, on_cread, 0, on_cdisconnect);
+	exit(1);
+}
+
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* does count round trips. with traced set, the loop is enclosed in two
+   getppid() calls marking the part the tracer counts. */
+static int run_client(unsigned short port, size_t count, unsigned long timeout, int traced) {
+	size_t i, got, n;
+	char msg[MSGSIZE], reply[MSGSIZE];
+	rocksock sock;
+	int ret;
+
+	rocksock_init(&sock, 0);
+	rocksock_set_timeout(&sock, timeout);
+	if((ret = rocksock_connect(&sock, "127.0.0.1", port, 0))) goto out;
+	memset(msg, 'x', sizeof msg);
+	if(traced) getppid();
+	for(i = 0; i < count; i++) {
+		if((ret = rocksock_send(&sock, msg, sizeof msg, 0, &n))) break;
+		for(got = 0; got < sizeof reply; got += n)
+			if((ret = rocksock_recv(&sock, reply + got, sizeof reply - got, 0, &n))) break;
+		if(ret) break;
+	}
+	if(traced) getppid();
+out:
+	if(ret) rocksock_error_dprintf(2, &sock);
+	rocksock_disconnect(&sock);
+	return ret;
+}
+
+enum { SC_SEND, SC_RECV, SC_WAIT, SC_SOCKOPT, SC_OTHER, SC_MAX };
+static const char* sc_names[SC_MAX] = { "send", "recv", "poll/select", "setsockopt", "other" };
+
+static int classify(long nr) {
+	switch(nr) {
+#ifdef SYS_sendto
+		case SYS_sendto:
+#endif
+#ifdef SYS_sendmsg
+		case SYS_sendmsg:
+#endif
+#ifdef SYS_write
+		case SYS_write:
+#endif
+			return SC_SEND;
+#ifdef SYS_recvfrom
+		case SYS_recvfrom:
+#endif
+#ifdef SYS_recvmsg
+		case SYS_recvmsg:
+#endif
+#ifdef SYS_read
+		case SYS_read:
+#endif
+			return SC_RECV;
+#ifdef SYS_poll
+		case SYS_poll:
+#endif
+#ifdef SYS_ppoll
+		case SYS_ppoll:
+#endif
+#ifdef SYS_select
+		case SYS_select:
+#endif
+#ifdef SYS_pselect6
+		case SYS_pselect6:
+#endif
+			return SC_WAIT;
+		case SYS_setsockopt:
+			return SC_SOCKOPT;
+		default:
+			return SC_OTHER;
+	}
+}
+
+/* runs the client in a traced child and counts the syscalls it enters
+   between the two markers */
+static int count_syscalls(unsigned short port, size_t count, unsigned long timeout, unsigned long* counts) {
+	struct __ptrace_syscall_info info;
+	int st, markers = 0, sc;
+	pid_t pid;
+
+	if(!(pid = fork())) {
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		raise(SIGSTOP);
+		exit(run_client(port, count, timeout, 1) != 0);
+	}
+	if(waitpid(pid, &st, 0) == -1 || !WIFSTOPPED(st)) return -1;
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+	for(;;) {
+		if(ptrace(PTRACE_SYSCALL, pid, 0, 0) == -1 || waitpid(pid, &st, 0) == -1) return -1;
+		if(WIFEXITED(st)) return WEXITSTATUS(st) ? -1 : 0;
+		if(!WIFSTOPPED(st) || WSTOPSIG(st) != (SIGTRAP | 0x80)) continue;
+		if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof info, &info) <= 0) return -1;
+		if(info.op != PTRACE_SYSCALL_INFO_ENTRY) continue;
+		if(info.entry.nr == SYS_getppid) {
+			markers++;
+			continue;
+		}
+		if(markers != 1) continue;
+		sc = classify(info.entry.nr);
+		counts[sc]++;
+	}
+}
+
+int main(int argc, char** argv) {
+	unsigned short port = argc > 1 ? atoi(argv[1]) : 9997;
+	size_t count = argc > 2 ? atoi(argv[2]) : 20000;
+	unsigned long timeout = argc > 3 ? atoi(argv[3]) : 5000;
+	unsigned long counts[SC_MAX] = {0}, total = 0;
+	size_t traced = count < 1000 ? count : 1000;
+	long long t;
+	pid_t pid;
+	int i, ret;
+
+	if(!count) return 1;
+	if(!(pid = fork())) run_server(port);
+	usleep(200000);
+
+	t = now_us();
+	if((ret = run_client(port, count, timeout, 0))) goto out;
+	t = now_us() - t;
+	printf("%zu round trips of %d bytes: %.2f us per round trip\n", count, MSGSIZE, (double) t / count);
+
+	/* the traced child would flush the buffered output again */
+	fflush(stdout);
+	if((ret = count_syscalls(port, traced, timeout, counts))) {
+		fprintf(stderr, "tracing the client failed\n");
+		goto out;
+	}
+	printf("syscalls per round trip (%zu traced):", traced);
+	for(i = 0; i < SC_MAX; i++) {
+		printf(" %s %.2f,", sc_names[i], (double) counts[i] / traced);
+		total += counts[i];
+	}
+	printf(" total %.2f\n", (double) total / traced);
+out:
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	return ret != 0;
+}
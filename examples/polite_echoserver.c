@@ -2,7 +2,6 @@
    mimics a traditional echo server */
 
 #include "../rocksockserver.h"
-#include "../../lib/include/sblist.h"
 #include <string.h>
 
 //RcB: CFLAGS "-std=c99"
@@ -13,35 +12,20 @@ enum cstate {
 	cs_said_hello,
 	cs_idle,
 	cs_msg,
+	cs_closing,
 };
 
+/* lives in the per-client arena of rocksockserver */
 typedef struct client {
-	int fd;
 	enum cstate state;
 	char msg[128];
 } client;
 
 typedef struct server_state {
 	rocksockserver srv;
-	sblist *clients;
 } server;
 
-struct client *client_from_fd(sblist *clients, int fd) {
-	struct client* c;
-	sblist_iter(clients, c) {
-		if(c->fd == fd) return c;
-	}
-	return 0;
-}
-
 static void disconnect_client(server* s, int fd) {
-	struct client *c;
-	sblist_iter_counter(s->clients, i, c) {
-		if(c->fd == fd) {
-			sblist_delete(s->clients, i);
-			break;
-		}
-	}
 	rocksockserver_disconnect_client(&s->srv, fd);
 }
 
@@ -51,73 +35,76 @@ static int on_cdisconnect (void* userdata, int fd) {
 	return 0;
 }
 
-static int on_cconnect (void* userdata, struct sockaddr_storage* clientaddr, int fd) {
-	server* s = userdata;
-	struct client c = {.fd = fd };
-	if(!sblist_add(s->clients, &c)) {
-		disconnect_client(s, fd);
-		return -1;
+#define SL(X) X, sizeof(X)-1
+static void reply(server *s, client *c, int fd) {
+	switch(c->state) {
+		case cs_said_hello:
+			rocksockserver_queue(&s->srv, fd, SL("HELO. you may now say something.\n"), 0);
+			c->state = cs_idle;
+			break;
+		case cs_error:
+			/* goes out after what was queued before, on_cwantsdata
+			   hangs up once it is sent */
+			rocksockserver_queue(&s->srv, fd, SL("error: need to send HELO first\n"), 0);
+			rocksockserver_want_write(&s->srv, fd, 1);
+			c->state = cs_closing;
+			break;
+		case cs_msg:
+			rocksockserver_queue(&s->srv, fd, c->msg, strlen(c->msg), 0);
+			c->state = cs_idle;
+			break;
+		default:
+			break;
 	}
-	return 0;
 }
 
 static void read_command(server *s, client *c, int fd) {
 	ssize_t nbytes;
-	if(c->state == cs_null) {
+	if(c->state == cs_closing) {
+		/* discard whatever else the client sends */
+		if(!recv(fd, c->msg, sizeof(c->msg), 0)) on_cdisconnect(s, fd);
+		return;
+	} else if(c->state == cs_null) {
 		if(5 != (nbytes = recv(fd, c->msg, 5, 0)) ||
 		   memcmp(c->msg, "HELO\n", 5)) {
 			c->state = cs_error;
 		} else c->state = cs_said_hello;
 	} else if (c->state == cs_idle) {
 		nbytes = recv(fd, c->msg, sizeof(c->msg)-1, 0);
-		if (nbytes == 0) on_cdisconnect(s, fd);
-		else if(nbytes < 1) c->state = cs_error;
+		if (nbytes == 0) {
+			on_cdisconnect(s, fd);
+			return;
+		} else if(nbytes < 1) c->state = cs_error;
 		else {
 			c->msg[nbytes] = 0;
 			c->state = cs_msg;
 		}
 	}
+	reply(s, c, fd);
 }
 
 static int on_cread (void* userdata, int fd, size_t dummy) {
 	server* s = userdata;
 	struct client *c;
-	if(!(c = client_from_fd(s->clients, fd))) return -1;
+	if(!(c = rocksockserver_ctx(&s->srv, fd))) return -1;
 	read_command(s, c, fd);
 	return 0;
 }
-#define SL(X) X, sizeof(X)-1
+
 static int on_cwantsdata (void* userdata, int fd) {
 	server* s = userdata;
-	struct client *c;
-	if(!(c = client_from_fd(s->clients, fd))) return -1;
-	switch(c->state) {
-		case cs_said_hello:
-			send(fd, SL("HELO. you may now say something.\n"), MSG_NOSIGNAL);
-			c->state = cs_idle;
-		case cs_idle:
-		case cs_null:
-			break;
-		case cs_error:
-			send(fd, SL("error: need to send HELO first\n"), MSG_NOSIGNAL);
-			disconnect_client(s, fd);
-			break;
-		case cs_msg:
-			send(fd, c->msg, strlen(c->msg), MSG_NOSIGNAL);
-			c->state = cs_idle;
-			break;
-	}
+	if(!rocksockserver_queued(&s->srv, fd)) disconnect_client(s, fd);
 	return 0;
 }
 
 int main() {
 	server sv, *s = &sv;
-	s->clients = sblist_new(sizeof(struct client), 32);
 	const int port = 9999;
 	const char* listenip = "0.0.0.0";
 	if(rocksockserver_init(&s->srv, listenip, port, (void*) s)) return -1;
+	if(rocksockserver_set_ctx_size(&s->srv, sizeof(struct client))) return -1;
 	if(rocksockserver_loop(&s->srv, NULL, 0,
-	                       &on_cconnect, &on_cread,
+	                       NULL, &on_cread,
 	                       &on_cwantsdata, &on_cdisconnect)) return -2;
 	return 0;
 }
@@ -1,5 +1,3 @@
-// use rcb to compile: rcb portscanner.c
-
 /*
  *
  * author: rofl0r
@@ -9,128 +7,121 @@
  *
  */
 
+/* scans a /24 subnet for an open port. the connects are driven from a single
+   poll() loop using the non-blocking rocksock_connect_* api, so no threads
+   are needed to have many of them in flight. */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <pthread.h>
-#include <errno.h>
 #include <time.h>
+#include <poll.h>
 #include "../rocksock.h"
 
-//RcB: LINK "-lpthread"
+#define TIMEOUT_MS 1500
 
 typedef struct {
+	rocksock sock;
 	char host[16];
-	int port;
+	long long started;
 	int status;
-} threaddata;
-
-static int done = 0;
-static pthread_mutex_t mutex;
-
-static void* scanHost(void* arg) {
-	threaddata* d = arg;
-	rocksock skt;
-	rocksock* soc = &skt;
-	rocksock_init(soc);
-	rocksock_set_timeout(soc, 1500);
-
-	if (!rocksock_connect(soc, d->host, d->port, 0)){
-		d->status = 1;
-	} else {
-		//printf("%s\n", soc->lasterror.errormsg);
-		d->status = 0;
-	}
+} scan;
 
-	rocksock_disconnect(soc);
-	rocksock_clear(soc);
-
-	pthread_mutex_lock(&mutex);
-	done++;
-	pthread_mutex_unlock(&mutex);
-	return 0;
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-int running(pthread_t* t, int max) {
-	int res = 0, i = 0;
-	for (; i <= max; i++) {
-		if (t[i]) res++;
-	}
-	return res;
+static int events(rocksock* sock) {
+	int want = rocksock_connect_want(sock);
+	return ((want & RS_WANT_READ) ? POLLIN : 0) | ((want & RS_WANT_WRITE) ? POLLOUT : 0);
 }
 
-int joinThreads(pthread_t* threads, int max) {
-	void* exitstate;
-	int i = 0;
-	for(;i<max;i++) {
-		if (threads[i]) {
-			if (!pthread_join(threads[i], &exitstate)) {
-				threads[i] = 0;
-				free(exitstate);
-			}
-		}
-	}
-	return 0;
+static int revents(int ev) {
+	if(ev & (POLLERR | POLLHUP)) return RS_WANT_READ | RS_WANT_WRITE;
+	return ((ev & POLLIN) ? RS_WANT_READ : 0) | ((ev & POLLOUT) ? RS_WANT_WRITE : 0);
 }
 
-int scanRange(const char *ip, int port, int max_threads) {
-
-	int maxthreads = max_threads > 254 ? 254 : max_threads;
-	pthread_t threads[255] = {0};
-	threaddata data[255] = {0};
+static void finish(scan* s, int status) {
+	s->status = status;
+	rocksock_disconnect(&s->sock);
+}
 
-	pthread_attr_t attr;
-	size_t stack;
-	pthread_attr_init(&attr);
-	pthread_attr_getstacksize(&attr, &stack);
-	stack = 32768;
-	pthread_attr_setstacksize(&attr, stack);
+int scanRange(const char *ip, int port, int maxconns) {
+	scan data[255] = {0};
+	struct pollfd pfd[255];
+	scan* active[255];
+	int x = 1, i, n, done = 0;
+	long long now;
 
-	pthread_mutex_init(&mutex, NULL);
+	if(maxconns > 254) maxconns = 254;
+	if(maxconns < 1) maxconns = 1;
 
-	volatile int x = 1;
 	while(done < 254) {
-		while(x < 255 && running((pthread_t*) threads, x) < maxthreads) {
-			threaddata* d = &data[x];
-			snprintf(d->host, sizeof(d->host), "%s.%d", ip, x);
-			d->port = port;
-			d->status = -1;
-			if (!pthread_create(&threads[x], &attr, scanHost, &data[x])) {
-				x++;
-			}
-			else {
-				break;
+		/* start new connects while there's room */
+		for(n = 0, i = 1; i < x; i++)
+			if(data[i].status == -1) n++;
+		for(; x < 255 && n < maxconns; x++) {
+			scan* s = &data[x];
+			snprintf(s->host, sizeof(s->host), "%s.%d", ip, x);
+			rocksock_init(&s->sock, 0);
+			s->started = now_ms();
+			s->status = -1;
+			if(rocksock_connect_start(&s->sock, s->host, port, 0)) {
+				finish(s, 0);
+				done++;
+			} else if(!rocksock_connect_want(&s->sock)) {
+				finish(s, 1);
+				done++;
+			} else n++;
+		}
+		for(n = 0, i = 1; i < x; i++) {
+			if(data[i].status != -1) continue;
+			active[n] = &data[i];
+			pfd[n].fd = data[i].sock.socket;
+			pfd[n].events = events(&data[i].sock);
+			n++;
+		}
+		if(!n) continue;
+		poll(pfd, n, 100);
+		now = now_ms();
+		for(i = 0; i < n; i++) {
+			scan* s = active[i];
+			if(pfd[i].revents) {
+				if(rocksock_connect_step(&s->sock, revents(pfd[i].revents))) {
+					finish(s, 0);
+					done++;
+				} else if(!rocksock_connect_want(&s->sock)) {
+					finish(s, 1);
+					done++;
+				}
+			} else if(now - s->started >= TIMEOUT_MS) {
+				finish(s, 0);
+				done++;
 			}
 		}
-		joinThreads(threads, x);
 	}
 
-	joinThreads(threads, x);
-
-	pthread_attr_destroy(&attr);
-
-	int i = 0;
-	for (; i < 255; i++) {
+	for (i = 1; i < 255; i++) {
 		if (data[i].status > 0) dprintf(1, "%s\n", data[i].host);
 	}
-
-	pthread_mutex_destroy(&mutex);
 	return 0;
 }
 
 int main(int argc, char** argv) {
 	if (argc < 4) {
-		dprintf(2, "multithreaded subnet portscanner\n"
+		dprintf(2, "subnet portscanner\n"
 		           "inv. syntax\n"
 		           "%s 127.0.0 22 16\n"
-		           "subnetA port maxthreads\n", argv[0]);
+		           "subnetA port maxconns\n", argv[0]);
 		exit(1);
 	}
 
 	int port = atoi(argv[2]);
 	char* ip = argv[1];
-	int maxthreads = atoi(argv[3]);
+	int maxconns = atoi(argv[3]);
 
-	scanRange(ip, port, maxthreads);
+	scanRange(ip, port, maxconns);
 	return 0;
 }
@@ -0,0 +1,206 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * compares connects through a flaky proxy pool picking a random proxy per
+ * hop with rocksock_connect_chain. forks SOCKS5 stand-ins on 127.0.0.1
+ * ports base+1 and up, of which two in ten are down, one in ten stalls, two
+ * in ten fail every other connect, and the rest delay both of their replies
+ * by up to 20ms, and a target on port base they connect to.
+ * the first half of the proxies serves hop 0, the second half hop 1.
+ *
+ * usage: proxychain_bench [base port] [proxies] [connects]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../rocksock.h"
+
+#define MAXPROXIES 100
+#define TIMEOUT 300
+#define DEADLINE 3000
+
+enum { PT_DOWN, PT_STALL, PT_FLAKY, PT_OK };
+
+static int kind(int i) {
+	switch(i % 10) {
+		case 0: case 1: return PT_DOWN;
+		case 2: return PT_STALL;
+		case 3: case 4: return PT_FLAKY;
+		default: return PT_OK;
+	}
+}
+
+static int listener(unsigned short port) {
+	struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	int l, one = 1;
+	if((l = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+	setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if(bind(l, (void*) &a, sizeof a) == -1 || listen(l, 64) == -1) {
+		close(l);
+		return -1;
+	}
+	return l;
+}
+
+static int readn(int fd, unsigned char* buf, size_t n) {
+	ssize_t r;
+	size_t got;
+	for(got = 0; got < n; got += r)
+		if((r = read(fd, buf + got, n - got)) <= 0) return -1;
+	return 0;
+}
+
+static void drain(int fd) {
+	char buf[512];
+	while(read(fd, buf, sizeof buf) > 0);
+}
+
+static void relay(int a, int b) {
+	struct pollfd pfd[2] = { { .fd = a, .events = POLLIN }, { .fd = b, .events = POLLIN } };
+	char buf[4096];
+	ssize_t n;
+	int i;
+	while(poll(pfd, 2, -1) > 0)
+		for(i = 0; i < 2; i++)
+			if(pfd[i].revents) {
+				if((n = read(pfd[i].fd, buf, sizeof buf)) <= 0 || write(pfd[!i].fd, buf, n) != n) return;
+			}
+}
+
+/* SOCKS5 without authentication, IPv4 targets only */
+static void socks5(int c, int delay) {
+	static const unsigned char ok[] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 }, refused[] = { 5, 5, 0, 1, 0, 0, 0, 0, 0, 0 };
+	struct sockaddr_in a = { .sin_family = AF_INET };
+	unsigned char buf[256];
+	int t;
+	if(readn(c, buf, 2) || readn(c, buf + 2, buf[1])) return;
+	usleep(delay * 1000);
+	if(write(c, "\5\0", 2) != 2 || readn(c, buf, 10) || buf[3] != 1) return;
+	memcpy(&a.sin_addr, buf + 4, 4);
+	memcpy(&a.sin_port, buf + 8, 2);
+	usleep(delay * 1000);
+	if((t = socket(AF_INET, SOCK_STREAM, 0)) == -1 || connect(t, (void*) &a, sizeof a) == -1) {
+		write(c, refused, sizeof refused);
+		return;
+	}
+	if(write(c, ok, sizeof ok) == sizeof ok) relay(c, t);
+	close(t);
+}
+
+static void handle(int c, int i) {
+	srand(getpid());
+	switch(i ? kind(i - 1) : -1) {
+		/* the target, and the stalling proxies */
+		case -1: case PT_STALL: drain(c); break;
+		case PT_FLAKY: if(rand() % 2) break;
+		/* fall through */
+		default: socks5(c, (i * 7) % 21);
+	}
+	exit(0);
+}
+
+/* listens on the target port and the ports of the proxies that aren't down */
+static void run_servers(unsigned short base, int nproxies) {
+	struct pollfd pfd[MAXPROXIES + 1];
+	int idx[MAXPROXIES + 1], i, n = 0, c;
+	signal(SIGCHLD, SIG_IGN);
+	for(i = 0; i <= nproxies; i++) {
+		if(i && kind(i - 1) == PT_DOWN) continue;
+		if((pfd[n].fd = listener(base + i)) == -1) {
+			perror("bind");
+			exit(1);
+		}
+		pfd[n].events = POLLIN;
+		idx[n++] = i;
+	}
+	while(poll(pfd, n, -1) > 0)
+		for(i = 0; i < n; i++)
+			if(pfd[i].revents && (c = accept(pfd[i].fd, 0, 0)) != -1) {
+				if(!fork()) handle(c, idx[i]);
+				close(c);
+			}
+	exit(1);
+}
+
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void report(const char* what, int nhops, int ok, int count, long long us, unsigned long attempts) {
+	printf("%d hop%s %-9s %3d/%d connected (%5.1f%%), %6.1f ms per connect, %lu attempts\n",
+	       nhops, nhops > 1 ? "s" : " ", what, ok, count, 100. * ok / count, us / 1000. / count, attempts);
+}
+
+static void run(unsigned short base, int nproxies, int nhops, int count) {
+	rocksock_proxychain chain;
+	rs_proxy px[2];
+	rocksock sock;
+	char buf[64];
+	int i, h, ok = 0, per_hop = nproxies / nhops;
+	unsigned long attempts = 0;
+	long long t;
+	size_t j;
+
+	t = now_us();
+	for(i = 0; i < count; i++) {
+		rocksock_init(&sock, px);
+		rocksock_set_timeout(&sock, TIMEOUT);
+		for(h = 0; h < nhops; h++) {
+			snprintf(buf, sizeof buf, "socks5://127.0.0.1:%d", base + 1 + h * per_hop + rand() % per_hop);
+			rocksock_add_proxy_fromstring(&sock, buf);
+		}
+		if(!rocksock_connect(&sock, "127.0.0.1", base, 0)) ok++;
+		rocksock_disconnect(&sock);
+	}
+	report("random", nhops, ok, count, now_us() - t, count);
+
+	if(rocksock_proxychain_init(&chain, nhops, 1000, 60000)) return;
+	for(h = 0; h < nhops; h++)
+		for(i = 0; i < per_hop; i++) {
+			snprintf(buf, sizeof buf, "socks5://127.0.0.1:%d", base + 1 + h * per_hop + i);
+			rocksock_proxychain_add(&chain, h, buf);
+		}
+	t = now_us();
+	for(ok = i = 0; i < count; i++) {
+		rocksock_init(&sock, px);
+		rocksock_set_timeout(&sock, TIMEOUT);
+		rocksock_set_deadline(&sock, DEADLINE);
+		if(!rocksock_connect_chain(&sock, &chain, "127.0.0.1", base, 0)) ok++;
+		rocksock_disconnect(&sock);
+	}
+	t = now_us() - t;
+	for(h = 0; h < nhops; h++)
+		for(j = 0; j < chain.hops[h].count; j++)
+			attempts += chain.hops[h].candidates[j].uses;
+	report("failover", nhops, ok, count, t, attempts / nhops);
+	rocksock_proxychain_free(&chain);
+}
+
+int main(int argc, char** argv) {
+	unsigned short base = argc > 1 ? atoi(argv[1]) : 9980;
+	int nproxies = argc > 2 ? atoi(argv[2]) : 40;
+	int count = argc > 3 ? atoi(argv[3]) : 200;
+	pid_t pid;
+
+	if(nproxies < 2 || nproxies > MAXPROXIES || count < 1) return 1;
+	if(!(pid = fork())) run_servers(base, nproxies);
+	usleep(200000);
+	srand(1);
+	run(base, nproxies, 1, count);
+	run(base, nproxies, 2, count);
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ * compares rocksock_send with and without MSG_ZEROCOPY over loopback:
+ * forks a receiver that reads and discards everything, then sends the
+ * given amount with various buffer sizes and reports the CPU cost of the
+ * sending process per GB, in cycles if the perf counters are accessible
+ * and in CPU time.
+ * note that on loopback the kernel has to copy zerocopy data when the
+ * receiver reads it, so the gain shows on the sender only, and is larger
+ * with a real NIC.
+ *
+ * usage: zerocopy_bench [port] [MB per run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "../rocksock.h"
+
+static void run_receiver(int l) {
+	static char buf[1 << 20];
+	int c;
+	while((c = accept(l, 0, 0)) != -1) {
+		while(read(c, buf, sizeof buf) > 0);
+		close(c);
+	}
+	exit(0);
+}
+
+/* counter of the cycles spent by this process, user and kernel, or -1 */
+static int open_cycles(void) {
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static long long read_cycles(int fd) {
+	long long v;
+	if(fd == -1 || read(fd, &v, sizeof v) != sizeof v) return 0;
+	return v;
+}
+
+static long long cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int run(unsigned short port, char* buf, size_t bufsize, size_t total, int zerocopy, int cycles_fd) {
+	rocksock sock;
+	size_t sent, n;
+	long long cyc, cpu, wall;
+	double gb = total / 1073741824.;
+	int ret;
+
+	rocksock_init(&sock, 0);
+	rocksock_set_timeout(&sock, 10000);
+	if((ret = rocksock_connect(&sock, "127.0.0.1", port, 0))) goto out;
+	if(zerocopy && (ret = rocksock_set_zerocopy(&sock, 16384))) goto out;
+	cyc = read_cycles(cycles_fd);
+	cpu = cpu_ns();
+	wall = now_ns();
+	for(sent = 0; sent < total; sent += n)
+		if((ret = rocksock_send(&sock, buf, bufsize, 0, &n))) goto out;
+	cyc = read_cycles(cycles_fd) - cyc;
+	cpu = cpu_ns() - cpu;
+	wall = now_ns() - wall;
+	printf("%8zuK %-9s ", bufsize / 1024, zerocopy ? "zerocopy" : "copy");
+	if(cycles_fd != -1) printf("%8.0f Mcycles/GB ", cyc / gb / 1e6);
+	else printf("%8s Mcycles/GB ", "n/a");
+	printf("%7.1f CPU ms/GB %6.2f GB/s\n", cpu / gb / 1e6, gb / (wall / 1e9));
+out:
+	if(ret) rocksock_error_dprintf(2, &sock);
+	rocksock_disconnect(&sock);
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	static const size_t sizes[] = { 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+	unsigned short port = argc > 1 ? atoi(argv[1]) : 9996;
+	size_t total = (size_t) (argc > 2 ? atoi(argv[2]) : 2048) << 20;
+	struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	int l, one = 1, cycles_fd, ret = 0;
+	unsigned i;
+	char* buf;
+	pid_t pid;
+
+	if(!total || !(buf = malloc(sizes[sizeof sizes / sizeof *sizes - 1]))) return 1;
+	memset(buf, 'x', sizes[sizeof sizes / sizeof *sizes - 1]);
+	if((l = socket(AF_INET, SOCK_STREAM, 0)) == -1) return 1;
+	setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if(bind(l, (void*) &a, sizeof a) == -1 || listen(l, 8) == -1) {
+		perror("bind");
+		return 1;
+	}
+	if(!(pid = fork())) run_receiver(l);
+	close(l);
+
+	if((cycles_fd = open_cycles()) == -1)
+		dprintf(2, "perf counters not accessible, only reporting CPU time\n");
+	for(i = 0; !ret && i < sizeof sizes / sizeof *sizes; i++) {
+		ret = run(port, buf, sizes[i], total, 0, cycles_fd);
+		if(!ret) ret = run(port, buf, sizes[i], total, 1, cycles_fd);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	free(buf);
+	return ret != 0;
+}
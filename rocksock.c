@@ -17,10 +17,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifndef WIN32
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#else
+#define poll WSAPoll
 #endif
 
 
@@ -91,6 +95,14 @@ static int isnumericipv4(const char* ipstring) {
 #define MSG_NOSIGNAL 0
 #endif
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0
+#endif
+
 #ifdef USE_SSL
 #include "rocksock_ssl_internal.h"
 #endif
@@ -109,45 +121,68 @@ int rocksock_seterror(rocksock* sock, rs_errorType errortype, int error, const c
 #define NOERR(S) rocksock_seterror(S, RS_ET_OWN, 0, NULL, 0)
 #define MKSYSERR(S, X) rocksock_seterror(S, RS_ET_SYS, X, ROCKSOCK_FILENAME, __LINE__)
 
+static void set_ports(rs_sockaddr* addrs, int naddrs, unsigned short port) {
+	int i;
+	for(i = 0; i < naddrs; i++) {
+		if(addrs[i].sa.sa_family == AF_INET) addrs[i].v4.sin_port = htons(port);
+		else addrs[i].v6.sin6_port = htons(port);
+	}
+}
+
 //#define NO_DNS_SUPPORT
-static int rocksock_resolve_host(rocksock* sock, rs_hostInfo* hostinfo, rs_resolveStorage* result) {
+/* resolves hostinfo into up to RS_MAX_ADDRS addresses for rocksock_connect to
+   race. the families alternate, starting with the one getaddrinfo put first,
+   as recommended by RFC 8305. */
+static int rocksock_resolve_addrs(rocksock* sock, rs_hostInfo* hostinfo, rs_sockaddr* addrs, int* naddrs) {
+	int ret;
 	if (!sock) return RS_E_NULL;
 	if (!hostinfo || !hostinfo->host[0] || !hostinfo->port) return MKOERR(sock, RS_E_NULL);
-
-	result->hostaddr = &(result->hostaddr_buf);
-
+	*naddrs = 0;
+	if(rs_dns_enabled()) {
+		if((ret = rs_dns_resolve(hostinfo->host, addrs, naddrs)))
+			return rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__);
+		goto set_port;
+	}
+	/* numeric addresses aren't worth caching */
+	int cacheable = !isnumericipv4(hostinfo->host) && !strchr(hostinfo->host, ':');
+	if(cacheable && rs_dnscache_get(hostinfo->host, addrs, naddrs, &ret)) {
+		if(ret) return rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__);
+		goto set_port;
+	}
 #ifndef NO_DNS_SUPPORT
 	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_ADDRCONFIG};
-	int ret;
-	struct addrinfo *best, *save;
+	struct addrinfo *ai[2], *save;
+	int fam;
 	ret = getaddrinfo(hostinfo->host, NULL, &hints, &save);
-	if(!ret) {
-		best = save;
-		while(best->ai_addr->sa_family == AF_INET6 && best->ai_next) best = best->ai_next;
-		*result->hostaddr = *best;
-		result->hostaddr->ai_addr = (struct sockaddr*) &(result->hostaddr_aiaddr_buf);
-		result->hostaddr->ai_next = 0;
-		*result->hostaddr->ai_addr = *best->ai_addr;
-
-		if(result->hostaddr->ai_addr->sa_family == AF_INET)
-			((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_port = htons(hostinfo->port);
-		else
-			((struct sockaddr_in6*) result->hostaddr->ai_addr)->sin6_port = htons(hostinfo->port);
-		freeaddrinfo(save);
-		return 0;
-	} else
+	if(ret) {
+		if(cacheable) rs_dnscache_put(hostinfo->host, addrs, 0, ret, 0);
 		return rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__);
+	}
+	ai[0] = save;
+	for(ai[1] = save; ai[1] && ai[1]->ai_family == save->ai_family; ai[1] = ai[1]->ai_next);
+	for(fam = 0; *naddrs < RS_MAX_ADDRS && (ai[0] || ai[1]); fam = !fam) {
+		if(!ai[fam]) continue;
+		if(ai[fam]->ai_family == AF_INET)
+			addrs[(*naddrs)++].v4 = *(struct sockaddr_in*) ai[fam]->ai_addr;
+		else if(ai[fam]->ai_family == AF_INET6)
+			addrs[(*naddrs)++].v6 = *(struct sockaddr_in6*) ai[fam]->ai_addr;
+		/* advance to the next address of the same family */
+		do ai[fam] = ai[fam]->ai_next;
+		while(ai[fam] && (ai[fam]->ai_family == save->ai_family) == !!fam);
+	}
+	freeaddrinfo(save);
+	if(cacheable) rs_dnscache_put(hostinfo->host, addrs, *naddrs, *naddrs ? 0 : EAI_FAMILY, 0);
+	if(!*naddrs) return rocksock_seterror(sock, RS_ET_GAI, EAI_FAMILY, ROCKSOCK_FILENAME, __LINE__);
 #else
-	result->hostaddr->ai_addr = (struct sockaddr*) &(result->hostaddr_aiaddr_buf);
-
-	((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_port = htons(hostinfo->port);
-	((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_family = AF_INET;
-	result->hostaddr->ai_addr->sa_family = AF_INET;
-	result->hostaddr->ai_addrlen = sizeof(struct sockaddr_in);
-	ipv4fromstring(hostinfo->host, (unsigned char*) &((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_addr);
-
-	return 0;
+	/* without dns, names are only known if they were put in the cache */
+	memset(&addrs[0], 0, sizeof(addrs[0]));
+	addrs[0].v4.sin_family = AF_INET;
+	ipv4fromstring(hostinfo->host, (unsigned char*) &addrs[0].v4.sin_addr);
+	*naddrs = 1;
 #endif
+	set_port:
+	set_ports(addrs, *naddrs, hostinfo->port);
+	return 0;
 }
 
 int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec) {
@@ -156,6 +191,35 @@ int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec) {
 	return NOERR(sock);
 }
 
+int rocksock_set_deadline(rocksock* sock, unsigned long timeout_millisec) {
+	if (!sock) return RS_E_NULL;
+	sock->deadline = timeout_millisec ? rs_now_ms() + timeout_millisec : 0;
+	return NOERR(sock);
+}
+
+int rocksock_set_fastopen(rocksock* sock, int on) {
+	if (!sock) return RS_E_NULL;
+#ifdef TCP_FASTOPEN_CONNECT
+	sock->fastopen = !!on;
+	return NOERR(sock);
+#else
+	if(!on) return NOERR(sock);
+	return MKSYSERR(sock, ENOPROTOOPT);
+#endif
+}
+
+int rocksock_set_pipelining(rocksock* sock, int on) {
+	if (!sock) return RS_E_NULL;
+	sock->pipelining = !!on;
+	return NOERR(sock);
+}
+
+unsigned long long rocksock_deadline(rocksock* sock) {
+	unsigned long long deadline = sock->timeout ? rs_now_ms() + sock->timeout : 0;
+	if(sock->deadline && (!deadline || sock->deadline < deadline)) deadline = sock->deadline;
+	return deadline;
+}
+
 int rocksock_init(rocksock* sock, rs_proxy *proxies) {
 	if (!sock) return RS_E_NULL;
 	memset(sock, 0, sizeof(rocksock));
@@ -166,67 +230,200 @@ int rocksock_init(rocksock* sock, rs_proxy *proxies) {
 	return NOERR(sock);
 }
 
-static struct timeval* make_timeval(struct timeval* tv, unsigned long timeout) {
-	if(!tv) return NULL;
-	tv->tv_sec = timeout / 1000;
-	tv->tv_usec = 1000 * (timeout % 1000);
-	return tv;
+static int poll_events(int want) {
+	return ((want & RS_WANT_READ) ? POLLIN : 0) | ((want & RS_WANT_WRITE) ? POLLOUT : 0);
 }
 
-static int do_connect(rocksock* sock, rs_resolveStorage* hostinfo, unsigned long timeout) {
-	int flags, ret;
-	fd_set wset;
-	struct timeval tv;
-	int optval;
-	socklen_t optlen = sizeof(optval);
+int rs_poll_timeout(unsigned long long deadline) {
+	unsigned long long now;
+	if(!deadline) return -1;
+	now = rs_now_ms();
+	if(now >= deadline) return 0;
+	return deadline - now > INT_MAX ? INT_MAX : (int) (deadline - now);
+}
+
+int rocksock_wait(rocksock* sock, int want, unsigned long long deadline) {
+	struct pollfd pfd = {.fd = sock->socket, .events = poll_events(want)};
+	int ret, wait;
+	/* a fast open connect that was deferred to the first send hasn't even
+	   sent its SYN if the peer is to speak first, an empty send starts it. */
+	if(sock->tfo_deferred && (want & RS_WANT_READ)) {
+		sock->tfo_deferred = 0;
+		send(sock->socket, "", 0, MSG_NOSIGNAL);
+	}
+	/* poll again if it woke up early, or the wait was longer than it takes */
+	while((wait = rs_poll_timeout(deadline))) {
+		if((ret = poll(&pfd, 1, wait)) > 0) return 0;
+		if(ret == -1 && errno != EINTR) return MKSYSERR(sock, errno);
+	}
+	return MKOERR(sock, (want & RS_WANT_READ) ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
+}
 
-	sock->socket = socket(hostinfo->hostaddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if(sock->socket == -1) return MKSYSERR(sock, errno);
+/* states of the connect state machine, rocksock.cs.state */
+enum {
+	CS_NONE = 0,
+	CS_RESOLVE,
+	CS_CONNECT,
+	CS_S4_REQUEST,
+	CS_S4_REPLY,
+	CS_S5_HELLO,
+	CS_S5_METHOD,
+	CS_S5_AUTH,
+	CS_S5_AUTHREPLY,
+	CS_S5_REQUEST,
+	CS_S5_REPLY,
+	CS_S5_ADDR,
+	CS_HTTP_REQUEST,
+	CS_HTTP_REPLY,
+	CS_SSL,
+};
 
-	/* the socket has to be made non-blocking temporarily so we can enforce a connect timeout */
+/* returned by the transfer functions if the socket would block */
+#define CS_AGAIN -1
+/* returned by cs_advance if the connect has to start over without
+   pipelining */
+#define CS_RETRY -2
+
+static int set_nonblocking(rocksock* sock, int on) {
 #ifdef WIN32
-	flags = 1;
-	ret = ioctlsocket(sock->socket, FIONBIO, (u_long*)&flags);
-	if (0 != ret) return ret;
+	u_long flags = on;
+	if(ioctlsocket(sock->socket, FIONBIO, &flags)) return MKSYSERR(sock, WSAGetLastError());
 #else
-	flags = fcntl(sock->socket, F_GETFL);
+	int flags = fcntl(sock->socket, F_GETFL);
 	if(flags == -1) return MKSYSERR(sock, errno);
+	flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if(fcntl(sock->socket, F_SETFL, flags) == -1) return MKSYSERR(sock, errno);
+#endif
+	return 0;
+}
 
-	if(fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK) == -1) return errno;
+/* time after which the next address is tried while the previous attempts
+   are still pending, the "Connection Attempt Delay" of RFC 8305 */
+#ifndef RS_CONNECT_ATTEMPT_DELAY
+#define RS_CONNECT_ATTEMPT_DELAY 250
 #endif
-	ret = connect(sock->socket, hostinfo->hostaddr->ai_addr, hostinfo->hostaddr->ai_addrlen);
-	if(ret == -1) {
-		ret = errno;
-		if (!(ret == EINPROGRESS || ret == EWOULDBLOCK)) return MKSYSERR(sock, ret);
-	}
+
+static void close_fd(int fd) {
 #ifdef WIN32
-	flags = 0;
-	ret = ioctlsocket(sock->socket, FIONBIO, (u_long*)&flags);
-	if (0 != ret) return ret;
+	closesocket(fd);
 #else
-	if(fcntl(sock->socket, F_SETFL, flags) == -1) return MKSYSERR(sock, errno);
+	close(fd);
 #endif
-	FD_ZERO(&wset);
-	FD_SET(sock->socket, &wset);
+}
 
-	ret = select(sock->socket+1, NULL, &wset, NULL, timeout ? make_timeval(&tv, timeout) : NULL);
+/* starts a connection attempt to the next address. returns 0 if connected,
+   CS_AGAIN if in progress, or an errno value */
+static int do_connect(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	rs_sockaddr* addr = &cs->addrs[cs->nextaddr];
+	int ret;
 
-	if(ret == 1 && FD_ISSET(sock->socket, &wset)) {
-		ret = getsockopt(sock->socket, SOL_SOCKET, SO_ERROR, &optval,&optlen);
-		if(ret == -1) return MKSYSERR(sock, errno);
-		else if(optval) return MKSYSERR(sock, optval);
-		return 0;
-	} else if(ret == 0) return MKOERR(sock, RS_E_HIT_CONNECTTIMEOUT);
+	cs->nextattempt = rs_now_ms() + RS_CONNECT_ATTEMPT_DELAY;
+	sock->socket = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	cs->fds[cs->nextaddr++] = sock->socket;
+	if(sock->socket == -1) return errno;
+
+	/* the socket is non-blocking until the connect is complete */
+	if(set_nonblocking(sock, 1)) return sock->lasterror.error;
+#ifdef TCP_FASTOPEN_CONNECT
+	/* with a cookie for the address cached, connect() returns 0 without
+	   sending anything and the first send goes out with the SYN. kernels
+	   without the option just do a normal connect. */
+	if(sock->fastopen) {
+		int one = 1;
+		setsockopt(sock->socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+	}
+#endif
+	ret = connect(sock->socket, &addr->sa, addr->sa.sa_family == AF_INET ? sizeof(addr->v4) : sizeof(addr->v6));
+	if(ret == -1) {
+		ret = errno;
+		if (!(ret == EINPROGRESS || ret == EWOULDBLOCK)) return ret;
+		return CS_AGAIN;
+	}
+	sock->tfo_deferred = sock->fastopen;
+	return 0;
+}
+
+/* closes the connection attempts except the one on fd keep */
+static void cs_close_attempts(rocksock* sock, int keep) {
+	rs_connectState* cs = &sock->cs;
+	int i;
+	for(i = 0; i < cs->nextaddr; i++)
+		if(cs->fds[i] != -1 && cs->fds[i] != keep) close_fd(cs->fds[i]);
+	cs->nextaddr = cs->naddrs = 0;
+}
+
+/* number of connection attempts in flight, sock->socket is set to the
+   latest one */
+static int cs_pending(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	int i, n = 0;
+	for(i = 0; i < cs->nextaddr; i++)
+		if(cs->fds[i] != -1) {
+			sock->socket = cs->fds[i];
+			n++;
+		}
+	return n;
+}
+
+/* checks the connection attempts in flight and starts the next one if the
+   others failed or the attempt delay passed. revents are the events of
+   sock->socket, the latest attempt. the earlier ones aren't watched by the
+   caller, so they are only polled when something happened or the attempt
+   delay passed. returns 0 once one of them is connected, CS_AGAIN while
+   waiting, or an error if all of them failed. */
+static int cs_race(rocksock* sock, int revents) {
+	rs_connectState* cs = &sock->cs;
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int i, ret, optval, n = cs_pending(sock);
+	socklen_t optlen;
+	unsigned long long now = rs_now_ms();
 
-	return MKSYSERR(sock, errno);
+	/* fds of failed attempts are -1 and ignored by poll */
+	for(i = 0; i < cs->nextaddr; i++) {
+		pfd[i].fd = cs->fds[i];
+		pfd[i].events = POLLOUT;
+		pfd[i].revents = (revents && cs->fds[i] == sock->socket) ? POLLOUT : 0;
+	}
+	if(n > 1 && (revents || now >= cs->nextattempt)) {
+		if(poll(pfd, cs->nextaddr, 0) == -1 && errno != EINTR) return MKSYSERR(sock, errno);
+		/* all addresses are in flight, look again after the delay */
+		if(cs->nextaddr == cs->naddrs) cs->nextattempt = now + RS_CONNECT_ATTEMPT_DELAY;
+	}
+	for(i = 0; i < cs->nextaddr; i++) {
+		if(cs->fds[i] == -1 || !pfd[i].revents) continue;
+		optlen = sizeof(optval);
+		if(getsockopt(cs->fds[i], SOL_SOCKET, SO_ERROR, (void*) &optval, &optlen) == -1)
+			optval = errno;
+		if(!optval) goto won;
+		cs->err = optval;
+		close_fd(cs->fds[i]);
+		cs->fds[i] = -1;
+	}
+	while(cs->nextaddr < cs->naddrs && (!cs_pending(sock) || rs_now_ms() >= cs->nextattempt)) {
+		i = cs->nextaddr;
+		ret = do_connect(sock);
+		if(!ret) goto won;
+		if(ret == CS_AGAIN) break;
+		cs->err = ret;
+		if(cs->fds[i] != -1) close_fd(cs->fds[i]);
+		cs->fds[i] = -1;
+	}
+	if(cs_pending(sock)) return CS_AGAIN;
+	sock->socket = -1;
+	return MKSYSERR(sock, cs->err);
+	won:
+	sock->socket = cs->fds[i];
+	cs_close_attempts(sock, sock->socket);
+	return 0;
 }
 
-static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer, rs_proxy* proxy, size_t* bytesused) {
+static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer, rs_hostInfo* target, size_t* bytesused) {
 	int ret;
 	buffer[0] = 4;
 	buffer[1] = 1;
-	buffer[2] = proxy->hostinfo.port / 256;
-	buffer[3] = proxy->hostinfo.port % 256;
+	buffer[2] = target->port / 256;
+	buffer[3] = target->port % 256;
 
 	if(is4a) {
 		buffer[4] = 0;
@@ -234,120 +431,175 @@ static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer,
 		buffer[6] = 0;
 		buffer[7] = 1;
 	} else {
-		rs_resolveStorage stor;
-		ret = rocksock_resolve_host(sock, &proxy->hostinfo, &stor);
+		rs_sockaddr addrs[RS_MAX_ADDRS];
+		int i, n;
+		ret = rocksock_resolve_addrs(sock, target, addrs, &n);
 		if(ret) return ret;
-		if(stor.hostaddr->ai_family != AF_INET)
+		for(i = 0; i < n && addrs[i].sa.sa_family != AF_INET; i++);
+		if(i == n)
 			return MKOERR(sock, RS_E_SOCKS4_NO_IP6);
-		buffer[4] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[0];
-		buffer[5] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[1];
-		buffer[6] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[2];
-		buffer[7] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[3];
+		memcpy(buffer + 4, &addrs[i].v4.sin_addr.s_addr, 4);
 	}
 	buffer[8] = 0;
 	*bytesused = 9;
 	if(is4a) {
 		char *p = buffer + *bytesused;
-		size_t l = strlen(proxy->hostinfo.host) + 1;
+		size_t l = strlen(target->host) + 1;
 		/* memcpy is safe because all functions accepting a hostname check it's < 255 */
-		memcpy(p, proxy->hostinfo.host, l);
+		memcpy(p, target->host, l);
 		*bytesused += l;
 	}
 	return NOERR(sock);
 }
 
-int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL) {
-	ptrdiff_t px;
-	int ret, trysocksv4a;
-	rs_hostInfo targethost;
-	rs_hostInfo* connector;
-	rs_proxy dummy;
-	rs_proxy* targetproxy;
-	char socksdata[768];
-	char* p;
-	size_t socksused = 0, bytes;
-	if (!sock) return RS_E_NULL;
-	if (!host || !port)
-		return MKOERR(sock, RS_E_NULL);
-	size_t hl = strlen(host);
-	if(hl > 255)
-		return MKOERR(sock, RS_E_HOSTNAME_TOO_LONG);
-#ifndef USE_SSL
-	if (useSSL) return MKOERR(sock, RS_E_NO_SSL);
-#endif
-	memcpy(targethost.host, host, hl+1);
-	targethost.port = port;
+/* the host the current proxy has to connect to */
+static rs_hostInfo* cs_nexthost(rocksock* sock) {
+	if(sock->cs.px == sock->lastproxy) return &sock->cs.target;
+	return &sock->proxies[sock->cs.px + 1].hostinfo;
+}
 
-	if(sock->lastproxy >= 0)
-		connector = &sock->proxies[0].hostinfo;
-	else
-		connector = &targethost;
+/* sets up the next transfer of len bytes of cs.buf */
+static void cs_expect(rocksock* sock, int state, size_t len, int want) {
+	sock->cs.state = state;
+	sock->cs.pos = 0;
+	sock->cs.len = len;
+	sock->cs.want = want;
+}
 
-	rs_resolveStorage stor;
+int rs_is_target_error(rocksock* sock) {
+	if(sock->lasterror.errortype != RS_ET_OWN) return 0;
+	switch(sock->lasterror.error) {
+		case RS_E_TARGETPROXY_CONNECT_FAILED: case RS_E_TARGETPROXY_NET_UNREACHABLE:
+		case RS_E_TARGETPROXY_HOST_UNREACHABLE: case RS_E_TARGETPROXY_CONN_REFUSED:
+		case RS_E_TARGETPROXY_TTL_EXPIRED:
+			return 1;
+		default:
+			return 0;
+	}
+}
 
-	ret = rocksock_resolve_host(sock, connector, &stor);
-	if(ret) {
-		check_proxy0_failure:
-		if(sock->lastproxy >= 0) sock->lasterror.failedProxy = 0;
-		return ret;
+/* ends the connect with error ret, blaming the proxy being talked to */
+static int cs_fail(rocksock* sock, int ret) {
+	if(sock->lastproxy >= 0 && sock->cs.px <= sock->lastproxy) {
+		sock->lasterror.failedProxy = sock->cs.px;
+		/* what it was thought to support may have been wrong */
+		/* a target error says nothing about its capabilities */
+		if(sock->cs.cachedcaps && !rs_is_target_error(sock))
+			rs_proxycache_drop(&sock->proxies[sock->cs.px].hostinfo);
 	}
+	if(sock->cs.state == CS_CONNECT) cs_close_attempts(sock, sock->socket);
+	else if(sock->cs.state == CS_RESOLVE) {
+		rocksock_dns_cancel(&sock->cs.dns);
+		sock->socket = -1;
+	}
+	sock->cs.state = CS_NONE;
+	sock->cs.want = 0;
+	return ret;
+}
 
-	ret = do_connect(sock, &stor, sock->timeout);
-	if(ret) goto check_proxy0_failure;
+static int cs_finish(rocksock* sock) {
+	sock->cs.state = CS_NONE;
+	sock->cs.want = 0;
+	/* the socket stays non-blocking, rocksock_send/recv poll when needed */
+	return NOERR(sock);
+}
 
-	for(px = 0; px <= sock->lastproxy; px++) {
-		if(px == sock->lastproxy) {
-			targetproxy = &dummy;
-			dummy.hostinfo = targethost;
-			dummy.password[0] = 0;
-			dummy.username[0] = 0;
-			dummy.proxytype = RS_PT_NONE;
-		} else {
-			targetproxy = &sock->proxies[px + 1];
-		}
-		// send socks connection data
-		switch(sock->proxies[px].proxytype) {
+static int cs_socks4_request(rocksock* sock) {
+	size_t len;
+	int ret = rocksock_setup_socks4_header(sock, sock->cs.trysocksv4a, sock->cs.buf, cs_nexthost(sock), &len);
+	if(ret) return ret;
+	cs_expect(sock, CS_S4_REQUEST, len, RS_WANT_WRITE);
+	return 0;
+}
+
+/* puts the request at offset off of cs.buf, after what's to be sent with it */
+static int cs_socks5_request(rocksock* sock, size_t off) {
+	rs_hostInfo* target = cs_nexthost(sock);
+	char* p = sock->cs.buf + off;
+	size_t bytes;
+	*p++ = 5;
+	*p++ = 1;
+	*p++ = 0;
+	if(isnumericipv4(target->host)) {
+		*p++ = 1; // ipv4 method
+		bytes = 4;
+		ipv4fromstring(target->host, (unsigned char*) p);
+	} else {
+		*p++ = 3; //hostname method, requires the server to do dns lookups.
+		bytes = strlen(target->host);
+		if(bytes > 255)
+			return MKOERR(sock, RS_E_SOCKS5_AUTH_EXCEEDSIZE);
+		*p++ = bytes;
+		memcpy(p, target->host, bytes);
+	}
+	p+=bytes;
+	*p++ = target->port / 256;
+	*p++ = target->port % 256;
+	cs_expect(sock, CS_S5_REQUEST, p - sock->cs.buf, RS_WANT_WRITE);
+	return 0;
+}
+
+static int has_auth(rs_proxy* proxy) {
+	return proxy->username[0] && proxy->password[0];
+}
+
+/* writes the username/password authentication to p, returns its end */
+static char* socks5_auth(rs_proxy* proxy, char* p) {
+	/*
+	+----+------+----------+------+----------+
+	|VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+	+----+------+----------+------+----------+
+	| 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+	+----+------+----------+------+----------+
+	*/
+	size_t bytes;
+	*p++ = 1;
+	bytes = strlen(proxy->username);
+	*p++ = bytes;
+	memcpy(p, proxy->username, bytes);
+	p += bytes;
+	bytes = strlen(proxy->password);
+	*p++ = bytes;
+	memcpy(p, proxy->password, bytes);
+	return p + bytes;
+}
+
+/* sends greeting, authentication and request at once. only the method the
+   rest is made for is offered, so the proxy can't pick another one and take
+   the authentication for the request. */
+static int cs_socks5_pipeline(rocksock* sock, rs_proxy* proxy) {
+	rs_connectState* cs = &sock->cs;
+	char* p = cs->buf;
+	int ret;
+	/* with credentials, unless the proxy is known to do without */
+	cs->method = has_auth(proxy) && !(cs->caps & RS_PC_NOAUTH) ? 2 : 0;
+	*p++ = 5;
+	*p++ = 1;
+	*p++ = cs->method;
+	if(cs->method) p = socks5_auth(proxy, p);
+	if((ret = cs_socks5_request(sock, p - cs->buf))) return ret;
+	cs->state = CS_S5_HELLO;
+	return 0;
+}
+
+/* starts the handshake with proxy cs.px, or whatever comes after the chain */
+static int cs_hop(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	rs_proxy* proxy;
+	char* p;
+	for(; cs->px <= sock->lastproxy; cs->px++) {
+		proxy = &sock->proxies[cs->px];
+		cs->caps = cs->cachedcaps = proxy->proxytype == RS_PT_HTTP ? 0 : rs_proxycache_get(&proxy->hostinfo);
+		switch(proxy->proxytype) {
 			case RS_PT_SOCKS4:
-				trysocksv4a = 1;
-				trysocks4:
-				ret = rocksock_setup_socks4_header(sock, trysocksv4a, socksdata, targetproxy, &socksused);
-				if(ret) {
-					proxyfailure:
-					sock->lasterror.failedProxy = px;
-					return ret;
-				}
-				ret = rocksock_send(sock, socksdata, socksused, 0, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, 8, 8, &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 8 || socksdata[0] != 0) {
-					err_unexpected:
-					ret = MKOERR(sock, RS_E_PROXY_UNEXPECTED_RESPONSE);
-					goto proxyfailure;
-				}
-				switch(socksdata[1]) {
-					case 0x5a:
-						break;
-					case 0x5b:
-						if(trysocksv4a) {
-							trysocksv4a = 0;
-							goto trysocks4;
-						}
-						err_proxyconnect:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_CONNECT_FAILED);
-						goto proxyfailure;
-					case 0x5c: case 0x5d:
-						err_proxyauth:
-						ret = MKOERR(sock, RS_E_PROXY_AUTH_FAILED);
-						goto proxyfailure;
-					default:
-						goto err_unexpected;
-				}
-				break;
+				cs->trysocksv4a = !(cs->caps & RS_PC_SOCKS4);
+				return cs_socks4_request(sock);
 			case RS_PT_SOCKS5:
-				p = socksdata;
+				cs->pipelined = sock->pipelining && !cs->strict && !(cs->caps & RS_PC_STRICT);
+				if(cs->pipelined) return cs_socks5_pipeline(sock, proxy);
+				p = cs->buf;
 				*p++ = 5;
-				if(sock->proxies[px].username[0] && sock->proxies[px].password[0]) {
+				if(has_auth(proxy)) {
 					*p++ = 2;
 					*p++ = 0;
 					*p++ = 2;
@@ -355,189 +607,454 @@ int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int
 					*p++ = 1;
 					*p++ = 0;
 				}
-				bytes = p - socksdata;
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, 2, 2, &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 2 || socksdata[0] != 5) goto err_unexpected;
-				if(socksdata[1] == '\xff') {
-					goto err_proxyauth;
-				} else if (socksdata[1] == 2) {
-					if(sock->proxies[px].username[0] && sock->proxies[px].password[0]) {
-						/*
-						+----+------+----------+------+----------+
-						|VER | ULEN |  UNAME   | PLEN |  PASSWD  |
-						+----+------+----------+------+----------+
-						| 1  |  1   | 1 to 255 |  1   | 1 to 255 |
-						+----+------+----------+------+----------+
-						*/
-						p = socksdata;
-						*p++ = 1;
-						bytes = strlen(sock->proxies[px].username);
-						*p++ = bytes;
-						memcpy(p, sock->proxies[px].username, bytes);
-						p += bytes;
-						bytes = strlen(sock->proxies[px].password);
-						*p++ = bytes;
-						memcpy(p, sock->proxies[px].password, bytes);
-						p += bytes;
-						bytes = p - socksdata;
-						ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-						if(ret) goto proxyfailure;
-						ret = rocksock_recv(sock, socksdata, 2, 2, &bytes);
-						if(ret) goto proxyfailure;
-						if(bytes < 2) goto err_unexpected;
-						else if(socksdata[1] != 0) goto err_proxyauth;
-					} else {
-						goto err_proxyauth;
-					}
-				}
-				p = socksdata;
-				*p++ = 5;
-				*p++ = 1;
-				*p++ = 0;
-				if(isnumericipv4(targetproxy->hostinfo.host)) {
-					*p++ = 1; // ipv4 method
-					bytes = 4;
-					ipv4fromstring(targetproxy->hostinfo.host, (unsigned char*) p);
-				} else {
-					*p++ = 3; //hostname method, requires the server to do dns lookups.
-					bytes = strlen(targetproxy->hostinfo.host);
-					if(bytes > 255)
-						return MKOERR(sock, RS_E_SOCKS5_AUTH_EXCEEDSIZE);
-					*p++ = bytes;
-					memcpy(p, targetproxy->hostinfo.host, bytes);
-				}
-				p+=bytes;
-				*p++ = targetproxy->hostinfo.port / 256;
-				*p++ = targetproxy->hostinfo.port % 256;
-				bytes = p - socksdata;
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, sizeof(socksdata), sizeof(socksdata), &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 2) goto err_unexpected;
-				switch(socksdata[1]) {
-					case 0:
-						break;
-					case 1:
-						ret = MKOERR(sock, RS_E_PROXY_GENERAL_FAILURE);
-						goto proxyfailure;
-					case 2:
-						goto err_proxyauth;
-					case 3:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_NET_UNREACHABLE);
-						goto proxyfailure;
-					case 4:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_HOST_UNREACHABLE);
-						goto proxyfailure;
-					case 5:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_CONN_REFUSED);
-						goto proxyfailure;
-					case 6:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_TTL_EXPIRED);
-						goto proxyfailure;
-					case 7:
-						ret = MKOERR(sock, RS_E_PROXY_COMMAND_NOT_SUPPORTED);
-						goto proxyfailure;
-					case 8:
-						ret = MKOERR(sock, RS_E_PROXY_ADDRESSTYPE_NOT_SUPPORTED);
-						goto proxyfailure;
-					default:
-						goto err_unexpected;
-				}
-				break;
+				cs_expect(sock, CS_S5_HELLO, p - cs->buf, RS_WANT_WRITE);
+				return 0;
 			case RS_PT_HTTP:
-				bytes = snprintf(socksdata, sizeof(socksdata), "CONNECT %s:%d HTTP/1.1\r\n\r\n", targetproxy->hostinfo.host, targetproxy->hostinfo.port);
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, sizeof(socksdata), sizeof(socksdata), &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 12) goto err_unexpected;
-				if(socksdata[9] != '2') goto err_proxyconnect;
-				break;
+				cs_expect(sock, CS_HTTP_REQUEST,
+				          snprintf(cs->buf, sizeof(cs->buf), "CONNECT %s:%d HTTP/1.1\r\n\r\n",
+				                   cs_nexthost(sock)->host, cs_nexthost(sock)->port),
+				          RS_WANT_WRITE);
+				return 0;
 			default:
 				break;
 		}
 	}
-
 #ifdef USE_SSL
-	if(useSSL) {
-		ret = rocksock_ssl_connect_fd(sock);
-		if(ret) return ret;
+	if(cs->useSSL) {
+		cs->state = CS_SSL;
+		return 0;
+	}
+#endif
+	return cs_finish(sock);
+}
+
+/* receives the reply of a HTTP proxy, without reading past its end */
+static ptrdiff_t cs_http_recv(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	ptrdiff_t n = recv(sock->socket, cs->buf + cs->pos, cs->len - cs->pos, MSG_PEEK);
+	size_t i;
+	if(n <= 0) return n;
+	/* the end of the header may start in data we already have */
+	for(i = cs->pos > 3 ? cs->pos - 3 : 0; i + 4 <= cs->pos + n; i++)
+		if(!memcmp(cs->buf + i, "\r\n\r\n", 4)) {
+			cs->len = i + 4;
+			n = cs->len - cs->pos;
+			break;
+		}
+	return recv(sock->socket, cs->buf + cs->pos, n, 0);
+}
+
+/* transfers the rest of cs.buf. returns 0 when done, CS_AGAIN if the socket
+   would block, or an error */
+static int cs_transfer(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	ptrdiff_t n;
+	while(cs->pos < cs->len) {
+		if(cs->want == RS_WANT_WRITE)
+			n = send(sock->socket, cs->buf + cs->pos, cs->len - cs->pos, MSG_NOSIGNAL);
+		else if(cs->state == CS_HTTP_REPLY)
+			n = cs_http_recv(sock);
+		else
+			n = recv(sock->socket, cs->buf + cs->pos, cs->len - cs->pos, 0);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return CS_AGAIN;
+			return MKSYSERR(sock, errno);
+		}
+		if(!n) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+		cs->pos += n;
 	}
+	return 0;
+}
+
+/* notes the SOCKS5 method the proxy picked */
+static void cs_method(rocksock* sock, int method) {
+	sock->cs.caps = (sock->cs.caps & ~(RS_PC_NOAUTH | RS_PC_AUTH)) | (method == 2 ? RS_PC_AUTH : RS_PC_NOAUTH);
+}
+
+/* handles the completed transfer and sets up the next one */
+static int cs_advance(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	rs_proxy* proxy = &sock->proxies[cs->px];
+	switch(cs->state) {
+		case CS_S4_REQUEST:
+			cs_expect(sock, CS_S4_REPLY, 8, RS_WANT_READ);
+			return 0;
+		case CS_S4_REPLY:
+			if(cs->buf[0] != 0) goto err_unexpected;
+			switch(cs->buf[1]) {
+				case 0x5a:
+					goto next_hop;
+				case 0x5b:
+					if(cs->trysocksv4a) {
+						/* remembered once plain SOCKS4 worked */
+						cs->caps |= RS_PC_SOCKS4;
+						cs->trysocksv4a = 0;
+						return cs_socks4_request(sock);
+					}
+					err_proxyconnect:
+					return MKOERR(sock, RS_E_TARGETPROXY_CONNECT_FAILED);
+				case 0x5c: case 0x5d:
+					err_proxyauth:
+					return MKOERR(sock, RS_E_PROXY_AUTH_FAILED);
+				default:
+					goto err_unexpected;
+			}
+		case CS_S5_HELLO:
+			cs_expect(sock, CS_S5_METHOD, 2, RS_WANT_READ);
+			return 0;
+		case CS_S5_METHOD:
+			if(cs->buf[0] != 5) goto err_unexpected;
+			if(cs->pipelined) {
+				/* what follows was sent already, the replies are read in turn */
+				if(cs->buf[1] == cs->method) {
+					cs_method(sock, cs->method);
+					cs_expect(sock, cs->method ? CS_S5_AUTH : CS_S5_REQUEST, 0, RS_WANT_WRITE);
+					return 0;
+				}
+				/* it may do without authentication, which wasn't offered */
+				if(has_auth(proxy)) return CS_RETRY;
+				if(cs->buf[1] == '\xff' || cs->buf[1] == 2) goto err_proxyauth;
+				goto err_unexpected;
+			}
+			if(cs->buf[1] == '\xff') {
+				goto err_proxyauth;
+			}
+			cs_method(sock, cs->buf[1]);
+			if (cs->buf[1] == 2) {
+				if(!has_auth(proxy)) goto err_proxyauth;
+				cs_expect(sock, CS_S5_AUTH, socks5_auth(proxy, cs->buf) - cs->buf, RS_WANT_WRITE);
+				return 0;
+			}
+			return cs_socks5_request(sock, 0);
+		case CS_S5_AUTH:
+			cs_expect(sock, CS_S5_AUTHREPLY, 2, RS_WANT_READ);
+			return 0;
+		case CS_S5_AUTHREPLY:
+			if(cs->buf[1] != 0) goto err_proxyauth;
+			if(cs->pipelined) {
+				cs_expect(sock, CS_S5_REQUEST, 0, RS_WANT_WRITE);
+				return 0;
+			}
+			return cs_socks5_request(sock, 0);
+		case CS_S5_REQUEST:
+			cs_expect(sock, CS_S5_REPLY, 2, RS_WANT_READ);
+			return 0;
+		case CS_S5_REPLY:
+			switch(cs->buf[1]) {
+				case 0:
+					/* read the bound address too, up to its first byte which
+					   tells the length of a hostname */
+					cs->state = CS_S5_ADDR;
+					cs->len = 5;
+					return 0;
+				case 1:
+					return MKOERR(sock, RS_E_PROXY_GENERAL_FAILURE);
+				case 2:
+					goto err_proxyauth;
+				case 3:
+					return MKOERR(sock, RS_E_TARGETPROXY_NET_UNREACHABLE);
+				case 4:
+					return MKOERR(sock, RS_E_TARGETPROXY_HOST_UNREACHABLE);
+				case 5:
+					return MKOERR(sock, RS_E_TARGETPROXY_CONN_REFUSED);
+				case 6:
+					return MKOERR(sock, RS_E_TARGETPROXY_TTL_EXPIRED);
+				case 7:
+					return MKOERR(sock, RS_E_PROXY_COMMAND_NOT_SUPPORTED);
+				case 8:
+					return MKOERR(sock, RS_E_PROXY_ADDRESSTYPE_NOT_SUPPORTED);
+				default:
+					goto err_unexpected;
+			}
+		case CS_S5_ADDR:
+			if(cs->len == 5) {
+				switch(cs->buf[3]) {
+					case 1: cs->len = 4 + 4 + 2; break;
+					case 3: cs->len = 4 + 1 + (unsigned char) cs->buf[4] + 2; break;
+					case 4: cs->len = 4 + 16 + 2; break;
+					default: goto err_unexpected;
+				}
+				return 0;
+			}
+			goto next_hop;
+		case CS_HTTP_REQUEST:
+			cs_expect(sock, CS_HTTP_REPLY, sizeof(cs->buf), RS_WANT_READ);
+			return 0;
+		case CS_HTTP_REPLY:
+			if(cs->len < 12 || memcmp(cs->buf + cs->len - 4, "\r\n\r\n", 4)) goto err_unexpected;
+			if(cs->buf[9] != '2') goto err_proxyconnect;
+			goto next_hop;
+		default:
+			return MKOERR(sock, RS_E_NULL);
+	}
+	err_unexpected:
+	return MKOERR(sock, RS_E_PROXY_UNEXPECTED_RESPONSE);
+	next_hop:
+	if(cs->caps != cs->cachedcaps) rs_proxycache_put(&proxy->hostinfo, cs->caps);
+	cs->px++;
+	return cs_hop(sock);
+}
+
+/* the host the tcp connection goes to */
+static rs_hostInfo* cs_connector(rocksock* sock) {
+	if(sock->lastproxy >= 0) return &sock->proxies[0].hostinfo;
+	return &sock->cs.target;
+}
+
+static int cs_begin(rocksock* sock);
+
+int rocksock_connect_start(rocksock* sock, const char* host, unsigned short port, int useSSL) {
+	rs_connectState* cs;
+	int ret;
+	if (!sock) return RS_E_NULL;
+	cs = &sock->cs;
+	cs->state = CS_NONE;
+	cs->want = 0;
+	if (!host || !port)
+		return MKOERR(sock, RS_E_NULL);
+	size_t hl = strlen(host);
+	if(hl > 255)
+		return MKOERR(sock, RS_E_HOSTNAME_TOO_LONG);
+#ifndef USE_SSL
+	if (useSSL) return MKOERR(sock, RS_E_NO_SSL);
+#endif
+	memcpy(cs->target.host, host, hl+1);
+	cs->target.port = port;
+	cs->useSSL = useSSL;
+	cs->strict = 0;
+	if((ret = cs_begin(sock))) return ret;
+	return rocksock_connect_step(sock, 0);
+}
+
+/* starts with the lookup or the tcp connect of proxy 0 or the target */
+static int cs_begin(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	int ret;
+	cs->px = 0;
+	cs->cachedcaps = 0;
+	if(rs_dns_enabled()) {
+		/* the lookup becomes the first step */
+		if((ret = rocksock_dns_start(&cs->dns, cs_connector(sock)->host)))
+			return cs_fail(sock, rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__));
+		cs_expect(sock, CS_RESOLVE, 0, RS_WANT_READ);
+	} else {
+		ret = rocksock_resolve_addrs(sock, cs_connector(sock), cs->addrs, &cs->naddrs);
+		if(ret) return cs_fail(sock, ret);
+		cs->nextaddr = 0;
+		cs_expect(sock, CS_CONNECT, 0, RS_WANT_WRITE);
+	}
+	return 0;
+}
+
+/* a proxy that didn't pick the method offered with the pipelined handshake,
+   or hung up on it, gets a new connection with the requests one by one */
+static int cs_retry(rocksock* sock) {
+	close_fd(sock->socket);
+	sock->socket = -1;
+	sock->cs.strict = 1;
+	return cs_begin(sock);
+}
+
+static int cs_timeout(rocksock* sock) {
+	rs_connectState* cs = &sock->cs;
+	unsigned long long now;
+	if(cs->state == CS_RESOLVE) return rocksock_dns_timeout(&cs->dns);
+	if(cs->state != CS_CONNECT) return -1;
+	/* the attempts but the latest are only noticed when polled */
+	if(cs->nextaddr < cs->naddrs || cs_pending(sock) > 1) {
+		now = rs_now_ms();
+		return now >= cs->nextattempt ? 0 : cs->nextattempt - now;
+	}
+	return -1;
+}
+
+/* the error of a connect that ran out of time in its current state */
+static int cs_timeout_error(rocksock* sock) {
+	switch(sock->cs.state) {
+		case CS_RESOLVE: case CS_CONNECT: case CS_SSL:
+			return MKOERR(sock, RS_E_HIT_CONNECTTIMEOUT);
+		default:
+			return MKOERR(sock, sock->cs.want == RS_WANT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
+	}
+}
+
+int rocksock_connect_timeout(rocksock* sock) {
+	int timeout, left;
+	if (!sock || !sock->cs.state) return -1;
+	timeout = cs_timeout(sock);
+	if(sock->deadline) {
+		left = rs_poll_timeout(sock->deadline);
+		if(timeout == -1 || left < timeout) timeout = left;
+	}
+	return timeout;
+}
+
+int rocksock_connect_want(rocksock* sock) {
+	if (!sock) return 0;
+	return sock->cs.want;
+}
+
+int rocksock_connect_step(rocksock* sock, int revents) {
+	rs_connectState* cs;
+	int ret;
+	if (!sock) return RS_E_NULL;
+	cs = &sock->cs;
+	if(cs->state != CS_NONE && sock->deadline && rs_now_ms() >= sock->deadline)
+		return cs_fail(sock, cs_timeout_error(sock));
+	switch(cs->state) {
+		case CS_NONE:
+			return NOERR(sock);
+		case CS_RESOLVE:
+			if((ret = rocksock_dns_step(&cs->dns)))
+				return cs_fail(sock, rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__));
+			if(rocksock_dns_timeout(&cs->dns) != -1) {
+				sock->socket = cs->dns.fd;
+				return NOERR(sock);
+			}
+			sock->socket = -1;
+			cs->naddrs = cs->dns.naddrs;
+			memcpy(cs->addrs, cs->dns.addrs, cs->naddrs * sizeof(*cs->addrs));
+			set_ports(cs->addrs, cs->naddrs, cs_connector(sock)->port);
+			cs->nextaddr = 0;
+			cs_expect(sock, CS_CONNECT, 0, RS_WANT_WRITE);
+			/* fall through */
+		case CS_CONNECT:
+			ret = cs_race(sock, revents);
+			if(ret == CS_AGAIN) return NOERR(sock);
+			if(ret || (ret = cs_hop(sock))) return cs_fail(sock, ret);
+			break;
+		default:
+			break;
+	}
+	/* proceed as far as the socket lets us without blocking */
+	while(cs->state != CS_NONE) {
+#ifdef USE_SSL
+		if(cs->state == CS_SSL) {
+			if((ret = rocksock_ssl_connect_step(sock, &cs->want))) return cs_fail(sock, ret);
+			if(cs->want) return NOERR(sock);
+			return cs_finish(sock);
+		}
 #endif
+		ret = cs_transfer(sock);
+		if(ret == CS_AGAIN) return NOERR(sock);
+		if(ret && cs->pipelined && cs->state == CS_S5_METHOD) {
+			/* it hung up on the pipelined handshake */
+			rs_proxycache_put(&sock->proxies[cs->px].hostinfo, cs->caps | RS_PC_STRICT);
+			ret = CS_RETRY;
+		}
+		if(!ret) ret = cs_advance(sock);
+		if(ret == CS_RETRY) {
+			if((ret = cs_retry(sock))) return cs_fail(sock, ret);
+			return rocksock_connect_step(sock, 0);
+		}
+		if(ret) return cs_fail(sock, ret);
+	}
 	return NOERR(sock);
 }
 
+int rocksock_connect_poll(rocksock* sock, unsigned long long deadline) {
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int ret, want, i, n = 0, wait;
+	want = rocksock_connect_want(sock);
+	if(sock->cs.state == CS_CONNECT) {
+		for(i = 0; i < sock->cs.nextaddr; i++)
+			if(sock->cs.fds[i] != -1) {
+				pfd[n].fd = sock->cs.fds[i];
+				pfd[n++].events = POLLOUT;
+			}
+	} else {
+		pfd[n].fd = sock->socket;
+		pfd[n++].events = poll_events(want);
+	}
+	wait = rs_poll_timeout(deadline);
+	i = cs_timeout(sock);
+	if(i != -1 && (wait == -1 || i < wait)) wait = i;
+	ret = poll(pfd, n, wait);
+	if(ret == -1) {
+		if(errno == EINTR) return 0;
+		return cs_fail(sock, MKSYSERR(sock, errno));
+	} else if(!ret && deadline && rs_now_ms() >= deadline)
+		return cs_fail(sock, cs_timeout_error(sock));
+	return rocksock_connect_step(sock, ret ? want : 0);
+}
+
+int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL) {
+	unsigned long long deadline;
+	int ret;
+
+	/* the timeout covers the whole connect: the lookup, all attempts of the
+	   tcp connect, the proxy hops and the SSL handshake */
+	deadline = rocksock_deadline(sock);
+	ret = rocksock_connect_start(sock, host, port, useSSL);
+	while(!ret && rocksock_connect_want(sock))
+		ret = rocksock_connect_poll(sock, deadline);
+	return ret;
+}
+
+int rocksock_connect_deadline(rocksock* sock, const char* host, unsigned short port, int useSSL, unsigned long timeout_millisec) {
+	int ret;
+	if((ret = rocksock_set_deadline(sock, timeout_millisec))) return ret;
+	return rocksock_connect(sock, host, port, useSSL);
+}
+
 typedef enum  {
 	RS_OT_SEND = 0,
 	RS_OT_READ
 } rs_operationType;
 
-static int rocksock_operation(rocksock* sock, rs_operationType operation, char* buffer, size_t bufsize, size_t chunksize, size_t* bytes) {
+/* the socket is non-blocking, so the transfer is tried right away and
+   poll() is only used to wait when it would block */
+/* flags are extra flags for send() */
+static int rocksock_operation(rocksock* sock, rs_operationType operation, char* buffer, size_t bufsize, size_t chunksize, size_t* bytes, int flags) {
 	if (!sock) return RS_E_NULL;
 	if (!buffer || !bytes || (!bufsize && operation == RS_OT_READ)) return MKOERR(sock, RS_E_NULL);
 	*bytes = 0;
-	struct timeval tv;
-	fd_set fd;
-	fd_set* rfd = NULL;
-	fd_set* wfd = NULL;
-	int ret = 0;
+	ptrdiff_t ret;
+	int want = operation == RS_OT_SEND ? RS_WANT_WRITE : RS_WANT_READ;
+	/* the timeout covers the whole call, not each wait */
+	unsigned long long deadline = rocksock_deadline(sock);
 	size_t bytesleft = bufsize ? bufsize : strlen(buffer);
 	size_t byteswanted;
 	char* bufptr = buffer;
+	int zc;
 
 	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
-	if(operation == RS_OT_SEND) wfd = &fd;
-	else rfd = &fd;
-
-	if(sock->timeout) {
-		if(operation == RS_OT_SEND)
-			ret = setsockopt(sock->socket, SOL_SOCKET, SO_SNDTIMEO, (void*) make_timeval(&tv, sock->timeout), sizeof(tv));
-		else
-			ret = setsockopt(sock->socket, SOL_SOCKET, SO_RCVTIMEO, (void*) make_timeval(&tv, sock->timeout), sizeof(tv));
-	}
-
-	if (ret == -1) return MKSYSERR(sock, errno);
 
 	while(bytesleft) {
 		byteswanted = (chunksize && chunksize < bytesleft) ? chunksize : bytesleft;
 #ifdef USE_SSL
 		if (sock->ssl) {
 			if(operation == RS_OT_SEND)
-				ret = rocksock_ssl_send(sock, bufptr, byteswanted);
+				ret = rocksock_ssl_send(sock, bufptr, byteswanted, &want);
 			else
-				ret = rocksock_ssl_recv(sock, bufptr, byteswanted);
-		} else {
+				ret = rocksock_ssl_recv(sock, bufptr, byteswanted, &want);
+		} else
 #endif
-		FD_ZERO(&fd);
-		/* enforce the timeout by using select() before doing the actual recv/send */
-		FD_SET(sock->socket, &fd);
-		ret=select(sock->socket+1, rfd, wfd, NULL, sock->timeout ? make_timeval(&tv, sock->timeout) : NULL);
-		if(!FD_ISSET(sock->socket, &fd)) MKOERR(sock, RS_E_NULL); // temp test
-		if(ret == -1) {
-			//printf("h: %s, skt: %d, to: %d:%d\n", targethost.host, sock->socket, tv.tv_sec, tv.tv_usec);
-			return MKSYSERR(sock, errno);
-		}
-		else if(!ret) return MKOERR(sock, RS_OT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
-
-		if(operation == RS_OT_SEND)
-			ret = send(sock->socket, bufptr, byteswanted, MSG_NOSIGNAL);
-		else
+		if(operation == RS_OT_SEND) {
+			/* large chunks go out from the caller's pages */
+			zc = sock->zerocopy && byteswanted >= sock->zerocopy ? MSG_ZEROCOPY : 0;
+			ret = send(sock->socket, bufptr, byteswanted, MSG_NOSIGNAL | flags | zc);
+			/* no memory left to pin more pages, this one gets copied */
+			if(zc && ret == -1 && errno == ENOBUFS)
+				ret = send(sock->socket, bufptr, byteswanted, MSG_NOSIGNAL | flags);
+			else if(zc && ret > 0)
+				sock->zc_sent++;
+		} else
 			ret = recv(sock->socket, bufptr, byteswanted, 0);
 
-#ifdef USE_SSL
-		}
-#endif
-
 		if(!ret) // The return value will be 0 when the peer has performed an orderly shutdown.
 			return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
 		else if(ret == -1) {
 			ret = errno;
-			if(ret == EWOULDBLOCK || ret == EINPROGRESS) return MKOERR(sock, RS_OT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
-			return MKSYSERR(sock, errno);
+			if(ret == EINTR) continue;
+			if(ret == EWOULDBLOCK || ret == EAGAIN) {
+				/* pending completions would wake up poll right away */
+				if(sock->zc_sent != sock->zc_done && (ret = rocksock_zerocopy_reap(sock))) return ret;
+				if((ret = rocksock_wait(sock, want, deadline))) return ret;
+				continue;
+			}
+			return MKSYSERR(sock, ret);
 		}
 
 		bytesleft -= ret;
@@ -545,19 +1062,153 @@ static int rocksock_operation(rocksock* sock, rs_operationType operation, char*
 		*bytes += ret;
 		if(operation == RS_OT_READ && (size_t) ret < byteswanted) break;
 	}
+	/* the caller may reuse the buffer once we return */
+	if(sock->zc_sent != sock->zc_done && (ret = rocksock_zerocopy_wait(sock, deadline))) return ret;
+	return NOERR(sock);
+}
+
+/* sends the content of the write buffer, with MSG_MORE if more is set */
+static int wbuf_flush(rocksock* sock, int more) {
+	rs_writeBuffer* wb = &sock->wbuf;
+	size_t n;
+	int ret;
+	if(!wb->len) return 0;
+	ret = rocksock_operation(sock, RS_OT_SEND, wb->data, wb->len, 0, &n, more ? MSG_MORE : 0);
+	/* keep what didn't make it */
+	wb->len -= n;
+	if(wb->len) memmove(wb->data, wb->data + n, wb->len);
+	return ret;
+}
+
+/* rocksock_send of a corked rocksock. whatever doesn't fit into the write
+   buffer goes out directly, except for the last part, so every batch ends
+   with the flush, the one send without MSG_MORE. */
+static int wbuf_send(rocksock* sock, char* buffer, size_t len, size_t* byteswritten) {
+	rs_writeBuffer* wb = &sock->wbuf;
+	size_t tail, n;
+	int ret;
+	*byteswritten = 0;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	if(len > wb->size - wb->len) {
+		if((ret = wbuf_flush(sock, 1))) return ret;
+		tail = len % wb->size;
+		if(!tail) tail = wb->size;
+		if(len > tail) {
+			ret = rocksock_operation(sock, RS_OT_SEND, buffer, len - tail, 0, &n, MSG_MORE);
+			*byteswritten = n;
+			if(ret) return ret;
+		}
+		buffer += len - tail;
+		len = tail;
+	}
+	memcpy(wb->data + wb->len, buffer, len);
+	wb->len += len;
+	*byteswritten += len;
 	return NOERR(sock);
 }
 
 int rocksock_send(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten) {
-	return rocksock_operation(sock, RS_OT_SEND, buffer, bufsize, chunksize, byteswritten);
+	int ret;
+	if (sock && sock->wbuf.corked && buffer && byteswritten)
+		return wbuf_send(sock, buffer, bufsize ? bufsize : strlen(buffer), byteswritten);
+	/* what a failed flush left in the buffer goes first */
+	if (sock && sock->wbuf.len && (ret = wbuf_flush(sock, 0))) {
+		if (byteswritten) *byteswritten = 0;
+		return ret;
+	}
+	return rocksock_operation(sock, RS_OT_SEND, buffer, bufsize, chunksize, byteswritten, 0);
+}
+
+int rocksock_flush(rocksock* sock) {
+	int ret;
+	if (!sock) return RS_E_NULL;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	if((ret = wbuf_flush(sock, 0))) return ret;
+	return NOERR(sock);
+}
+
+int rocksock_cork(rocksock* sock, char* buf, size_t size) {
+	rs_writeBuffer* wb;
+	int ret;
+	if (!sock) return RS_E_NULL;
+	wb = &sock->wbuf;
+	if (!buf) {
+		wb->corked = 0;
+		if (wb->len) return rocksock_flush(sock);
+		return NOERR(sock);
+	}
+	if (!size) return MKOERR(sock, RS_E_OUT_OF_BUFFER);
+	/* what's left in another buffer goes first */
+	if (buf != wb->data && wb->len && (ret = wbuf_flush(sock, 0))) return ret;
+	if (wb->len > size) return MKOERR(sock, RS_E_OUT_OF_BUFFER);
+	wb->data = buf;
+	wb->size = size;
+	wb->corked = 1;
+	return NOERR(sock);
 }
 
 int rocksock_recv(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* bytesread) {
-	return rocksock_operation(sock, RS_OT_READ, buffer, bufsize, chunksize, bytesread);
+	rs_readBuffer* rb;
+	size_t n;
+	int ret;
+	/* data read ahead by rocksock_readline comes first, and is returned
+	   alone as a short read so it doesn't wait for more */
+	if (sock && sock->rbuf.len && buffer && bufsize && bytesread) {
+		rb = &sock->rbuf;
+		n = rb->len < bufsize ? rb->len : bufsize;
+		memcpy(buffer, rb->data + rb->start, n);
+		rb->start += n;
+		rb->len -= n;
+		*bytesread = n;
+		return NOERR(sock);
+	}
+	/* don't wait for the answer to a request that's still buffered */
+	if (sock && sock->wbuf.len && (ret = wbuf_flush(sock, 0))) return ret;
+	return rocksock_operation(sock, RS_OT_READ, buffer, bufsize, chunksize, bytesread, 0);
+}
+
+int rocksock_set_readbuf(rocksock* sock, char* buf, size_t size) {
+	rs_readBuffer* rb;
+	if (!sock) return RS_E_NULL;
+	rb = &sock->rbuf;
+	if (!buf) size = 0;
+	if (rb->len > size) return MKOERR(sock, RS_E_OUT_OF_BUFFER);
+	if (rb->len) memmove(buf, rb->data + rb->start, rb->len);
+	rb->start = 0;
+	rb->data = buf;
+	rb->size = size;
+	return NOERR(sock);
+}
+
+int rocksock_fill(rocksock* sock) {
+	rs_readBuffer* rb = &sock->rbuf;
+	size_t n;
+	int ret;
+	if(rb->start) {
+		memmove(rb->data, rb->data + rb->start, rb->len);
+		rb->start = 0;
+	}
+	if(sock->wbuf.len && (ret = wbuf_flush(sock, 0))) return ret;
+	ret = rocksock_operation(sock, RS_OT_READ, rb->data + rb->len, rb->size - rb->len, 0, &n, 0);
+	rb->len += n;
+	return ret;
 }
 
 int rocksock_disconnect(rocksock* sock) {
 	if (!sock) return RS_E_NULL;
+	/* abandoned while connecting */
+	if (sock->cs.state == CS_CONNECT) cs_close_attempts(sock, sock->socket);
+	else if (sock->cs.state == CS_RESOLVE) {
+		rocksock_dns_cancel(&sock->cs.dns);
+		sock->socket = -1;
+	}
+	sock->cs.state = CS_NONE;
+	sock->cs.want = 0;
+	sock->rbuf.start = sock->rbuf.len = 0;
+	sock->wbuf.len = 0;
+	sock->zerocopy = 0;
+	sock->zc_sent = sock->zc_done = 0;
+	sock->tfo_deferred = 0;
 #ifdef USE_SSL
 	rocksock_ssl_free_context(sock);
 #endif
@@ -7,10 +7,12 @@
 #define _ROCKSOCK_H_
 
 #include <stddef.h>
+#include <sys/types.h>
 #ifndef  WIN32
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #else
 #include <stdio.h>
 #include <winsock2.h>
@@ -84,17 +86,117 @@ typedef struct {
 	rs_proxyType proxytype;
 } rs_proxy;
 
+/* max number of addresses of proxy 0 or the target rocksock_connect tries */
+#ifndef RS_MAX_ADDRS
+#define RS_MAX_ADDRS 8
+#endif
+
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+} rs_sockaddr;
+
+/* lookup of the DNS stub resolver, see rocksock_dns_start */
+typedef struct {
+	int fd;
+	/* the result, IPv6 and IPv4 interleaved, with port 0 */
+	int naddrs;
+	rs_sockaddr addrs[RS_MAX_ADDRS];
+	/* internal */
+	int family;
+	int asked;
+	int pending;
+	int server;
+	int tries;
+	int n[2];
+	unsigned short id[2];
+	unsigned long ttl;
+	unsigned long long deadline;
+	char host[256];
+} rs_dnsQuery;
+
+/* state of a connect in progress, see rocksock_connect_start */
+typedef struct {
+	int state;
+	int want;
+	int useSSL;
+	int trysocksv4a;
+	/* the SOCKS5 handshake of the current hop was sent at once */
+	int pipelined;
+	/* retrying without pipelining */
+	int strict;
+	/* SOCKS5 method offered with the pipelined handshake */
+	int method;
+	/* RS_PC_* flags of the current hop, and as found in the cache */
+	int caps;
+	int cachedcaps;
+	ptrdiff_t px;
+	size_t pos;
+	size_t len;
+	rs_hostInfo target;
+	char buf[1024];
+	/* addresses to race, and the sockets of the attempts started so far */
+	int naddrs;
+	int nextaddr;
+	int err;
+	unsigned long long nextattempt;
+	int fds[RS_MAX_ADDRS];
+	rs_sockaddr addrs[RS_MAX_ADDRS];
+	rs_dnsQuery dns;
+} rs_connectState;
+
+/* data read ahead by rocksock_readline(_view), rocksock_recv and
+   rocksock_peek see it before the socket. data is the buffer passed to
+   rocksock_set_readbuf, it belongs to the app; rocksock_disconnect only
+   drops what is left in it. */
+typedef struct {
+	size_t start;
+	size_t len;
+	size_t size;
+	char* data;
+} rs_readBuffer;
+
+/* data is the buffer passed to rocksock_cork, it stays attached after cork
+   is turned off, until everything in it was sent */
+typedef struct {
+	int corked;
+	size_t len;
+	size_t size;
+	char* data;
+} rs_writeBuffer;
+
 typedef struct rocksock {
 	int socket;
 	int connected;
 	unsigned long timeout;
+	/* CLOCK_MONOTONIC ms, 0 if none */
+	unsigned long long deadline;
 	rs_proxy *proxies;
 	ptrdiff_t lastproxy;
 	rs_errorInfo lasterror;
 	void *ssl;
 	void *sslctx;
+	rs_connectState cs;
+	/* send the SOCKS5 handshakes at once */
+	int pipelining;
+	/* connect with TCP_FASTOPEN_CONNECT */
+	int fastopen;
+	/* the connect was deferred by it, the SYN may not be out yet */
+	int tfo_deferred;
+	/* size from which on sends use MSG_ZEROCOPY, 0 if off */
+	size_t zerocopy;
+	/* number of MSG_ZEROCOPY sends made and completed */
+	unsigned zc_sent;
+	unsigned zc_done;
+	rs_readBuffer rbuf;
+	rs_writeBuffer wbuf;
 } rocksock;
 
+/* return values of rocksock_connect_want */
+#define RS_WANT_READ 1
+#define RS_WANT_WRITE 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -106,13 +208,143 @@ void rocksock_free_ssl(void);
 /* rocksock_init: pass empty rocksock struct and if you want to use proxies,
    an array of rs_proxy's that you need to allocate yourself. */
 int rocksock_init(rocksock* sock, rs_proxy *proxies);
+/* the timeout bounds every call of rocksock_connect, rocksock_send/recv and
+   rocksock_sendfile as a whole, 0 means no timeout. default is 60 secs. */
 int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec);
+/* sets a deadline timeout_millisec from now, shared by everything done with
+   sock until it is changed: name lookup, tcp connect, each proxy hop, the SSL
+   handshake and all following transfers, so the whole job ends when it
+   expires, with the timeout error of the operation that was going on. the
+   timeout of the single calls still applies when it ends earlier.
+   0 removes the deadline. lookups with getaddrinfo, rather than the stub
+   resolver, can't be interrupted and aren't bound by it. */
+int rocksock_set_deadline(rocksock* sock, unsigned long timeout_millisec);
+/* with on set, connects use TCP Fast Open (RFC 7413): once the first
+   connection to an address got a cookie from the server, the next ones send
+   their first bytes in the SYN, saving a round trip. these are the request
+   to proxy 0 with a proxy chain, the SSL ClientHello with SSL, and else
+   whatever the application sends first with rocksock_send. for the latter
+   the connect returns right away, before the server was even contacted, so
+   errors like a refused connection show up in the first send or recv. if
+   the server speaks first, the first read starts the handshake without
+   data. such a connect wins the race of the addresses right
+   away, so the next address isn't tried if it fails.
+   needs linux 4.11 or newer and net.ipv4.tcp_fastopen with bit 1 set (the
+   default), else connects work as usual. fails where the option is unknown
+   at compile time. it stays set across rocksock_disconnect. */
+int rocksock_set_fastopen(rocksock* sock, int on);
+/* with on set, the greeting, the authentication and the connect request
+   for a SOCKS5 proxy go out together and the replies are read in turn,
+   so a hop takes one round trip instead of two, or three with username
+   and password. with credentials only username/password authentication is
+   offered then. if the proxy picks another method or hangs up on the
+   requests sent ahead, the connect starts over once with the usual step by
+   step handshake. rocksock_proxycache_init makes that, and the method the
+   proxy picked, stick for the following connects. proxies that throw away
+   what they get ahead of their reply just stall until the timeout, so this
+   is for proxies known to handle it. */
+int rocksock_set_pipelining(rocksock* sock, int on);
 int rocksock_add_proxy(rocksock* sock, rs_proxyType proxytype, const char* host, unsigned short port, const char* username, const char* password);
 int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring);
 int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL);
+/* rocksock_set_deadline followed by rocksock_connect. the deadline stays in
+   effect for the transfers on the connection. */
+int rocksock_connect_deadline(rocksock* sock, const char* host, unsigned short port, int useSSL, unsigned long timeout_millisec);
+/* non-blocking variant of rocksock_connect, so many connects can be driven
+   from one event loop. rocksock_connect_start resolves proxy 0 or the target
+   and starts connecting to it, after which sock->socket is valid.
+   as long as rocksock_connect_want returns non-zero, wait until sock->socket
+   gets readable (RS_WANT_READ) or writable (RS_WANT_WRITE) and call
+   rocksock_connect_step with the conditions that occurred, errors and hangups
+   count as both. it proceeds through the proxy chain and the SSL handshake as
+   far as it can without blocking. once want returns 0 the connection is
+   established and ready for use with rocksock_send/recv.
+   either function returning an error ends the attempt, the socket still
+   has to be closed with rocksock_disconnect. timeouts are up to the caller,
+   except the deadline of rocksock_set_deadline, which fails the step after
+   it expired.
+   name resolution blocks unless the stub resolver was enabled with
+   rocksock_dns_init, then the lookup of proxy 0 or the target is the first
+   step, with sock->socket being the resolver's.
+   all addresses of proxy 0 or the target are tried, IPv6 and IPv4
+   interleaved, starting a new attempt whenever the previous ones failed or
+   didn't finish within 250ms (RFC 8305). the first one to connect is used.
+   sock->socket refers to the latest attempt until then, so it may change
+   with every step, and rocksock_connect_timeout returns the ms after which
+   rocksock_connect_step has to be called even if nothing happened on it
+   (with revents 0), or -1 if there's no such deadline. while connecting,
+   revents decide whether sock->socket is checked at all, the other
+   attempts are only polled once something happened or the timeout passed. */
+int rocksock_connect_start(rocksock* sock, const char* host, unsigned short port, int useSSL);
+int rocksock_connect_step(rocksock* sock, int revents);
+int rocksock_connect_want(rocksock* sock);
+int rocksock_connect_timeout(rocksock* sock);
+/* the socket of a connected rocksock is non-blocking: transfers are tried
+   right away and only when the kernel can't take or deliver data, poll()
+   waits for the socket up to the timeout. */
 int rocksock_send(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten);
 int rocksock_recv(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* bytesread);
+/* turns cork on with buf of size bytes as the write buffer, or off if buf
+   is NULL. with cork on, rocksock_send only copies into the buffer, so many
+   small writes cost one send() (one TLS record with SSL) when the buffer is
+   full or rocksock_flush is called. what doesn't fit goes out right away
+   with MSG_MORE, so the kernel can merge it into full packets, and the flush
+   ends the batch. reads flush first, so a request can't sit in the buffer
+   while its answer is awaited. turning cork off flushes. if that fails, the
+   rest stays in buf and goes out before the next send, so buf must stay
+   valid until the rocksock is disconnected or corked with another buffer.
+   rocksock_disconnect drops what's still buffered. */
+int rocksock_cork(rocksock* sock, char* buf, size_t size);
+/* turns on MSG_ZEROCOPY for the chunks of rocksock_send of threshold bytes
+   or more on the connected socket of sock, 0 turns it off. the kernel then
+   sends from the pages of the caller instead of copying them.
+   rocksock_send waits until the kernel reports it is done with the pages,
+   so the buffer can be reused once it returns, unless it failed: then the
+   connection should be closed first. since that wait ends each call, it
+   pays off for calls of some 100KB and more, see examples/zerocopy_bench.
+   it has no effect with SSL, and fails where the kernel lacks SO_ZEROCOPY
+   (before linux 4.14). rocksock_disconnect turns it off. */
+int rocksock_set_zerocopy(rocksock* sock, size_t threshold);
+#ifndef WIN32
+/* rocksock_send/recv for iovcnt pieces of memory at once, with sendmsg()
+   and recvmsg(), so headers and bodies don't need to be copied together to
+   go out in one call. with cork on they are collected in the write buffer,
+   with SSL in a buffer on the stack, to go out as few records.
+   rocksock_recvv, like rocksock_recv, returns after a short read. */
+int rocksock_sendv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* byteswritten);
+int rocksock_recvv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* bytesread);
+#endif
+int rocksock_flush(rocksock* sock);
+/* reads one line, up to and including '\n', into buffer and replaces the
+   '\n' with 0. bytesread is the length of the line without it.
+   returns RS_E_OUT_OF_BUFFER if the line doesn't fit into bufsize, with
+   bufsize bytes of it consumed.
+   with a read buffer set, lines are read in large chunks and the rest is kept
+   for the following calls of rocksock_readline(_view), rocksock_recv and
+   rocksock_peek, so after readline sock->socket must not be read from
+   directly. without one, the line is read a byte at a time. */
 int rocksock_readline(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread);
+/* makes buf of size bytes the read-ahead buffer of sock, NULL removes it.
+   data still buffered is moved over, RS_E_OUT_OF_BUFFER if it doesn't fit.
+   buf must stay valid as long as it is set, rocksock_disconnect only drops
+   its content. */
+int rocksock_set_readbuf(rocksock* sock, char* buf, size_t size);
+/* like rocksock_readline, but without copying: line points to the line,
+   0-terminated instead of the '\n', inside sock's read buffer and stays valid
+   until the next read from sock. returns RS_E_OUT_OF_BUFFER if a line is
+   longer than the size of the read buffer - 1, or no read buffer is set.
+   the data stays buffered then and can be fetched with rocksock_recv. */
+int rocksock_readline_view(rocksock* sock, char** line, size_t* len);
+/* sends len bytes of file descriptor fd starting at offset off, or everything
+   up to the end of the file if len is 0. the data is moved by the kernel with
+   sendfile(), or splice() if fd is a pipe, and copied through a buffer when SSL
+   is active or the file type isn't supported. pipes are read from their
+   current position, off is ignored. the file offset of fd is not changed.
+   the timeout applies to the whole call as with rocksock_send.
+   byteswritten contains the number of bytes sent, which is less than len if
+   the file ended early. note that sendfile() raises SIGPIPE if the peer went
+   away. */
+int rocksock_sendfile(rocksock* sock, int fd, off_t off, size_t len, size_t* byteswritten);
 int rocksock_disconnect(rocksock* sock);
 
 /* returns a string describing the last error or NULL */
@@ -138,6 +370,177 @@ int rocksock_clear(rocksock* sock);
    return value 0 indicates success, everything else error. result may not be NULL */
 int rocksock_peek(rocksock* sock, int *result);
 
+/* optional process-wide cache for the name lookups of rocksock_connect and
+   SOCKS4 targets. rocksock_dnscache_init sets it up with room for about
+   entries hosts, which is all the memory it ever uses. successful lookups are
+   kept for ttl_ms, lookups that found the name doesn't exist for
+   negative_ttl_ms (0 disables that). numeric addresses bypass the cache.
+   lookups are lock-free, the functions may be called from any thread, except
+   for init and free which must not race with anything.
+   returns 0 on success, -1 if out of memory or already set up. */
+int rocksock_dnscache_init(size_t entries, unsigned long ttl_ms, unsigned long negative_ttl_ms);
+void rocksock_dnscache_free(void);
+/* caches host as resolving to addrs, a comma separated list of numeric IPv4
+   and IPv6 addresses, for ttl_ms. with ttl_ms 0 the entry is pinned: it
+   doesn't expire and is never evicted. an empty or NULL addrs makes the host
+   fail to resolve. returns 0 on success, -1 if the cache isn't set up, an
+   address is invalid, or there's no room left next to pinned entries. */
+int rocksock_dnscache_set(const char* host, const char* addrs, unsigned long ttl_ms);
+
+typedef struct {
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+	unsigned long evictions;
+} rs_dnscacheStats;
+
+/* copies the counters of the cache, which count up since the program start */
+void rocksock_dnscache_stats(rs_dnscacheStats* stats);
+
+/* optional process-wide cache of what proxies support, keyed by host and
+   port: that a SOCKS4 proxy can't do 4a, so the target gets resolved locally
+   right away instead of after a rejected 4a request, and the authentication
+   method of a SOCKS5 proxy and whether it takes pipelined handshakes (see
+   rocksock_set_pipelining). rocksock_proxycache_init sets it up with room
+   for about entries proxies, kept for ttl_ms. an entry is dropped whenever a
+   connect fails at its proxy, so the next one finds out again.
+   the functions may be called from any thread, except for init and free.
+   returns 0 on success, -1 if out of memory or already set up. */
+int rocksock_proxycache_init(size_t entries, unsigned long ttl_ms);
+void rocksock_proxycache_free(void);
+
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long drops;
+} rs_proxycacheStats;
+
+void rocksock_proxycache_stats(rs_proxycacheStats* stats);
+
+/* DNS stub resolver, resolving names without blocking and without malloc.
+   rocksock_dns_init makes the rocksock_connect functions use it instead of
+   getaddrinfo. servers is a comma separated list of nameservers, like
+   "127.0.0.1:5353,[::1]", port 53 if omitted, or NULL to read them from
+   /etc/resolv.conf, along with its timeout and attempts options. it must not
+   race with lookups. returns 0 on success, -1 if no usable nameserver was
+   given or found. */
+int rocksock_dns_init(const char* servers);
+/* starts looking up the A and AAAA records of host. numeric addresses, names
+   in /etc/hosts and those in the dns cache are answered right away, names are
+   taken as given, without the search domains of resolv.conf.
+   as long as rocksock_dns_timeout returns a value other than -1, wait until
+   q->fd gets readable or that many ms passed, then call rocksock_dns_step.
+   q->fd may change with every step. once finished, q->addrs holds the
+   q->naddrs addresses found. the functions return 0 or an EAI_* error like
+   getaddrinfo, which ends the lookup. */
+int rocksock_dns_start(rs_dnsQuery* q, const char* host);
+int rocksock_dns_step(rs_dnsQuery* q);
+int rocksock_dns_timeout(rs_dnsQuery* q);
+/* abandons a lookup that didn't finish yet */
+void rocksock_dns_cancel(rs_dnsQuery* q);
+
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	/* connections found dead on checkout */
+	unsigned long stale;
+	unsigned long evictions;
+	unsigned long idle;
+} rs_poolStats;
+
+typedef struct rocksock_pool {
+	struct rs_poolEntry *entries;
+	size_t count;
+	size_t size;
+	size_t max_per_key;
+	unsigned long max_idle;
+	rs_poolStats stats;
+} rocksock_pool;
+
+/* pool of established connections for reuse, keyed by proxy chain, target
+   host, port and SSL mode, so repeated connects to the same place skip the
+   tcp, proxy and SSL handshakes. chains are compared by a 64bit digest of
+   their proxies, including the credentials.
+   rocksock_pool_init sets it up to hold up to size idle connections, at most
+   max_per_key of them per key (0: no limit), each dropped after being idle
+   for max_idle_ms (0: never). when full, the least recently used one is
+   dropped. returns 0 on success, -1 if size is 0 or out of memory.
+   a pool is not thread-safe. */
+int rocksock_pool_init(rocksock_pool* pool, size_t size, size_t max_per_key, unsigned long max_idle_ms);
+/* closes and frees the idle connections and releases the pool */
+void rocksock_pool_free(rocksock_pool* pool);
+/* checks out an idle connection to host:port through the nproxies proxies,
+   the most recently used one first. connections that got readable while
+   idle, which means the peer closed them, are dropped on the way.
+   returns NULL if there's none, then connect a new one as usual. the
+   proxies pointer of the returned rocksock is the one it had when it was put
+   back, so set it again before reusing the rocksock for another connect. */
+rocksock* rocksock_pool_get(rocksock_pool* pool, const rs_proxy* proxies, int nproxies, const char* host, unsigned short port, int useSSL);
+/* returns sock, which must have been allocated with rocksock_new, to the
+   pool. it's keyed by the proxies and target of its last connect, so its
+   proxies must still be valid. only put back connections whose protocol is
+   idle, with no response pending. returns 0 if it was pooled, -1 if it was
+   not connected or had data waiting, in which case it got closed and freed. */
+int rocksock_pool_put(rocksock_pool* pool, rocksock* sock);
+/* copies the counters of the pool, idle being the number of pooled
+   connections */
+void rocksock_pool_stats(rocksock_pool* pool, rs_poolStats* stats);
+
+/* candidate proxy of a hop of a rocksock_proxychain, with its health */
+typedef struct {
+	rs_proxy proxy;
+	/* EWMA of the time its hop of the handshake took in us, 0 until it
+	   went through once */
+	unsigned long latency;
+	/* failures in a row, and the CLOCK_MONOTONIC ms until which it's
+	   banned for them */
+	unsigned failures;
+	unsigned long long banned;
+	/* times it was picked and failed */
+	unsigned long uses;
+	unsigned long fails;
+} rs_proxyCandidate;
+
+typedef struct {
+	rs_proxyCandidate* candidates;
+	size_t count;
+	size_t size;
+	/* where the next search starts, and the candidate of the last connect */
+	size_t next;
+	rs_proxyCandidate* use;
+} rs_proxyHop;
+
+typedef struct rocksock_proxychain {
+	rs_proxyHop* hops;
+	int nhops;
+	unsigned long backoff;
+	unsigned long max_backoff;
+} rocksock_proxychain;
+
+/* proxy chain of nhops hops, each with a set of candidate proxies, added
+   with rocksock_proxychain_add in the format of
+   rocksock_add_proxy_fromstring. rocksock_connect_chain picks for every hop
+   the candidate with the shortest handshakes, preferring ones not tried yet,
+   and leaves out those that failed: for backoff_ms after a failure, doubling
+   with each further one in a row, up to max_backoff_ms. when the connect
+   fails, the candidate of the hop in lasterror.failedProxy (or the one after
+   it, when the proxy answered it couldn't reach it) is banned and the
+   connect is retried with the next best ones, up to once per candidate and
+   until the deadline of rocksock_set_deadline passes. the timeout of
+   rocksock_set_timeout bounds each attempt, so it should be short when
+   proxies may stall. errors of the target or the SSL handshake with it end
+   the connect right away.
+   sock needs storage for nhops proxies as for rocksock_add_proxy, they are
+   set to the candidates used. the health of the candidates can be read from
+   chain->hops. a chain is not thread-safe.
+   init returns 0 on success, -1 if out of memory. add returns 0, -1 if out
+   of memory or there's no such hop, or the RS_E_* error of a bad
+   proxystring. */
+int rocksock_proxychain_init(rocksock_proxychain* chain, int nhops, unsigned long backoff_ms, unsigned long max_backoff_ms);
+void rocksock_proxychain_free(rocksock_proxychain* chain);
+int rocksock_proxychain_add(rocksock_proxychain* chain, int hop, const char* proxystring);
+int rocksock_connect_chain(rocksock* sock, rocksock_proxychain* chain, const char* host, unsigned short port, int useSSL);
+
 /* using these two pulls in malloc from libc - only matters if you static link and dont use SSL */
 /* returns a new heap alloced rocksock object which must be passed to rocksock_init later on */
 rocksock* rocksock_new(void);
@@ -159,4 +562,12 @@ void rocksock_free(rocksock* s);
 //RcB: DEP "rocksock_dynamic.c"
 //RcB: DEP "rocksock_readline.c"
 //RcB: DEP "rocksock_peek.c"
+//RcB: DEP "rocksock_sendfile.c"
+//RcB: DEP "rocksock_iov.c"
+//RcB: DEP "rocksock_zerocopy.c"
+//RcB: DEP "rocksock_dnscache.c"
+//RcB: DEP "rocksock_proxycache.c"
+//RcB: DEP "rocksock_dns.c"
+//RcB: DEP "rocksock_pool.c"
+//RcB: DEP "rocksock_proxychain.c"
 
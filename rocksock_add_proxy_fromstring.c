@@ -24,15 +24,9 @@
 	user:pass@ part is optional for http and socks5.
 	however, user:pass authentication is currently not implemented for http proxies.
 */
-#define MKERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
-int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring) {
-	if (!sock)
-		return RS_E_NULL;
-	if(!sock->proxies) return MKERR(sock, RS_E_NO_PROXYSTORAGE);
-
+int rs_proxy_fromstring(rs_proxy* prx, const char *proxystring) {
 	const char* p;
 	rs_proxyType proxytype;
-	rs_proxy* prx = &sock->proxies[sock->lastproxy+1];
 	char *user_buf = prx->username;
 	char *pass_buf = prx->password;
 	char *host_buf = prx->hostinfo.host;
@@ -55,7 +49,7 @@ int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring) {
 	const char *at = strchr(proxystring+next_token, '@');
 	if(at) {
 		if(proxytype == RS_PT_SOCKS4)
-			return MKERR(sock, RS_E_SOCKS4_NOAUTH);
+			return RS_E_SOCKS4_NOAUTH;
 		p = strchr(proxystring+next_token, ':');
 		if(!p || p >= at) goto inv_string;
 		const char *u = proxystring+next_token;
@@ -63,7 +57,7 @@ int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring) {
 		p++;
 		pl = at-p;
 		if(proxytype == RS_PT_SOCKS5 && (ul > 255 || pl > 255))
-			return MKERR(sock, RS_E_SOCKS5_AUTH_EXCEEDSIZE);
+			return RS_E_SOCKS5_AUTH_EXCEEDSIZE;
 		memcpy(user_buf, u, ul);
 		user_buf[ul]=0;
 		memcpy(pass_buf, p, pl);
@@ -78,14 +72,25 @@ int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring) {
 	if(!p) goto inv_string;
 	hl = p-h;
 	if(hl > 255)
-		return MKERR(sock, RS_E_HOSTNAME_TOO_LONG);
+		return RS_E_HOSTNAME_TOO_LONG;
 	memcpy(host_buf, h, hl);
 	host_buf[hl]=0;
-	sock->lastproxy++;
 	prx->hostinfo.port = atoi(p+1);
 	prx->proxytype = proxytype;
-	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+	return 0;
 inv_string:
-	return MKERR(sock, RS_E_INVALID_PROXY_URL);
+	return RS_E_INVALID_PROXY_URL;
+}
+
+#define MKERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
+int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring) {
+	int ret;
+	if (!sock)
+		return RS_E_NULL;
+	if(!sock->proxies) return MKERR(sock, RS_E_NO_PROXYSTORAGE);
+	if((ret = rs_proxy_fromstring(&sock->proxies[sock->lastproxy+1], proxystring)))
+		return MKERR(sock, ret);
+	sock->lastproxy++;
+	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
 }
 
@@ -31,44 +31,60 @@ const char* rocksock_ssl_strerror(rocksock *sock, int error) {
 }
 
 #include <errno.h>
-int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz) {
-        int ret = CyaSSL_write(sock->ssl, buf, sz);
-        if (ret < 0 && CyaSSL_get_error(sock->ssl, ret) == SSL_ERROR_WANT_WRITE) errno = EWOULDBLOCK;
-        return ret;
-}
-
-int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz) {
-	int ret = CyaSSL_read(sock->ssl, buf, sz);
-	if (ret < 0 && CyaSSL_get_error(sock->ssl, ret) == SSL_ERROR_WANT_READ) errno = EWOULDBLOCK;
+/* maps the want conditions of a transfer to EWOULDBLOCK and what to wait for */
+static int ssl_result(rocksock* sock, int ret, int *want) {
+	if(ret < 0) switch(CyaSSL_get_error(sock->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			*want = RS_WANT_READ;
+			errno = EWOULDBLOCK;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			*want = RS_WANT_WRITE;
+			errno = EWOULDBLOCK;
+			break;
+	}
 	return ret;
 }
 
-int rocksock_ssl_connect_fd(rocksock* sock) {
-	sock->sslctx = CyaSSL_CTX_new(CyaSSLv23_client_method());
-	if (!sock->sslctx) {
-		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
-	}
+int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz, int *want) {
+	return ssl_result(sock, CyaSSL_write(sock->ssl, buf, sz), want);
+}
 
-	/* FIXME cyassl needs explicit passing of certificates
-	   however the location may vary by system.
-	   until resolved, certificate checks are disabled */
-	CyaSSL_CTX_set_verify(sock->sslctx, SSL_VERIFY_NONE, 0);
+int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz, int *want) {
+	return ssl_result(sock, CyaSSL_read(sock->ssl, buf, sz), want);
+}
 
-	sock->ssl = CyaSSL_new(sock->sslctx);
-	if (!sock->ssl) {
-		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+int rocksock_ssl_connect_step(rocksock* sock, int *want) {
+	*want = 0;
+	if(!sock->ssl) {
+		sock->sslctx = CyaSSL_CTX_new(CyaSSLv23_client_method());
+		if (!sock->sslctx) {
+			return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+		}
+
+		/* FIXME cyassl needs explicit passing of certificates
+		   however the location may vary by system.
+		   until resolved, certificate checks are disabled */
+		CyaSSL_CTX_set_verify(sock->sslctx, SSL_VERIFY_NONE, 0);
+
+		sock->ssl = CyaSSL_new(sock->sslctx);
+		if (!sock->ssl) {
+			return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+		}
+
+		CyaSSL_set_fd(sock->ssl, sock->socket);
+		CyaSSL_set_using_nonblock(sock->ssl, 1);
 	}
 
-	CyaSSL_set_fd(sock->ssl, sock->socket);
-	//CyaSSL_set_using_nonblock(sock->ssl, 0);
-
 	int ret = CyaSSL_connect(sock->ssl);
 	if(ret != SSL_SUCCESS) {
-		/* when CyaSSL_connect gets interrupted by a timeout, it reports LENGTH_ERROR instead of
-		   SSL_ERROR_WANT_READ as it's supposed to do (see cyassl github issue #65).
-		   since that value is not exported we can't catch it without hardcoding the value, so we will wait for a fix */
-		if((ret = CyaSSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ)
-			return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_CONNECTTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+		if((ret = CyaSSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ) {
+			*want = RS_WANT_READ;
+			return 0;
+		} else if(ret == SSL_ERROR_WANT_WRITE) {
+			*want = RS_WANT_WRITE;
+			return 0;
+		}
 		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
 	}
 	return 0;
@@ -94,8 +110,9 @@ int rocksock_ssl_peek(rocksock* sock, int *result) {
 	if(ret >= 0) *result = 1;
 	else {
 		ret = CyaSSL_get_error(sock->ssl, 0);
-		if(ret == SSL_ERROR_WANT_READ) return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_READTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
-		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
+		/* the socket is non-blocking, no complete record arrived yet */
+		if(ret == SSL_ERROR_WANT_READ) *result = 0;
+		else return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
 	}
 	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
 }
@@ -0,0 +1,498 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* DNS stub resolver, an alternative to getaddrinfo that can be driven from an
+   event loop. the A and AAAA queries of a lookup are sent together over UDP to
+   a nameserver of /etc/resolv.conf, and resent to the next one when no answer
+   arrived in time or the server refused it. the socket is connected to the
+   current server, so the kernel drops packets of anyone else and reports port
+   unreachable errors, which move on to the next server right away. answers
+   are received into a buffer on the stack and parsed right away, so a lookup
+   only needs its rs_dnsQuery and doesn't malloc. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#endif
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef RS_DNS_MAX_SERVERS
+#define RS_DNS_MAX_SERVERS 3
+#endif
+
+/* answers are limited to 512 bytes without EDNS */
+#define DNS_BUFSIZE 512
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+
+#ifdef EAI_NODATA
+#define DNS_NODATA EAI_NODATA
+#else
+#define DNS_NODATA EAI_NONAME
+#endif
+
+static struct {
+	int nservers;
+	int attempts;
+	unsigned long timeout;
+	rs_sockaddr servers[RS_DNS_MAX_SERVERS];
+} conf;
+
+static void close_fd(int fd) {
+#ifdef WIN32
+	closesocket(fd);
+#else
+	close(fd);
+#endif
+}
+
+static socklen_t addrlen(const rs_sockaddr* a) {
+	return a->sa.sa_family == AF_INET ? sizeof(a->v4) : sizeof(a->v6);
+}
+
+/* parses a numeric IPv4 or IPv6 address */
+static int parse_numeric(const char* s, rs_sockaddr* a) {
+	memset(a, 0, sizeof(*a));
+	if(inet_pton(AF_INET, s, &a->v4.sin_addr) == 1)
+		a->v4.sin_family = AF_INET;
+	else if(inet_pton(AF_INET6, s, &a->v6.sin6_addr) == 1)
+		a->v6.sin6_family = AF_INET6;
+	else return -1;
+	return 0;
+}
+
+/* parses a nameserver of the form ip, ip:port or [ipv6]:port */
+static int parse_server(const char* s, size_t len, rs_sockaddr* a) {
+	char buf[64], *ip = buf, *port = 0, *p;
+	int n = 53;
+	if(!len || len >= sizeof(buf)) return -1;
+	memcpy(buf, s, len);
+	buf[len] = 0;
+	if(*ip == '[') {
+		ip++;
+		if(!(p = strchr(ip, ']'))) return -1;
+		*p++ = 0;
+		if(*p == ':') port = p + 1;
+		else if(*p) return -1;
+	} else if((p = strchr(ip, ':')) && !strchr(p + 1, ':')) {
+		*p = 0;
+		port = p + 1;
+	}
+	/* scope ids aren't supported */
+	if((p = strchr(ip, '%'))) *p = 0;
+	if(port && ((n = atoi(port)) <= 0 || n > 65535)) return -1;
+	if(parse_numeric(ip, a)) return -1;
+	if(a->sa.sa_family == AF_INET) a->v4.sin_port = htons(n);
+	else a->v6.sin6_port = htons(n);
+	return 0;
+}
+
+/* returns the next word of the line at *p, or NULL at its end or a comment */
+static char* token(char** p) {
+	char* s = *p + strspn(*p, " \t\r");
+	size_t l = strcspn(s, " \t\r");
+	if(!l || *s == '#' || *s == ';') return 0;
+	*p = s + l + !!s[l];
+	s[l] = 0;
+	return s;
+}
+
+/* calls fn for every line of the file at path, reading it through a buffer on
+   the stack. lines that don't fit are skipped. */
+static void for_each_line(const char* path, void (*fn)(char* line, void* ctx), void* ctx) {
+	char buf[1024];
+	size_t have = 0, start, i;
+	ptrdiff_t n;
+	int skip = 0, fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return;
+	for(;;) {
+		n = read(fd, buf + have, sizeof(buf) - 1 - have);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) {
+			buf[have] = 0;
+			if(have && !skip) fn(buf, ctx);
+			break;
+		}
+		for(start = i = have, have += n; i < have; i++) {
+			if(buf[i] != '\n') continue;
+			buf[i] = 0;
+			if(!skip) fn(buf + start, ctx);
+			skip = 0;
+			start = i + 1;
+		}
+		if(!start && have == sizeof(buf) - 1) {
+			skip = 1;
+			have = 0;
+		} else {
+			memmove(buf, buf + start, have - start);
+			have -= start;
+		}
+	}
+	close(fd);
+}
+
+static void resolvconf_line(char* line, void* ctx) {
+	char *w = token(&line);
+	(void) ctx;
+	if(!w) return;
+	if(!strcmp(w, "nameserver")) {
+		if((w = token(&line)) && conf.nservers < RS_DNS_MAX_SERVERS &&
+		   !parse_server(w, strlen(w), &conf.servers[conf.nservers]))
+			conf.nservers++;
+	} else if(!strcmp(w, "options")) {
+		while((w = token(&line))) {
+			if(!strncmp(w, "timeout:", 8) && atoi(w + 8) > 0) conf.timeout = atoi(w + 8) * 1000UL;
+			else if(!strncmp(w, "attempts:", 9) && atoi(w + 9) > 0) conf.attempts = atoi(w + 9);
+		}
+	}
+}
+
+int rocksock_dns_init(const char* servers) {
+	const char* p;
+	size_t l;
+	conf.nservers = 0;
+	conf.timeout = 5000;
+	conf.attempts = 2;
+	if(!servers) {
+		for_each_line("/etc/resolv.conf", resolvconf_line, 0);
+		return conf.nservers ? 0 : -1;
+	}
+	for(p = servers; *p && conf.nservers < RS_DNS_MAX_SERVERS; p += l + !!p[l]) {
+		l = strcspn(p, ",");
+		if(parse_server(p, l, &conf.servers[conf.nservers])) {
+			conf.nservers = 0;
+			return -1;
+		}
+		conf.nservers++;
+	}
+	return conf.nservers ? 0 : -1;
+}
+
+int rs_dns_enabled(void) {
+	return conf.nservers != 0;
+}
+
+struct hosts_lookup {
+	const char* host;
+	rs_sockaddr* addrs;
+	int naddrs;
+};
+
+static void hosts_line(char* line, void* ctx) {
+	struct hosts_lookup* h = ctx;
+	char *ip = token(&line), *w;
+	if(!ip) return;
+	while((w = token(&line)))
+		if(!strcasecmp(w, h->host)) {
+			if(h->naddrs < RS_MAX_ADDRS && !parse_numeric(ip, &h->addrs[h->naddrs])) h->naddrs++;
+			return;
+		}
+}
+
+/* random query ids, so answers are hard to spoof. mixes a counter with the
+   clock through splitmix64. */
+static unsigned short new_id(void) {
+	static unsigned long long counter;
+	struct timespec ts;
+	unsigned long long x;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	x = __atomic_add_fetch(&counter, 0x9E3779B97F4A7C15ULL, __ATOMIC_RELAXED) ^ ts.tv_nsec;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* builds the query for the records of type of host into buf, which must have
+   room for 12 + 2 + 255 + 4 bytes. returns its length or 0 if host isn't a
+   valid name. */
+static size_t make_query(unsigned char* buf, const char* host, unsigned short id, int type) {
+	unsigned char* p = buf;
+	size_t l;
+	*p++ = id >> 8;
+	*p++ = id;
+	*p++ = 1; /* recursion desired */
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 1; /* one question */
+	memset(p, 0, 6);
+	p += 6;
+	for(; *host; host += l + !!host[l]) {
+		l = strcspn(host, ".");
+		if(!l || l > 63) return 0;
+		*p++ = l;
+		memcpy(p, host, l);
+		p += l;
+	}
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = type;
+	*p++ = 0;
+	*p++ = 1; /* class IN */
+	return p - buf;
+}
+
+/* sends the outstanding queries to the current server, opening a socket of
+   its family if needed. returns 0 or an errno value. a refused query makes
+   the next rocksock_dns_step move on to the next server. */
+static int send_queries(rs_dnsQuery* q) {
+	unsigned char buf[12 + 2 + 255 + 4];
+	rs_sockaddr* srv = &conf.servers[q->server];
+	size_t len;
+	int i;
+	if(q->fd != -1 && q->family != srv->sa.sa_family) {
+		close_fd(q->fd);
+		q->fd = -1;
+	}
+	if(q->fd == -1) {
+		q->family = srv->sa.sa_family;
+		q->fd = socket(q->family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(q->fd == -1) return errno;
+		if(fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK) == -1) return errno;
+	}
+	if(connect(q->fd, &srv->sa, addrlen(srv)) == -1) return errno;
+	q->deadline = rs_now_ms() + conf.timeout;
+	for(i = 0; i < 2; i++) {
+		if(!(q->pending & (1 << i))) continue;
+		q->id[i] = new_id();
+		len = make_query(buf, q->host, q->id[i], i ? DNS_TYPE_AAAA : DNS_TYPE_A);
+		if(send(q->fd, (void*) buf, len, 0) == -1) {
+			/* the port unreachable of a query sent before */
+			if(errno == ECONNREFUSED) {
+				q->deadline = 0;
+				break;
+			}
+			/* a full send buffer looks like a lost packet, the retry fixes it */
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return errno;
+		}
+	}
+	return 0;
+}
+
+/* skips the possibly compressed name at *pos */
+static int skip_name(const unsigned char* buf, size_t len, size_t* pos) {
+	size_t p = *pos;
+	while(p < len) {
+		if((buf[p] & 0xc0) == 0xc0) {
+			*pos = p + 2;
+			return 0;
+		}
+		if(buf[p] > 63) return -1;
+		if(!buf[p]) {
+			*pos = p + 1;
+			return 0;
+		}
+		p += 1 + buf[p];
+	}
+	return -1;
+}
+
+/* checks that the question at *pos asks for host, it's never compressed */
+static int match_name(const unsigned char* buf, size_t len, size_t* pos, const char* host) {
+	size_t p = *pos, l;
+	for(; *host; host += l + !!host[l]) {
+		l = strcspn(host, ".");
+		if(p + 1 + l > len || buf[p] != l || strncasecmp((const char*) buf + p + 1, host, l)) return -1;
+		p += 1 + l;
+	}
+	if(p >= len || buf[p]) return -1;
+	*pos = p + 1;
+	return 0;
+}
+
+static unsigned get16(const unsigned char* p) {
+	return p[0] << 8 | p[1];
+}
+
+enum { DNS_OK = 0, DNS_IGNORE, DNS_NEXTSERVER, DNS_NXDOMAIN };
+
+/* takes the addresses out of an answer */
+static int parse_answer(rs_dnsQuery* q, const unsigned char* buf, size_t len) {
+	size_t pos = 12, rdlen;
+	unsigned an, type, ttl;
+	int i, max;
+	rs_sockaddr* a;
+	if(len < 12 || !(buf[2] & 0x80) || get16(buf + 4) != 1) return DNS_IGNORE;
+	for(i = 0; i < 2; i++)
+		if((q->pending & (1 << i)) && get16(buf) == q->id[i]) break;
+	if(i == 2) return DNS_IGNORE;
+	type = i ? DNS_TYPE_AAAA : DNS_TYPE_A;
+	if(match_name(buf, len, &pos, q->host) || pos + 4 > len || get16(buf + pos) != type || get16(buf + pos + 2) != 1)
+		return DNS_IGNORE;
+	pos += 4;
+	switch(buf[3] & 15) {
+		case 0: break;
+		case 3: return DNS_NXDOMAIN;
+		/* server failure, refused, ... */
+		default: return DNS_NEXTSERVER;
+	}
+	/* each family gets half of the room if both were asked for */
+	max = (q->asked == 3) ? RS_MAX_ADDRS / 2 : RS_MAX_ADDRS;
+	/* a truncated answer is used as far as it goes */
+	for(an = get16(buf + 6); an && q->n[i] < max; an--) {
+		if(skip_name(buf, len, &pos) || pos + 10 > len) break;
+		rdlen = get16(buf + pos + 8);
+		ttl = (unsigned) buf[pos + 4] << 24 | buf[pos + 5] << 16 | buf[pos + 6] << 8 | buf[pos + 7];
+		if(pos + 10 + rdlen > len) break;
+		if(get16(buf + pos) == type && get16(buf + pos + 2) == 1 && rdlen == (i ? 16U : 4U)) {
+			a = &q->addrs[(max == RS_MAX_ADDRS ? 0 : i * max) + q->n[i]++];
+			memset(a, 0, sizeof(*a));
+			if(i) {
+				a->v6.sin6_family = AF_INET6;
+				memcpy(&a->v6.sin6_addr, buf + pos + 10, 16);
+			} else {
+				a->v4.sin_family = AF_INET;
+				memcpy(&a->v4.sin_addr, buf + pos + 10, 4);
+			}
+			if(ttl < q->ttl) q->ttl = ttl;
+		}
+		/* CNAMEs are skipped, the server sends their records along */
+		pos += 10 + rdlen;
+	}
+	q->pending &= ~(1 << i);
+	return DNS_OK;
+}
+
+/* ends the lookup, interleaving the families IPv6 first, and caches it */
+static int finish(rs_dnsQuery* q, int err) {
+	rs_sockaddr addrs[RS_MAX_ADDRS];
+	int i, j, fam, max = (q->asked == 3) ? RS_MAX_ADDRS / 2 : RS_MAX_ADDRS;
+	if(q->fd != -1) close_fd(q->fd);
+	q->fd = -1;
+	q->pending = 0;
+	q->naddrs = 0;
+	if(!err) {
+		for(i = j = 0; i < q->n[0] || j < q->n[1];) {
+			for(fam = 1; fam >= 0; fam--) {
+				int* k = fam ? &j : &i;
+				if(*k < q->n[fam]) addrs[q->naddrs++] = q->addrs[(max == RS_MAX_ADDRS ? 0 : fam * max) + (*k)++];
+			}
+		}
+		memcpy(q->addrs, addrs, q->naddrs * sizeof(*addrs));
+		if(!q->naddrs) err = DNS_NODATA;
+	}
+	/* records with TTL 0 must not be cached, 1ms is close enough */
+	if(!err) rs_dnscache_put(q->host, q->addrs, q->naddrs, 0, q->ttl ? (q->ttl < 86400 ? q->ttl * 1000UL : 86400000UL) : 1);
+	else if(err != EAI_AGAIN && err != EAI_SYSTEM) rs_dnscache_put(q->host, q->addrs, 0, err, 0);
+	return err;
+}
+
+int rocksock_dns_start(rs_dnsQuery* q, const char* host) {
+	struct hosts_lookup h = {.host = host, .addrs = q->addrs};
+	unsigned char buf[12 + 2 + 255 + 4];
+	size_t l = strlen(host);
+	int ret;
+	q->fd = -1;
+	q->pending = 0;
+	q->naddrs = 0;
+	if(!l || l > 254) return EAI_NONAME;
+	if(!parse_numeric(host, &q->addrs[0])) {
+		q->naddrs = 1;
+		return 0;
+	}
+	if(rs_dnscache_get(host, q->addrs, &q->naddrs, &ret)) return ret;
+#ifndef WIN32
+	for_each_line("/etc/hosts", hosts_line, &h);
+#endif
+	if((q->naddrs = h.naddrs)) return 0;
+	if(!conf.nservers) return EAI_AGAIN;
+	if(!make_query(buf, host, 0, 0)) return EAI_NONAME;
+	memcpy(q->host, host, l + 1);
+#ifdef IPV4_ONLY
+	q->asked = q->pending = 1;
+#else
+	q->asked = q->pending = 3;
+#endif
+	q->n[0] = q->n[1] = 0;
+	q->server = 0;
+	q->tries = 0;
+	q->ttl = -1;
+	if((ret = send_queries(q))) {
+		finish(q, EAI_SYSTEM);
+		errno = ret;
+		return EAI_SYSTEM;
+	}
+	return 0;
+}
+
+int rocksock_dns_step(rs_dnsQuery* q) {
+	unsigned char buf[DNS_BUFSIZE];
+	ptrdiff_t n;
+	int ret;
+	if(q->fd == -1) return 0;
+	for(;;) {
+		n = recv(q->fd, (void*) buf, sizeof(buf), 0);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			/* port unreachable and the like count as a failed server */
+			if(errno != EAGAIN && errno != EWOULDBLOCK) q->deadline = 0;
+			break;
+		}
+		switch(parse_answer(q, buf, n)) {
+			case DNS_OK:
+				if(!q->pending) return finish(q, 0);
+				break;
+			case DNS_NXDOMAIN:
+				return finish(q, EAI_NONAME);
+			case DNS_NEXTSERVER:
+				q->deadline = 0;
+				break;
+		}
+	}
+	if(rs_now_ms() < q->deadline) return 0;
+	if(++q->tries >= conf.attempts * conf.nservers) return finish(q, EAI_AGAIN);
+	q->server = (q->server + 1) % conf.nservers;
+	if((ret = send_queries(q))) {
+		finish(q, EAI_SYSTEM);
+		errno = ret;
+		return EAI_SYSTEM;
+	}
+	return 0;
+}
+
+int rocksock_dns_timeout(rs_dnsQuery* q) {
+	unsigned long long now;
+	if(q->fd == -1) return -1;
+	now = rs_now_ms();
+	return now >= q->deadline ? 0 : q->deadline - now;
+}
+
+void rocksock_dns_cancel(rs_dnsQuery* q) {
+	if(q->fd != -1) close_fd(q->fd);
+	q->fd = -1;
+	q->pending = 0;
+}
+
+int rs_dns_resolve(const char* host, rs_sockaddr* addrs, int* naddrs) {
+	rs_dnsQuery q;
+	struct pollfd pfd;
+	int ret, wait;
+	if((ret = rocksock_dns_start(&q, host))) return ret;
+	while((wait = rocksock_dns_timeout(&q)) != -1) {
+		pfd.fd = q.fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, wait) == -1 && errno != EINTR) {
+			rocksock_dns_cancel(&q);
+			return EAI_SYSTEM;
+		}
+		if((ret = rocksock_dns_step(&q))) return ret;
+	}
+	*naddrs = q.naddrs;
+	memcpy(addrs, q.addrs, q.naddrs * sizeof(*addrs));
+	return 0;
+}
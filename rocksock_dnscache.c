@@ -0,0 +1,211 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* process-wide cache for the name lookups of rocksock_connect.
+   the table has a fixed number of entries, grouped into buckets of 4 ways a
+   host hashes to. when a bucket is full, the least recently used entry that
+   isn't pinned is replaced.
+   lookups don't take a lock: every entry carries a sequence counter that is
+   odd while the entry is being written, readers copy the entry and retry if
+   the counter changed meanwhile. writers serialize on a spinlock, they only
+   run after a lookup went to the resolver. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+#include "rocksock_internal.h"
+
+
+struct rs_dnsentry {
+	unsigned seq;
+	unsigned hash;
+	int pinned;
+	int naddrs;
+	/* getaddrinfo error of a negative entry */
+	int err;
+	unsigned long long expires;
+	unsigned long long used;
+	char host[256];
+	rs_sockaddr addrs[RS_MAX_ADDRS];
+};
+
+static struct rs_dnscache {
+	size_t mask;
+	unsigned long ttl;
+	unsigned long negative_ttl;
+	struct rs_dnsentry* entries;
+} *cache;
+
+static char lock;
+static unsigned long hits, negative_hits, misses, evictions;
+
+static struct rs_dnsentry* bucket(struct rs_dnscache* c, unsigned hash) {
+	return &c->entries[rs_cache_bucket(hash, c->mask)];
+}
+
+int rs_dnscache_get(const char* host, rs_sockaddr* addrs, int* naddrs, int* err) {
+	struct rs_dnscache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	struct rs_dnsentry* e;
+	char key[256];
+	unsigned hash, seq;
+	unsigned long long expires, now;
+	int i, tries, hit = 0, pinned = 0;
+	if(!c) return 0;
+	hash = rs_host_key(host, key);
+	e = bucket(c, hash);
+	for(i = 0; i < RS_CACHE_WAYS; i++, e++) {
+		for(tries = 0; tries < 8; tries++) {
+			seq = rs_seq_read(&e->seq);
+			if(seq & 1) continue;
+			hit = e->hash == hash && !strncmp(e->host, key, sizeof(e->host));
+			if(hit) {
+				pinned = e->pinned;
+				expires = e->expires;
+				*err = e->err;
+				*naddrs = e->naddrs;
+				if(*naddrs > RS_MAX_ADDRS) *naddrs = RS_MAX_ADDRS;
+				memcpy(addrs, e->addrs, *naddrs * sizeof(*addrs));
+			}
+			if(!rs_seq_changed(&e->seq, seq)) break;
+			hit = 0;
+		}
+		if(hit) break;
+	}
+	if(hit) {
+		now = rs_now_ms();
+		if(pinned || now < expires) {
+			__atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+			__atomic_fetch_add(*err ? &negative_hits : &hits, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	__atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* stores an entry for host, replacing the one there is or the least recently
+   used of its bucket. a pinned entry only gets replaced by another pinned one.
+   returns 0 on success, -1 if there's no room. */
+static int cache_put(struct rs_dnscache* c, const char* host, const rs_sockaddr* addrs, int naddrs, int err,
+                     unsigned long ttl, int pinned) {
+	struct rs_dnsentry *e, *b, *victim = 0;
+	char key[256];
+	unsigned hash = rs_host_key(host, key);
+	unsigned long long now = rs_now_ms();
+	int i;
+	rs_spin_lock(&lock);
+	b = bucket(c, hash);
+	for(i = 0; i < RS_CACHE_WAYS && !victim; i++)
+		if(b[i].host[0] && b[i].hash == hash && !strcmp(b[i].host, key)) victim = &b[i];
+	for(i = 0; i < RS_CACHE_WAYS && !victim; i++)
+		if(!b[i].host[0]) victim = &b[i];
+	for(i = 0; i < RS_CACHE_WAYS && !victim; i++)
+		if(!b[i].pinned && now >= b[i].expires) victim = &b[i];
+	if(!victim) {
+		for(i = 0; i < RS_CACHE_WAYS; i++)
+			if(!b[i].pinned && (!victim || b[i].used < victim->used)) victim = &b[i];
+		if(victim) __atomic_fetch_add(&evictions, 1, __ATOMIC_RELAXED);
+	}
+	if(!victim || (victim->pinned && !pinned)) {
+		rs_spin_unlock(&lock);
+		return -1;
+	}
+	e = victim;
+	rs_seq_write_begin(&e->seq);
+	e->hash = hash;
+	memcpy(e->host, key, sizeof(key));
+	e->pinned = pinned;
+	e->naddrs = naddrs;
+	e->err = err;
+	e->expires = now + ttl;
+	__atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+	memcpy(e->addrs, addrs, naddrs * sizeof(*addrs));
+	rs_seq_write_end(&e->seq);
+	rs_spin_unlock(&lock);
+	return 0;
+}
+
+void rs_dnscache_put(const char* host, const rs_sockaddr* addrs, int naddrs, int err, unsigned long ttl_ms) {
+	unsigned long ttl;
+	struct rs_dnscache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	if(!c) return;
+	if(err) {
+		/* only cache answers saying the name doesn't exist, not temporary
+		   failures */
+		if(!c->negative_ttl) return;
+		if(err != EAI_NONAME && err != EAI_FAMILY
+#ifdef EAI_NODATA
+		   && err != EAI_NODATA
+#endif
+		) return;
+	}
+	ttl = err ? c->negative_ttl : c->ttl;
+	/* the TTL of the records, if known, can only shorten it */
+	if(ttl_ms && ttl_ms < ttl) ttl = ttl_ms;
+	cache_put(c, host, addrs, naddrs, err, ttl, 0);
+}
+
+int rocksock_dnscache_init(size_t entries, unsigned long ttl_ms, unsigned long negative_ttl_ms) {
+	struct rs_dnscache* c;
+	size_t n;
+	if(!entries || __atomic_load_n(&cache, __ATOMIC_ACQUIRE)) return -1;
+	n = rs_cache_buckets(entries);
+	if(!(c = malloc(sizeof *c))) return -1;
+	if(!(c->entries = calloc(n * RS_CACHE_WAYS, sizeof(*c->entries)))) {
+		free(c);
+		return -1;
+	}
+	c->mask = n - 1;
+	c->ttl = ttl_ms;
+	c->negative_ttl = negative_ttl_ms;
+	__atomic_store_n(&cache, c, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void rocksock_dnscache_free(void) {
+	struct rs_dnscache* c = __atomic_exchange_n(&cache, 0, __ATOMIC_ACQ_REL);
+	if(!c) return;
+	free(c->entries);
+	free(c);
+}
+
+int rocksock_dnscache_set(const char* host, const char* addrlist, unsigned long ttl_ms) {
+	struct rs_dnscache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	rs_sockaddr addrs[RS_MAX_ADDRS];
+	char buf[64];
+	const char* p;
+	size_t l;
+	int n = 0;
+	if(!c || !host || !host[0] || strlen(host) > 255) return -1;
+	for(p = addrlist; p && *p; p += l + !!p[l]) {
+		l = strcspn(p, ",");
+		if(!l || l >= sizeof(buf) || n == RS_MAX_ADDRS) return -1;
+		memcpy(buf, p, l);
+		buf[l] = 0;
+		memset(&addrs[n], 0, sizeof(addrs[n]));
+		if(inet_pton(AF_INET, buf, &addrs[n].v4.sin_addr) == 1)
+			addrs[n].v4.sin_family = AF_INET;
+		else if(inet_pton(AF_INET6, buf, &addrs[n].v6.sin6_addr) == 1)
+			addrs[n].v6.sin6_family = AF_INET6;
+		else return -1;
+		n++;
+	}
+	return cache_put(c, host, addrs, n, n ? 0 : EAI_NONAME, ttl_ms, !ttl_ms);
+}
+
+void rocksock_dnscache_stats(rs_dnscacheStats* stats) {
+	stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+	stats->negative_hits = __atomic_load_n(&negative_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+}
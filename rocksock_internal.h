@@ -2,13 +2,159 @@
 #define ROCKSOCK_INTERNAL_H
 
 #include "rocksock.h"
+#include <time.h>
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+/* CLOCK_MONOTONIC time in us and ms */
+static inline unsigned long long rs_now_us(void) {
+#ifdef WIN32
+	return GetTickCount64() * 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+static inline unsigned long long rs_now_ms(void) {
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* spinlock on a char, for the writers of the caches, which are rare and
+   short */
+static inline void rs_spin_lock(char* lock) {
+	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+#ifdef WIN32
+		SwitchToThread();
+#else
+		sched_yield();
+#endif
+}
+
+static inline void rs_spin_unlock(char* lock) {
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+/* the dns and the proxy cache have buckets of RS_CACHE_WAYS entries. a
+   table with room for entries has rs_cache_buckets of them, a power of 2,
+   and the bucket of hash starts at entry rs_cache_bucket, mask being the
+   number of buckets - 1. */
+#define RS_CACHE_WAYS 4
+
+static inline size_t rs_cache_buckets(size_t entries) {
+	size_t n = 1;
+	while(n * RS_CACHE_WAYS < entries) n *= 2;
+	return n;
+}
+
+static inline size_t rs_cache_bucket(unsigned hash, size_t mask) {
+	return (hash & mask) * RS_CACHE_WAYS;
+}
+
+/* FNV-1a */
+#define RS_FNV_BASIS 2166136261u
+
+static inline unsigned rs_fnv_byte(unsigned h, unsigned char c) {
+	return (h ^ c) * 16777619u;
+}
+
+/* lowercases host into key, up to 255 chars, and returns its hash */
+static inline unsigned rs_host_key(const char* host, char* key) {
+	unsigned h = RS_FNV_BASIS;
+	size_t i;
+	for(i = 0; host[i] && i < 255; i++) {
+		key[i] = (host[i] >= 'A' && host[i] <= 'Z') ? host[i] + 32 : host[i];
+		h = rs_fnv_byte(h, key[i]);
+	}
+	key[i] = 0;
+	return h;
+}
+
+/* sequence counter of a cache entry, odd while a writer holding the cache
+   lock changes it. readers copy what they need after rs_seq_read returned
+   an even count, and retry if rs_seq_changed says a write came in between. */
+static inline unsigned rs_seq_read(const unsigned* seq) {
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int rs_seq_changed(const unsigned* seq, unsigned start) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+static inline void rs_seq_write_begin(unsigned* seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void rs_seq_write_end(unsigned* seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* dns cache, rocksock_dnscache.c. get returns 1 if host is cached, storing
+   its addresses, with port 0, or the error of a negative entry in err. put
+   caches the result of a lookup, err != 0 being a failed one, for ttl_ms if
+   that is shorter than the configured TTL. both do nothing unless the cache
+   was set up with rocksock_dnscache_init. */
+int rs_dnscache_get(const char* host, rs_sockaddr* addrs, int* naddrs, int* err);
+void rs_dnscache_put(const char* host, const rs_sockaddr* addrs, int naddrs, int err, unsigned long ttl_ms);
+
+/* proxy capability cache, rocksock_proxycache.c. get returns the RS_PC_*
+   flags known for proxy, 0 if none. put sets them, drop forgets them. all do
+   nothing unless the cache was set up with rocksock_proxycache_init. */
+/* SOCKS4 proxy rejecting 4a requests */
+#define RS_PC_SOCKS4 1
+/* SOCKS5 proxy taking no authentication, or username/password */
+#define RS_PC_NOAUTH 2
+#define RS_PC_AUTH 4
+/* SOCKS5 proxy not taking pipelined handshakes */
+#define RS_PC_STRICT 8
+int rs_proxycache_get(const rs_hostInfo* proxy);
+void rs_proxycache_put(const rs_hostInfo* proxy, int caps);
+void rs_proxycache_drop(const rs_hostInfo* proxy);
+
+/* stub resolver, rocksock_dns.c. enabled returns whether rocksock_dns_init
+   was called successfully, resolve does a blocking lookup with it, returning
+   0 or an EAI_* error. */
+int rs_dns_enabled(void);
+int rs_dns_resolve(const char* host, rs_sockaddr* addrs, int* naddrs);
 
-typedef struct {
-	struct addrinfo* hostaddr;
-	struct addrinfo hostaddr_buf;
-	struct sockaddr_storage hostaddr_aiaddr_buf;
-} rs_resolveStorage;
+/* parses proxystring, see rocksock_add_proxy_fromstring, into prx.
+   returns 0 or an RS_E_* error. */
+int rs_proxy_fromstring(rs_proxy* prx, const char *proxystring);
 
 int rocksock_seterror(rocksock* sock, rs_errorType errortype, int error, const char* file, int line);
+/* whether the last error of sock is a proxy answering that it couldn't reach
+   the next host */
+int rs_is_target_error(rocksock* sock);
+/* the point in CLOCK_MONOTONIC ms an operation starting now has to end by,
+   after the timeout or the deadline of sock. 0 if there's none. */
+unsigned long long rocksock_deadline(rocksock* sock);
+/* poll() timeout in ms until deadline, -1 waiting forever if it's 0 */
+int rs_poll_timeout(unsigned long long deadline);
+/* waits until the socket of sock gets ready for the RS_WANT_* conditions in
+   want, or deadline (from rocksock_deadline) passed. returns 0 or the error
+   set on sock. */
+int rocksock_wait(rocksock* sock, int want, unsigned long long deadline);
+/* waits for the connect started with rocksock_connect_start to make
+   progress and takes the next step, failing it once deadline passed.
+   returns 0 or the error that ended the connect. */
+int rocksock_connect_poll(rocksock* sock, unsigned long long deadline);
+/* reads what's available, waiting for it as rocksock_recv does, into the
+   free space of the read buffer of sock, moving its content to the start.
+   the buffer must not be full. */
+int rocksock_fill(rocksock* sock);
+/* takes the MSG_ZEROCOPY completions that arrived off the error queue */
+int rocksock_zerocopy_reap(rocksock* sock);
+/* waits until all MSG_ZEROCOPY sends of sock completed, or deadline */
+int rocksock_zerocopy_wait(rocksock* sock, unsigned long long deadline);
 
 #endif
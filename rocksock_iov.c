@@ -0,0 +1,177 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#ifndef WIN32
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#define MKOERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
+#define NOERR(S) rocksock_seterror(S, RS_ET_OWN, 0, NULL, 0)
+#define MKSYSERR(S, X) rocksock_seterror(S, RS_ET_SYS, X, ROCKSOCK_FILENAME, __LINE__)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* number of iovecs handed to the kernel at once */
+#define RS_IOV_BATCH 64
+
+/* size of the buffer the pieces are coalesced in with SSL */
+#define RS_IOV_SSLBUF 4096
+
+/* copies the part of the iovecs starting at element i, offset off, into v.
+   returns the number of elements copied. */
+static int iov_window(struct iovec* v, const struct iovec* iov, int iovcnt, int i, size_t off) {
+	int n;
+	for(n = 0; i < iovcnt && n < RS_IOV_BATCH; i++, n++) {
+		v[n].iov_base = (char*) iov[i].iov_base + off;
+		v[n].iov_len = iov[i].iov_len - off;
+		off = 0;
+	}
+	return n;
+}
+
+/* moves element i and offset off past n bytes */
+static void iov_advance(const struct iovec* iov, int iovcnt, int* i, size_t* off, size_t n) {
+	while(*i < iovcnt && n >= iov[*i].iov_len - *off) {
+		n -= iov[*i].iov_len - *off;
+		*off = 0;
+		++*i;
+	}
+	*off += n;
+}
+
+static int iov_check(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* bytes) {
+	if (!sock) return RS_E_NULL;
+	if (!iov || iovcnt < 0 || !bytes) return MKOERR(sock, RS_E_NULL);
+	*bytes = 0;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	return 0;
+}
+
+/* rocksock_send for each piece, stops at the first error */
+static int send_pieces(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* byteswritten) {
+	size_t n;
+	int i, ret = 0;
+	for(i = 0; !ret && i < iovcnt; i++)
+		if(iov[i].iov_len) {
+			ret = rocksock_send(sock, iov[i].iov_base, iov[i].iov_len, 0, &n);
+			*byteswritten += n;
+		}
+	return ret;
+}
+
+int rocksock_sendv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* byteswritten) {
+	struct iovec v[RS_IOV_BATCH];
+	struct msghdr msg = {0};
+	unsigned long long deadline;
+	size_t off = 0;
+	ptrdiff_t ret;
+	int i = 0;
+	if((ret = iov_check(sock, iov, iovcnt, byteswritten))) return ret;
+	/* a corked rocksock collects the pieces in its write buffer */
+	if(sock->wbuf.corked) return send_pieces(sock, iov, iovcnt, byteswritten);
+	if(sock->wbuf.len && (ret = rocksock_flush(sock))) return ret;
+	/* SSL gets them coalesced in a buffer of its own, to be written as few
+	   records. it's on the stack, so nothing may be left in it. */
+	if(sock->ssl) {
+		char buf[RS_IOV_SSLBUF];
+		rs_writeBuffer wb = sock->wbuf;
+		sock->wbuf.data = buf;
+		sock->wbuf.size = sizeof buf;
+		sock->wbuf.corked = 1;
+		if(!(ret = send_pieces(sock, iov, iovcnt, byteswritten))) ret = rocksock_flush(sock);
+		/* what's still buffered didn't go out */
+		*byteswritten -= sock->wbuf.len;
+		sock->wbuf = wb;
+		return ret;
+	}
+	deadline = rocksock_deadline(sock);
+	while(i < iovcnt) {
+		if(!iov[i].iov_len) {
+			i++;
+			continue;
+		}
+		msg.msg_iov = v;
+		msg.msg_iovlen = iov_window(v, iov, iovcnt, i, off);
+		ret = sendmsg(sock->socket, &msg, MSG_NOSIGNAL);
+		if(!ret) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+		if(ret == -1) {
+			ret = errno;
+			if(ret == EINTR) continue;
+			if(ret == EWOULDBLOCK || ret == EAGAIN) {
+				if((ret = rocksock_wait(sock, RS_WANT_WRITE, deadline))) return ret;
+				continue;
+			}
+			return MKSYSERR(sock, ret);
+		}
+		*byteswritten += ret;
+		iov_advance(iov, iovcnt, &i, &off, ret);
+	}
+	return NOERR(sock);
+}
+
+int rocksock_recvv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t* bytesread) {
+	struct iovec v[RS_IOV_BATCH];
+	struct msghdr msg = {0};
+	unsigned long long deadline;
+	size_t off = 0, n, want;
+	ptrdiff_t ret;
+	int i = 0;
+	if((ret = iov_check(sock, iov, iovcnt, bytesread))) return ret;
+	/* read-ahead data and SSL go through rocksock_recv element by element,
+	   ending at the first short read like a single recv does */
+	if(sock->ssl || sock->rbuf.len) {
+		for(; i < iovcnt; i++) {
+			if(!iov[i].iov_len) continue;
+			if((ret = rocksock_recv(sock, iov[i].iov_base, iov[i].iov_len, 0, &n))) return ret;
+			*bytesread += n;
+			if(n < iov[i].iov_len) break;
+		}
+		return NOERR(sock);
+	}
+	if(sock->wbuf.len && (ret = rocksock_flush(sock))) return ret;
+	deadline = rocksock_deadline(sock);
+	while(i < iovcnt) {
+		if(!iov[i].iov_len) {
+			i++;
+			continue;
+		}
+		msg.msg_iov = v;
+		msg.msg_iovlen = iov_window(v, iov, iovcnt, i, off);
+		for(want = 0, n = 0; n < (size_t) msg.msg_iovlen; n++) want += v[n].iov_len;
+		ret = recvmsg(sock->socket, &msg, 0);
+		if(!ret) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+		if(ret == -1) {
+			ret = errno;
+			if(ret == EINTR) continue;
+			if(ret == EWOULDBLOCK || ret == EAGAIN) {
+				if((ret = rocksock_wait(sock, RS_WANT_READ, deadline))) return ret;
+				continue;
+			}
+			return MKSYSERR(sock, ret);
+		}
+		*bytesread += ret;
+		if((size_t) ret < want) break;
+		iov_advance(iov, iovcnt, &i, &off, ret);
+	}
+	return NOERR(sock);
+}
+
+#endif
@@ -40,34 +40,53 @@ const char* rocksock_ssl_strerror(rocksock *sock, int error) {
 }
 
 #include <errno.h>
-int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz) {
-        int ret = SSL_write(sock->ssl, buf, sz);
-        if (ret < 0 && SSL_get_error(sock->ssl, ret) == SSL_ERROR_WANT_WRITE) errno = EWOULDBLOCK;
-        return ret;
+/* maps the want conditions of a transfer to EWOULDBLOCK and what to wait for */
+static int ssl_result(rocksock* sock, int ret, int *want) {
+	if(ret < 0) switch(SSL_get_error(sock->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			*want = RS_WANT_READ;
+			errno = EWOULDBLOCK;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			*want = RS_WANT_WRITE;
+			errno = EWOULDBLOCK;
+			break;
+	}
+	return ret;
 }
 
-int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz) {
-	int ret = SSL_read(sock->ssl, buf, sz);
-	if (ret < 0 && SSL_get_error(sock->ssl, ret) == SSL_ERROR_WANT_READ) errno = EWOULDBLOCK;
-	return ret;
+int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz, int *want) {
+	return ssl_result(sock, SSL_write(sock->ssl, buf, sz), want);
 }
 
-int rocksock_ssl_connect_fd(rocksock* sock) {
-	sock->sslctx = SSL_CTX_new(SSLv23_client_method());
-	if (!sock->sslctx) {
-		ERR_print_errors_fp(stderr);
-		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
-	}
-	sock->ssl = SSL_new(sock->sslctx);
-	if (!sock->ssl) {
-		ERR_print_errors_fp(stderr);
-		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz, int *want) {
+	return ssl_result(sock, SSL_read(sock->ssl, buf, sz), want);
+}
+
+int rocksock_ssl_connect_step(rocksock* sock, int *want) {
+	*want = 0;
+	if(!sock->ssl) {
+		sock->sslctx = SSL_CTX_new(SSLv23_client_method());
+		if (!sock->sslctx) {
+			ERR_print_errors_fp(stderr);
+			return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+		}
+		sock->ssl = SSL_new(sock->sslctx);
+		if (!sock->ssl) {
+			ERR_print_errors_fp(stderr);
+			return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+		}
+		SSL_set_fd(sock->ssl, sock->socket);
 	}
-	SSL_set_fd(sock->ssl, sock->socket);
 	int ret = SSL_connect(sock->ssl);
 	if(ret != 1) {
-		if((ret = SSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ)
-			return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_CONNECTTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+		if((ret = SSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ) {
+			*want = RS_WANT_READ;
+			return 0;
+		} else if(ret == SSL_ERROR_WANT_WRITE) {
+			*want = RS_WANT_WRITE;
+			return 0;
+		}
 		//ERR_print_errors_fp(stderr);
 		//printf("%dxxx\n", SSL_get_error(sock->ssl, ret));
 		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
@@ -95,9 +114,9 @@ int rocksock_ssl_peek(rocksock* sock, int *result) {
 	if(ret >= 0) *result = 1;
 	else {
 		ret = SSL_get_error(sock->ssl, ret);
-		if(ret == SSL_ERROR_WANT_READ)
-			return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_READTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
-		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
+		/* the socket is non-blocking, no complete record arrived yet */
+		if(ret == SSL_ERROR_WANT_READ) *result = 0;
+		else return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
         }
 	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
 }
@@ -10,8 +10,10 @@
 
 #include <stdio.h>
 #ifndef WIN32
-#include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
+#else
+#define poll WSAPoll
 #endif
 #include <errno.h>
 
@@ -31,32 +33,28 @@
    if data is available, and a subsequent recv call returns 0 bytes read, the
    connection was terminated. */
 int rocksock_peek(rocksock* sock, int *result) {
-	size_t readv;
 	if(!result)
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
 	if (sock->socket == -1) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+	/* read ahead by rocksock_readline */
+	if(sock->rbuf.len) {
+		*result = 1;
+		goto no_err;
+	}
 #ifdef USE_SSL
 	if(sock->ssl && rocksock_ssl_pending(sock)) {
 		*result = 1;
 		goto no_err;
 	}
 #endif
-	fd_set readfds;
-
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 1;
-	FD_ZERO(&readfds);
-	FD_SET(sock->socket, &readfds);
-
-	readv = select(sock->socket + 1, &readfds, 0, 0, &tv);
-	if(readv < 0) return rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
-	*result = FD_ISSET(sock->socket, &readfds);
+	struct pollfd pfd = {.fd = sock->socket, .events = POLLIN};
+	if(poll(&pfd, 1, 0) == -1) return rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+	*result = !!pfd.revents;
 #ifdef USE_SSL
 	if(sock->ssl && *result) {
 		return rocksock_ssl_peek(sock, result);
 	}
-	no_err:
 #endif
+	no_err:
 	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
 }
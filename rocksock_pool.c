@@ -0,0 +1,172 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* pool of idle connections. entries are kept in the order they were put
+   back, so the least recently used one is first and lookups scan from the
+   end to hand out the warmest connection. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+struct rs_poolEntry {
+	rocksock* sock;
+	unsigned long long key;
+	unsigned long long since;
+};
+
+static unsigned long long hash_bytes(unsigned long long h, const void* data, size_t len) {
+	const unsigned char* p = data;
+	while(len--) h = (h ^ *p++) * 1099511628211ULL;
+	return h;
+}
+
+static unsigned long long hash_str(unsigned long long h, const char* s) {
+	return hash_bytes(h, s, strlen(s) + 1);
+}
+
+/* digest of the chain and target, FNV-1a */
+static unsigned long long make_key(const rs_proxy* proxies, int nproxies, const char* host, unsigned short port, int useSSL) {
+	unsigned long long h = 14695981039346656037ULL;
+	int i, ssl = !!useSSL;
+	for(i = 0; i < nproxies; i++) {
+		h = hash_bytes(h, &proxies[i].proxytype, sizeof(proxies[i].proxytype));
+		h = hash_bytes(h, &proxies[i].hostinfo.port, sizeof(proxies[i].hostinfo.port));
+		h = hash_str(h, proxies[i].hostinfo.host);
+		h = hash_str(h, proxies[i].username);
+		h = hash_str(h, proxies[i].password);
+	}
+	h = hash_bytes(h, &nproxies, sizeof(nproxies));
+	h = hash_bytes(h, &port, sizeof(port));
+	h = hash_bytes(h, &ssl, sizeof(ssl));
+	return hash_str(h, host);
+}
+
+static int same_proxy(const rs_proxy* a, const rs_proxy* b) {
+	return a->proxytype == b->proxytype && a->hostinfo.port == b->hostinfo.port &&
+	       !strcmp(a->hostinfo.host, b->hostinfo.host) && !strcmp(a->username, b->username) &&
+	       !strcmp(a->password, b->password);
+}
+
+/* the key only narrows the search down, a collision must not hand out a
+   connection made through another chain */
+static int matches(struct rs_poolEntry* e, unsigned long long key, const rs_proxy* proxies, int nproxies,
+                   const char* host, unsigned short port, int useSSL) {
+	rocksock* sock = e->sock;
+	int i;
+	if(e->key != key || sock->cs.target.port != port || !!sock->cs.useSSL != !!useSSL ||
+	   strcmp(sock->cs.target.host, host) || sock->lastproxy + 1 != nproxies) return 0;
+	for(i = 0; i < nproxies; i++)
+		if(!same_proxy(&sock->proxies[i], &proxies[i])) return 0;
+	return 1;
+}
+
+static void discard(rocksock* sock) {
+	rocksock_disconnect(sock);
+	rocksock_clear(sock);
+	rocksock_free(sock);
+}
+
+static void drop(rocksock_pool* pool, size_t i) {
+	discard(pool->entries[i].sock);
+	pool->count--;
+	memmove(&pool->entries[i], &pool->entries[i + 1], (pool->count - i) * sizeof(*pool->entries));
+	pool->stats.evictions++;
+}
+
+/* drops the connections that were idle for too long */
+static void expire(rocksock_pool* pool) {
+	unsigned long long now;
+	if(!pool->max_idle || !pool->count) return;
+	now = rs_now_ms();
+	/* the oldest come first */
+	while(pool->count && now - pool->entries[0].since >= pool->max_idle)
+		drop(pool, 0);
+}
+
+int rocksock_pool_init(rocksock_pool* pool, size_t size, size_t max_per_key, unsigned long max_idle_ms) {
+	if(!size) return -1;
+	memset(pool, 0, sizeof(*pool));
+	if(!(pool->entries = calloc(size, sizeof(*pool->entries)))) return -1;
+	pool->size = size;
+	pool->max_per_key = max_per_key;
+	pool->max_idle = max_idle_ms;
+	return 0;
+}
+
+void rocksock_pool_free(rocksock_pool* pool) {
+	size_t i;
+	for(i = 0; i < pool->count; i++) discard(pool->entries[i].sock);
+	free(pool->entries);
+	memset(pool, 0, sizeof(*pool));
+}
+
+rocksock* rocksock_pool_get(rocksock_pool* pool, const rs_proxy* proxies, int nproxies, const char* host, unsigned short port, int useSSL) {
+	unsigned long long key;
+	rocksock* sock;
+	size_t i;
+	int readable;
+	if(!host || nproxies < 0 || (nproxies && !proxies)) return 0;
+	expire(pool);
+	key = make_key(proxies, nproxies, host, port, useSSL);
+	for(i = pool->count; i--;) {
+		if(!matches(&pool->entries[i], key, proxies, nproxies, host, port, useSSL)) continue;
+		sock = pool->entries[i].sock;
+		pool->count--;
+		memmove(&pool->entries[i], &pool->entries[i + 1], (pool->count - i) * sizeof(*pool->entries));
+		/* an idle connection that got readable was closed by the peer,
+		   or is out of sync */
+		if(rocksock_peek(sock, &readable) || readable) {
+			discard(sock);
+			pool->stats.stale++;
+			continue;
+		}
+		pool->stats.hits++;
+		return sock;
+	}
+	pool->stats.misses++;
+	return 0;
+}
+
+int rocksock_pool_put(rocksock_pool* pool, rocksock* sock) {
+	unsigned long long key;
+	size_t i, oldest = 0, n = 0;
+	int readable;
+	if(!sock) return -1;
+	if(sock->socket == -1 || sock->cs.state || sock->wbuf.len || rocksock_peek(sock, &readable) || readable) {
+		discard(sock);
+		return -1;
+	}
+	/* the deadline was the one of the job that used it */
+	sock->deadline = 0;
+	expire(pool);
+	key = make_key(sock->proxies, sock->lastproxy + 1, sock->cs.target.host, sock->cs.target.port, sock->cs.useSSL);
+	if(pool->max_per_key) {
+		for(i = 0; i < pool->count; i++)
+			if(matches(&pool->entries[i], key, sock->proxies, sock->lastproxy + 1,
+			           sock->cs.target.host, sock->cs.target.port, sock->cs.useSSL))
+				if(!n++) oldest = i;
+		if(n >= pool->max_per_key) drop(pool, oldest);
+	}
+	if(pool->count == pool->size) drop(pool, 0);
+	pool->entries[pool->count].sock = sock;
+	pool->entries[pool->count].key = key;
+	pool->entries[pool->count].since = rs_now_ms();
+	pool->count++;
+	return 0;
+}
+
+void rocksock_pool_stats(rocksock_pool* pool, rs_poolStats* stats) {
+	expire(pool);
+	*stats = pool->stats;
+	stats->idle = pool->count;
+}
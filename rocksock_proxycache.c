@@ -0,0 +1,174 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* process-wide cache of what proxies were found to support, so the
+   handshakes don't have to find out again with every connect. it works like
+   the dns cache: buckets of 4 ways, lock-free lookups using a sequence
+   counter per entry, and writers serialized on a spinlock, with the helpers
+   from rocksock_internal.h. writes only happen when a handshake found out
+   something new, or failed. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rocksock_internal.h"
+
+
+struct rs_proxyentry {
+	unsigned seq;
+	unsigned hash;
+	unsigned short port;
+	int caps;
+	unsigned long long expires;
+	unsigned long long used;
+	char host[256];
+};
+
+static struct rs_proxycache {
+	size_t mask;
+	unsigned long ttl;
+	struct rs_proxyentry* entries;
+} *cache;
+
+static char lock;
+static unsigned long hits, misses, drops;
+
+/* lowercases the host into key and returns the hash of it and the port */
+static unsigned make_key(const rs_hostInfo* proxy, char* key) {
+	unsigned h = rs_host_key(proxy->host, key);
+	return rs_fnv_byte(rs_fnv_byte(h, proxy->port & 0xff), proxy->port >> 8);
+}
+
+static struct rs_proxyentry* bucket(struct rs_proxycache* c, unsigned hash) {
+	return &c->entries[rs_cache_bucket(hash, c->mask)];
+}
+
+static int matches(struct rs_proxyentry* e, unsigned hash, const char* key, unsigned short port) {
+	return e->hash == hash && e->port == port && !strncmp(e->host, key, sizeof(e->host));
+}
+
+int rs_proxycache_get(const rs_hostInfo* proxy) {
+	struct rs_proxycache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	struct rs_proxyentry* e;
+	char key[256];
+	unsigned hash, seq;
+	unsigned long long expires = 0, now;
+	int i, tries, hit = 0, caps = 0;
+	if(!c) return 0;
+	hash = make_key(proxy, key);
+	e = bucket(c, hash);
+	for(i = 0; i < RS_CACHE_WAYS; i++, e++) {
+		for(tries = 0; tries < 8; tries++) {
+			seq = rs_seq_read(&e->seq);
+			if(seq & 1) continue;
+			hit = matches(e, hash, key, proxy->port);
+			if(hit) {
+				caps = e->caps;
+				expires = e->expires;
+			}
+			if(!rs_seq_changed(&e->seq, seq)) break;
+			hit = 0;
+		}
+		if(hit) break;
+	}
+	if(hit) {
+		now = rs_now_ms();
+		if(now < expires) {
+			__atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+			return caps;
+		}
+	}
+	__atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* writes entry e under the lock, an empty key clears it */
+static void write_entry(struct rs_proxyentry* e, unsigned hash, const char* key, unsigned short port, int caps,
+                        unsigned long long expires) {
+	rs_seq_write_begin(&e->seq);
+	e->hash = hash;
+	e->port = port;
+	e->caps = caps;
+	e->expires = expires;
+	memcpy(e->host, key, sizeof(e->host));
+	__atomic_store_n(&e->used, expires ? rs_now_ms() : 0, __ATOMIC_RELAXED);
+	rs_seq_write_end(&e->seq);
+}
+
+void rs_proxycache_put(const rs_hostInfo* proxy, int caps) {
+	struct rs_proxycache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	struct rs_proxyentry *b, *victim = 0;
+	char key[256];
+	unsigned hash;
+	unsigned long long now;
+	int i;
+	if(!c) return;
+	hash = make_key(proxy, key);
+	now = rs_now_ms();
+	rs_spin_lock(&lock);
+	b = bucket(c, hash);
+	for(i = 0; i < RS_CACHE_WAYS && !victim; i++)
+		if(b[i].host[0] && matches(&b[i], hash, key, proxy->port)) victim = &b[i];
+	for(i = 0; i < RS_CACHE_WAYS && !victim; i++)
+		if(!b[i].host[0] || now >= b[i].expires) victim = &b[i];
+	if(!victim)
+		for(i = 0; i < RS_CACHE_WAYS; i++)
+			if(!victim || b[i].used < victim->used) victim = &b[i];
+	write_entry(victim, hash, key, proxy->port, caps, now + c->ttl);
+	rs_spin_unlock(&lock);
+}
+
+void rs_proxycache_drop(const rs_hostInfo* proxy) {
+	struct rs_proxycache* c = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+	struct rs_proxyentry* b;
+	char key[256], empty[256] = {0};
+	unsigned hash;
+	int i;
+	if(!c) return;
+	hash = make_key(proxy, key);
+	rs_spin_lock(&lock);
+	b = bucket(c, hash);
+	for(i = 0; i < RS_CACHE_WAYS; i++)
+		if(b[i].host[0] && matches(&b[i], hash, key, proxy->port)) {
+			write_entry(&b[i], 0, empty, 0, 0, 0);
+			__atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+		}
+	rs_spin_unlock(&lock);
+}
+
+int rocksock_proxycache_init(size_t entries, unsigned long ttl_ms) {
+	struct rs_proxycache* c;
+	size_t n;
+	if(!entries || !ttl_ms || __atomic_load_n(&cache, __ATOMIC_ACQUIRE)) return -1;
+	n = rs_cache_buckets(entries);
+	if(!(c = malloc(sizeof *c))) return -1;
+	if(!(c->entries = calloc(n * RS_CACHE_WAYS, sizeof(*c->entries)))) {
+		free(c);
+		return -1;
+	}
+	c->mask = n - 1;
+	c->ttl = ttl_ms;
+	__atomic_store_n(&cache, c, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void rocksock_proxycache_free(void) {
+	struct rs_proxycache* c = __atomic_exchange_n(&cache, 0, __ATOMIC_ACQ_REL);
+	if(!c) return;
+	free(c->entries);
+	free(c);
+}
+
+void rocksock_proxycache_stats(rs_proxycacheStats* stats) {
+	stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+	stats->drops = __atomic_load_n(&drops, __ATOMIC_RELAXED);
+}
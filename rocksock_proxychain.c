@@ -0,0 +1,171 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* proxy chains with a set of candidates per hop. every connect picks the
+   candidate of each hop that isn't banned and had the shortest handshakes,
+   those that failed are banned for a time doubling with every failure in a
+   row. the handshake time is measured per hop: from the moment the previous
+   hop is through, or the connect started for the first, until the proxy
+   let us through to the next host. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#define MKOERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
+
+int rocksock_proxychain_init(rocksock_proxychain* chain, int nhops, unsigned long backoff_ms, unsigned long max_backoff_ms) {
+	if(nhops < 1 || !backoff_ms) return -1;
+	memset(chain, 0, sizeof(*chain));
+	if(!(chain->hops = calloc(nhops, sizeof(*chain->hops)))) return -1;
+	chain->nhops = nhops;
+	chain->backoff = backoff_ms;
+	chain->max_backoff = max_backoff_ms < backoff_ms ? backoff_ms : max_backoff_ms;
+	return 0;
+}
+
+void rocksock_proxychain_free(rocksock_proxychain* chain) {
+	int i;
+	for(i = 0; i < chain->nhops; i++) free(chain->hops[i].candidates);
+	free(chain->hops);
+	memset(chain, 0, sizeof(*chain));
+}
+
+int rocksock_proxychain_add(rocksock_proxychain* chain, int hop, const char* proxystring) {
+	rs_proxyHop* h;
+	rs_proxyCandidate* c;
+	size_t size;
+	int ret;
+	if(hop < 0 || hop >= chain->nhops || !proxystring) return -1;
+	h = &chain->hops[hop];
+	if(h->count == h->size) {
+		size = h->size ? h->size * 2 : 8;
+		if(!(c = realloc(h->candidates, size * sizeof(*c)))) return -1;
+		h->candidates = c;
+		h->size = size;
+	}
+	c = &h->candidates[h->count];
+	memset(c, 0, sizeof(*c));
+	if((ret = rs_proxy_fromstring(&c->proxy, proxystring))) return ret;
+	h->count++;
+	return 0;
+}
+
+/* untried candidates come first, so every one gets measured, ones that
+   never worked last */
+static unsigned long score(rs_proxyCandidate* c) {
+	if(c->latency) return c->latency;
+	return c->failures ? ULONG_MAX : 0;
+}
+
+/* the best candidate that isn't banned, or the one whose ban ends first.
+   the search starts after the last pick, so equal ones take turns. */
+static rs_proxyCandidate* pick(rs_proxyHop* h, unsigned long long now) {
+	rs_proxyCandidate *c, *best = 0, *soonest = 0;
+	size_t i;
+	for(i = 0; i < h->count; i++) {
+		c = &h->candidates[(h->next + i) % h->count];
+		if(c->banned > now) {
+			if(!soonest || c->banned < soonest->banned) soonest = c;
+			continue;
+		}
+		if(!best || score(c) < score(best)) best = c;
+	}
+	if(!best) best = soonest;
+	h->next = (best - h->candidates + 1) % h->count;
+	return best;
+}
+
+static void penalize(rocksock_proxychain* chain, rs_proxyCandidate* c, unsigned long long now) {
+	unsigned long ban = chain->backoff;
+	unsigned i;
+	c->fails++;
+	c->failures++;
+	for(i = 1; i < c->failures && ban < chain->max_backoff; i++) ban *= 2;
+	if(ban > chain->max_backoff) ban = chain->max_backoff;
+	c->banned = now + ban;
+}
+
+/* adds a handshake time to the EWMA of c, weighing it 1/8 like the
+   smoothed round trip time of TCP */
+static void measure(rs_proxyCandidate* c, unsigned long long us) {
+	if(!us) us = 1;
+	if(us > ULONG_MAX / 8) us = ULONG_MAX / 8;
+	c->latency = c->latency ? (7 * (unsigned long long) c->latency + us) / 8 : us;
+}
+
+/* one connect through the candidates in use, timing the hops */
+static int attempt(rocksock* sock, rocksock_proxychain* chain, const char* host, unsigned short port, int useSSL) {
+	unsigned long long deadline = rocksock_deadline(sock), start = rs_now_us(), now;
+	int ret, done = 0;
+	ret = rocksock_connect_start(sock, host, port, useSSL);
+	for(;;) {
+		/* a pipelining retry starts over at the first hop */
+		if(sock->cs.px < done) {
+			done = sock->cs.px;
+			start = rs_now_us();
+		}
+		for(; done < sock->cs.px && done < chain->nhops; done++) {
+			now = rs_now_us();
+			measure(chain->hops[done].use, now - start);
+			start = now;
+		}
+		if(ret || !rocksock_connect_want(sock)) return ret;
+		ret = rocksock_connect_poll(sock, deadline);
+	}
+}
+
+int rocksock_connect_chain(rocksock* sock, rocksock_proxychain* chain, const char* host, unsigned short port, int useSSL) {
+	rs_proxyHop* h;
+	unsigned long long now;
+	size_t tries = 0;
+	int i, ret, failed;
+	if (!sock) return RS_E_NULL;
+	if (!chain || !host) return MKOERR(sock, RS_E_NULL);
+	if (!sock->proxies) return MKOERR(sock, RS_E_NO_PROXYSTORAGE);
+	/* every candidate can be given a chance */
+	for(i = 0; i < chain->nhops; i++) {
+		if(!chain->hops[i].count) return MKOERR(sock, RS_E_NULL);
+		tries += chain->hops[i].count;
+	}
+	for(;;) {
+		now = rs_now_us() / 1000;
+		for(i = 0; i < chain->nhops; i++) {
+			h = &chain->hops[i];
+			h->use = pick(h, now);
+			h->use->uses++;
+			sock->proxies[i] = h->use->proxy;
+		}
+		sock->lastproxy = chain->nhops - 1;
+		if(!(ret = attempt(sock, chain, host, port, useSSL))) {
+			for(i = 0; i < chain->nhops; i++) chain->hops[i].use->failures = 0;
+			return ret;
+		}
+		failed = sock->lasterror.failedProxy;
+		/* the target or the SSL handshake with it failed */
+		if(failed < 0 || failed >= chain->nhops) return ret;
+		if(rs_is_target_error(sock)) {
+			if(failed == chain->nhops - 1) return ret;
+			/* it's the next proxy that's unreachable */
+			failed++;
+		}
+		now = rs_now_us() / 1000;
+		penalize(chain, chain->hops[failed].use, now);
+		if(!--tries || (sock->deadline && now >= sock->deadline)) return ret;
+		rocksock_disconnect(sock);
+	}
+}
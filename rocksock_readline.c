@@ -9,44 +9,100 @@
 #define _GNU_SOURCE
 
 #include <stddef.h>
+#include <string.h>
 #include "rocksock_internal.h"
 
 #ifndef ROCKSOCK_FILENAME
 #define ROCKSOCK_FILENAME __FILE__
 #endif
 
+/* lines are looked for in the read buffer of the rocksock, which is filled
+   a chunk at a time. memchr() scans it, libc implements that with SIMD. */
+
+static void consume(rs_readBuffer* rb, size_t n) {
+	rb->start += n;
+	rb->len -= n;
+}
+
+/* without a read buffer nothing past the '\n' may be consumed, so the line
+   is read a byte at a time */
+static int readline_bytewise(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread) {
+	size_t n;
+	int ret;
+	while(*bytesread < bufsize) {
+		ret = rocksock_recv(sock, buffer + *bytesread, 1, 1, &n);
+		if(ret || !n) return ret;
+		if(buffer[(*bytesread)++] == '\n') {
+			*bytesread -= 1;
+			buffer[*bytesread] = 0;
+			return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+		}
+	}
+	return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER,
+	                         ROCKSOCK_FILENAME, __LINE__);
+}
+
 // tries to read exactly one line, until '\n', then overwrites the \n with \0
 // bytesread contains the number of bytes read till \n was encountered
 // (so 0 in case \n was the first char).
 // returns RS_E_OUT_OF_BUFFER if the line doesnt fit into the buffer.
 int rocksock_readline(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread) {
-	// TODO: make more efficient by peeking into the buffer (Flag MSG_PEEK to recv), instead of reading byte by byte
-	// would need a different approach for ssl though.
 	if (!sock) return RS_E_NULL;
 	if (!buffer || !bufsize || !bytesread)
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL,
 		                         ROCKSOCK_FILENAME, __LINE__);
-	char* ptr = buffer;
-	size_t bytesread2 = 0;
+	rs_readBuffer* rb = &sock->rbuf;
+	char *src, *nl;
+	size_t n, room;
 	int ret;
 	*bytesread = 0;
-	while(*bytesread < bufsize) {
-		ret = rocksock_recv(sock, ptr, 1, 1, &bytesread2);
-		if(ret || !bytesread2) return ret;
-		*bytesread += bytesread2;
-		if(ptr > buffer + bufsize)
-			break;
-		if(*bytesread > bufsize) {
+	if(!rb->data) return readline_bytewise(sock, buffer, bufsize, bytesread);
+	for(;;) {
+		if(!rb->len && (ret = rocksock_fill(sock))) return ret;
+		src = rb->data + rb->start;
+		nl = memchr(src, '\n', rb->len);
+		n = nl ? (size_t) (nl - src) + 1 : rb->len;
+		room = bufsize - *bytesread;
+		if(n > room) {
+			memcpy(buffer + *bytesread, src, room);
+			consume(rb, room);
 			*bytesread = bufsize;
 			break;
 		}
-		if(*ptr == '\n') {
-			*ptr = 0;
+		memcpy(buffer + *bytesread, src, n);
+		consume(rb, n);
+		*bytesread += n;
+		if(nl) {
 			*bytesread -= 1;
-			return 0;
+			buffer[*bytesread] = 0;
+			return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
 		}
-		ptr++;
 	}
 	return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER,
 	                         ROCKSOCK_FILENAME, __LINE__);
 }
+
+int rocksock_readline_view(rocksock* sock, char** line, size_t* len) {
+	if (!sock) return RS_E_NULL;
+	if (!line || !len)
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL,
+		                         ROCKSOCK_FILENAME, __LINE__);
+	rs_readBuffer* rb = &sock->rbuf;
+	char *nl;
+	/* the part of the buffer already known to have no '\n' */
+	size_t scanned = 0;
+	int ret;
+	/* without a read buffer, size is 0 */
+	while(rb->len == scanned || !(nl = memchr(rb->data + rb->start + scanned, '\n', rb->len - scanned))) {
+		if(rb->len == rb->size)
+			return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER,
+			                         ROCKSOCK_FILENAME, __LINE__);
+		scanned = rb->len;
+		if((ret = rocksock_fill(sock))) return ret;
+	}
+	*nl = 0;
+	*line = rb->data + rb->start;
+	*len = nl - *line;
+	consume(rb, *len + 1);
+	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+}
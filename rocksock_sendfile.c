@@ -0,0 +1,150 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#else
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#define MKOERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
+#define NOERR(S) rocksock_seterror(S, RS_ET_OWN, 0, NULL, 0)
+#define MKSYSERR(S, X) rocksock_seterror(S, RS_ET_SYS, X, ROCKSOCK_FILENAME, __LINE__)
+
+/* size of the bounce buffer used when the kernel can't move the data itself */
+#ifndef RS_SENDFILE_BUFSIZE
+#define RS_SENDFILE_BUFSIZE 16384
+#endif
+
+/* copies through user space, used for SSL and for files sendfile/splice
+   don't take. pipes are read from their current position. */
+static int sendfile_copy(rocksock* sock, int fd, off_t off, int seekable, size_t len, size_t* byteswritten) {
+	char buf[RS_SENDFILE_BUFSIZE];
+	size_t want, n;
+	ptrdiff_t got;
+	int ret = 0;
+	/* the timeout is for the whole call, so the chunks share it by way of
+	   the deadline */
+	unsigned long long deadline = sock->deadline;
+	sock->deadline = rocksock_deadline(sock);
+#ifdef WIN32
+	if(seekable && lseek(fd, off, SEEK_SET) == (off_t) -1) ret = MKSYSERR(sock, errno);
+	seekable = 0;
+#endif
+	while(!ret && (!len || *byteswritten < len)) {
+		want = (len && len - *byteswritten < sizeof buf) ? len - *byteswritten : sizeof buf;
+#ifndef WIN32
+		if(seekable) got = pread(fd, buf, want, off + *byteswritten);
+		else
+#endif
+		got = read(fd, buf, want);
+		if(got == -1) {
+			if(errno == EINTR) continue;
+			ret = MKSYSERR(sock, errno);
+			break;
+		}
+		if(!got) break;
+		ret = rocksock_send(sock, buf, got, 0, &n);
+		*byteswritten += n;
+	}
+	sock->deadline = deadline;
+	return ret ? ret : NOERR(sock);
+}
+
+#ifdef __linux__
+/* splice fails with EAGAIN when the pipe is empty as well as when the socket
+   is full, so this waits until the pipe has data, or no writer left, and the
+   socket takes more. */
+static int splice_wait(rocksock* sock, int fd, unsigned long long deadline) {
+	struct pollfd pfd[2] = {{.fd = fd, .events = POLLIN}, {.fd = sock->socket, .events = POLLOUT}};
+	int i, ret, wait;
+	while((wait = rs_poll_timeout(deadline))) {
+		if((ret = poll(pfd, 2, wait)) == -1) {
+			if(errno == EINTR) continue;
+			return MKSYSERR(sock, errno);
+		}
+		/* poll skips negative fds, so what's ready isn't waited for again */
+		for(i = 0; i < 2; i++)
+			if(pfd[i].revents) pfd[i].fd = -1;
+		if(pfd[0].fd == -1 && pfd[1].fd == -1) return 0;
+	}
+	return MKOERR(sock, RS_E_HIT_WRITETIMEOUT);
+}
+#endif
+
+int rocksock_sendfile(rocksock* sock, int fd, off_t off, size_t len, size_t* byteswritten) {
+	if (!sock) return RS_E_NULL;
+	if (fd < 0 || !byteswritten) return MKOERR(sock, RS_E_NULL);
+	*byteswritten = 0;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	int seekable = 1;
+#ifndef WIN32
+	struct stat st;
+	if(fstat(fd, &st) == -1) return MKSYSERR(sock, errno);
+	seekable = !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode) && !S_ISCHR(st.st_mode);
+#endif
+#ifdef __linux__
+	size_t want;
+	ptrdiff_t ret;
+	/* loff_t of splice is 64bit wide, off_t may not be */
+	loff_t loff = off;
+	int use_splice = S_ISFIFO(st.st_mode);
+	unsigned long long deadline;
+
+	if(sock->ssl) return sendfile_copy(sock, fd, off, seekable, len, byteswritten);
+
+	/* what rocksock_send buffered goes first */
+	if(sock->wbuf.len && (ret = rocksock_flush(sock))) return ret;
+	deadline = rocksock_deadline(sock);
+	while(!len || *byteswritten < len) {
+		/* the kernel caps a single transfer at ~2GB anyway */
+		want = (len && len - *byteswritten < 0x40000000) ? len - *byteswritten : 0x40000000;
+		if(use_splice)
+			ret = splice(fd, NULL, sock->socket, NULL, want, SPLICE_F_MORE | SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			ret = sendfile(sock->socket, fd, &loff, want);
+		if(!ret) break; // end of file
+		else if(ret == -1) {
+			ret = errno;
+			if(ret == EINTR) continue;
+			/* the socket is non-blocking, wait until it takes more */
+			if(ret == EAGAIN || ret == EWOULDBLOCK) {
+				if(use_splice) ret = splice_wait(sock, fd, deadline);
+				else ret = rocksock_wait(sock, RS_WANT_WRITE, deadline);
+				if(ret) return ret;
+				continue;
+			}
+			/* the file type doesn't support it, copy the rest */
+			if((ret == EINVAL || ret == ENOSYS) && !*byteswritten)
+				return sendfile_copy(sock, fd, off, seekable, len, byteswritten);
+			if(ret == EPIPE || ret == ECONNRESET) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+			return MKSYSERR(sock, ret);
+		}
+		*byteswritten += ret;
+	}
+	return NOERR(sock);
+#else
+	return sendfile_copy(sock, fd, off, seekable, len, byteswritten);
+#endif
+}
@@ -4,9 +4,13 @@
 #include "rocksock.h"
 
 const char* rocksock_ssl_strerror(rocksock *sock, int error);
-int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz);
-int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz);
-int rocksock_ssl_connect_fd(rocksock* sock);
+/* return what SSL_write/SSL_read do. if they would block, errno is set to
+   EWOULDBLOCK and want to the RS_WANT_* condition to wait for. */
+int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz, int *want);
+int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz, int *want);
+/* does as much of the handshake as the socket allows. returns 0 and sets
+   want to the RS_WANT_* condition to wait for, or to 0 once done. */
+int rocksock_ssl_connect_step(rocksock* sock, int *want);
 void rocksock_ssl_free_context(rocksock *sock);
 int rocksock_ssl_peek(rocksock* sock, int *result);
 int rocksock_ssl_pending(rocksock *sock);
@@ -0,0 +1,96 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* MSG_ZEROCOPY support. every send with the flag gets an id from the
+   kernel, counting up from 0, and the kernel reports ranges of ids it no
+   longer needs the pages of on the error queue of the socket. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#define MKOERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
+#define NOERR(S) rocksock_seterror(S, RS_ET_OWN, 0, NULL, 0)
+#define MKSYSERR(S, X) rocksock_seterror(S, RS_ET_SYS, X, ROCKSOCK_FILENAME, __LINE__)
+
+#if defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+
+int rocksock_set_zerocopy(rocksock* sock, size_t threshold) {
+	int on = !!threshold;
+	if (!sock) return RS_E_NULL;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	if (setsockopt(sock->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+		return MKSYSERR(sock, errno);
+	sock->zerocopy = threshold;
+	return NOERR(sock);
+}
+
+int rocksock_zerocopy_reap(rocksock* sock) {
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr* cm;
+	struct sock_extended_err* ee;
+	for(;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock->socket, &msg, MSG_ERRQUEUE) == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINTR) continue;
+			return MKSYSERR(sock, errno);
+		}
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			   !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) continue;
+			ee = (struct sock_extended_err*) CMSG_DATA(cm);
+			if(ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			/* ee_info to ee_data, inclusive */
+			sock->zc_done += ee->ee_data - ee->ee_info + 1;
+		}
+	}
+}
+
+int rocksock_zerocopy_wait(rocksock* sock, unsigned long long deadline) {
+	int ret;
+	for(;;) {
+		if((ret = rocksock_zerocopy_reap(sock))) return ret;
+		if(sock->zc_done == sock->zc_sent) return 0;
+		/* poll reports the error queue getting filled as POLLERR */
+		if((ret = rocksock_wait(sock, 0, deadline))) return ret;
+	}
+}
+
+#else
+
+int rocksock_set_zerocopy(rocksock* sock, size_t threshold) {
+	if (!sock) return RS_E_NULL;
+	if (!threshold) return NOERR(sock);
+	return MKSYSERR(sock, ENOPROTOOPT);
+}
+
+int rocksock_zerocopy_reap(rocksock* sock) {
+	return 0;
+}
+
+int rocksock_zerocopy_wait(rocksock* sock, unsigned long long deadline) {
+	return 0;
+}
+
+#endif
@@ -50,10 +50,13 @@ int rsirc_privmsgf(struct rsirc *r, const char *dest, const char *fmt, ...) {
 int rsirc_handshake(struct rsirc *r, const char* host, const char* nick, const char* user) {
 	char cmdbuf[512];
 	int ret;
+	/* both lines in one packet */
+	chk(rocksock_cork(r->s, r->corkbuf, sizeof r->corkbuf));
 	snprintf(cmdbuf, sizeof(cmdbuf), "NICK %s", nick);
 	chk(sendl(cmdbuf));
 	snprintf(cmdbuf, sizeof(cmdbuf), "USER %s %s %s :%s", user, user, host, nick);
 	chk(sendl(cmdbuf));
+	chk(rocksock_cork(r->s, 0, 0));
         return 0;
 }
 
@@ -2,6 +2,8 @@
 
 typedef struct rsirc {
 	struct rocksock *s;
+	/* write buffer for the handshake */
+	char corkbuf[1024];
 } rsirc;
 
 int rsirc_init(struct rsirc *r, struct rocksock *s);
@@ -19,27 +19,24 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #endif // !WIN32
+#include "rocksockserver_internal.h"
+#ifdef RSS_HAVE_WORKERS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "rocksockserver.h"
 
-#include "endianness.h"
-
-#define LOGP(X) do { if(srv->perr) srv->perr(X); } while(0)
-
 #ifdef USE_LIBULZ
 #include "../lib/include/strlib.h"
-#include "../lib/include/timelib.h"
 #else
 #include <stdio.h>
 #ifndef WIN32
 #include <arpa/inet.h>
-#define microsleep(X) usleep(X)
-#else
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#define microsleep(X) Sleep((X)/1000)
 #endif
 
 static inline char* my_intToString(int i, char *b, size_t s) {
@@ -84,26 +81,127 @@ int rocksockserver_resolve_host(rs_hostInfo* hostinfo) {
 #endif
 }
 
-/* returns 0 on success.
-   possible error return codes:
-   -1: erroneus parameter
-   -2: bind() failed
-   -3: socket() failed
-   -4: listen() failed
-   positive number: dns error, pass to gai_strerror()
-*/
-int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata) {
+
+static int rss_fdlimit(const rss_backend* backend) {
+	long limit;
+#ifdef RSS_HAVE_EPOLL
+	struct rlimit rl;
+	if(backend != &rss_backend_select) {
+		if(getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20))
+			limit = 1 << 20;
+		else
+			limit = rl.rlim_cur;
+	} else
+#endif
+	limit = FD_SETSIZE;
+#ifdef USER_MAX_FD
+	if(limit > USER_MAX_FD) limit = USER_MAX_FD;
+#endif
+	return limit;
+}
+
+/* engines in order of preference, init picks the first one that works */
+static const rss_backend* const rss_backends[] = {
+#ifdef RSS_HAVE_URING
+	&rss_backend_uring,
+#endif
+#ifdef RSS_HAVE_EPOLL
+	&rss_backend_epoll,
+#endif
+	&rss_backend_select,
+};
+
+#define RSS_NUM_BACKENDS (sizeof(rss_backends) / sizeof(rss_backends[0]))
+
+/* entries the conn table starts with */
+#define RSS_CONNS_MIN 64
+
+/* the conn table doubles until fd fits, up to fdlimit. the idle timers of
+   the conns are linked into the wheel, so the wheel is told about the move. */
+static int rss_grow(rocksockserver* srv, int fd) {
+	uintptr_t old = (uintptr_t) srv->conns;
+	int cap = srv->fdcap ? srv->fdcap : RSS_CONNS_MIN;
+	rss_conn* conns;
+	while(cap <= fd) cap *= 2;
+	if(cap > srv->fdlimit) cap = srv->fdlimit;
+	if(!(conns = realloc(srv->conns, cap * sizeof(rss_conn)))) {
+		LOGP("malloc");
+		return -1;
+	}
+	memset(conns + srv->fdcap, 0, (cap - srv->fdcap) * sizeof(rss_conn));
+	srv->conns = conns;
+	rss_timer_moved(srv, old, srv->fdcap);
+	srv->fdcap = cap;
+	return 0;
+}
+
+static int rss_watch(rocksockserver* srv, int fd, int events) {
+	if(fd < 0 || fd >= srv->fdlimit) return -1;
+	if(fd >= srv->fdcap && rss_grow(srv, fd)) return -1;
+	if(srv->conns[fd].flags & RSS_F_WATCHED) return 0;
+	srv->conns[fd].gen++;
+	if(srv->backend->add(srv, fd, events)) return -1;
+	srv->conns[fd].flags = RSS_F_WATCHED | ((events & RSS_EV_WRITE) ? RSS_F_WANTWRITE : 0) |
+	                       ((events & RSS_EV_STREAM) ? RSS_F_STREAM : 0) |
+	                       (srv->conns[fd].flags & RSS_F_QPENDING);
+	if(fd > srv->maxfd) srv->maxfd = fd;
+	srv->numfds++;
+	return 0;
+}
+
+/* events to register fd with, derived from its flags */
+static int rss_events(rss_conn* c) {
+	return RSS_EV_READ |
+	       ((c->flags & (RSS_F_WANTWRITE | RSS_F_QWRITE)) ? RSS_EV_WRITE : 0) |
+	       ((c->flags & RSS_F_STREAM) ? RSS_EV_STREAM : 0);
+}
+
+#ifdef RSS_HAVE_WORKERS
+__thread rocksockserver* rss_current_worker;
+#endif
+
+static int rss_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata, int reuseport) {
+	size_t i = 0;
 	int ret = 0;
 	int yes = 1;
 	rs_hostInfo conn;
-	if(!srv || !listenip || !port) return -1;
 	conn.host = listenip;
 	conn.port = port;
+	srv->workers = 0;
+	srv->nworkers = 0;
 	FD_ZERO(&srv->master);
+	FD_ZERO(&srv->wmaster);
 	srv->userdata = userdata;
-	srv->sleeptime_us = 20000; // set a reasonable default value. it's a compromise between throughput and cpu usage basically.
+	srv->idle_timeout = 0;
+	srv->wheel = 0;
+	srv->listensocket = -1;
+	srv->signalfd = -1;
+	srv->maxfd = -1;
+	srv->numfds = 0;
+	srv->pollfd = -1;
+	srv->qpending = -1;
+	srv->inpool = 0;
+	srv->ctxpool = 0;
+	srv->engine = 0;
+	srv->backend = rss_backends[0];
+	srv->conns = 0;
+	srv->fdcap = 0;
+	if(rss_timer_init(srv)) {
+		LOGP("malloc");
+		rocksockserver_free(srv);
+		return -5;
+	}
+	for(i = 0; srv->backend->init(srv); srv->backend = rss_backends[i]) {
+		if(++i == RSS_NUM_BACKENDS) {
+			LOGP(srv->backend->name);
+			srv->backend = 0;
+			rocksockserver_free(srv);
+			return -5;
+		}
+	}
+	srv->fdlimit = rss_fdlimit(srv->backend);
 	ret = rocksockserver_resolve_host(&conn);
-	if(ret) return ret;
+	if(ret) goto fail;
 #ifndef IPV4_ONLY
 	struct addrinfo* p;
 	for(p = conn.hostaddr; p != NULL; p = p->ai_next) {
@@ -114,13 +212,14 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 
 		// lose the pesky "address already in use" error message
 		setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#ifdef RSS_HAVE_WORKERS
+		// every worker binds its own socket to the same address
+		if(reuseport) setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#endif
 
 		if (bind(srv->listensocket, p->ai_addr, p->ai_addrlen) < 0) {
-#ifdef WIN32
-			closesocket(srv->listensocket);
-#else
-			close(srv->listensocket);
-#endif
+			rss_closesocket(srv->listensocket);
+			srv->listensocket = -1;
 			continue;
 		}
 
@@ -131,189 +230,464 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 		ret = -2;
 	}
 	freeaddrinfo(conn.hostaddr);
-	if(ret == -2) return -2;
+	if(ret == -2) goto fail;
 #else
 	srv->listensocket = socket(AF_INET, SOCK_STREAM, 0);
 	if(srv->listensocket < 0) {
 		LOGP("socket");
-		return -3;
+		ret = -3;
+		goto fail;
 	}
 	setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#ifdef RSS_HAVE_WORKERS
+	if(reuseport) setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#endif
 	if(bind(srv->listensocket, (struct sockaddr*) &conn.hostaddr, sizeof(struct sockaddr_in)) < 0) {
-		close(srv->listensocket);
 		LOGP("bind");
-		return -2;
+		ret = -2;
+		goto fail;
 	}
 
+#endif
+#ifndef WIN32
+	// accept until EAGAIN without blocking the loop
+	fcntl(srv->listensocket, F_SETFL, fcntl(srv->listensocket, F_GETFL) | O_NONBLOCK);
 #endif
 	// listen
-	if (listen(srv->listensocket, 10) == -1) {
+	if (listen(srv->listensocket, RSS_LISTEN_BACKLOG) == -1) {
 		LOGP("listen");
 		ret = -4;
-	} else {
-		FD_SET(srv->listensocket, &srv->master);
-		srv->maxfd = srv->listensocket;
-	}
+	} else if(rss_watch(srv, srv->listensocket, RSS_EV_READ)) {
+		LOGP(srv->backend->name);
+		ret = -5;
+	} else return 0;
+fail:
+	rocksockserver_free(srv);
 	return ret;
 }
 
-int rocksockserver_disconnect_client(rocksockserver* srv, int client) {
-	if(client < 0 || client > USER_MAX_FD) return -1;
-	if(FD_ISSET(client, &srv->master)) {
-#ifdef WIN32
-		closesocket(client);
+/* returns 0 on success.
+   possible error return codes:
+   -1: erroneus parameter
+   -2: bind() failed
+   -3: socket() failed
+   -4: listen() failed
+   -5: setting up the event engine failed
+   positive number: dns error, pass to gai_strerror()
+*/
+int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata) {
+	if(!srv || !listenip || !port) return -1;
+	srv->parent = 0;
+	return rss_init(srv, listenip, port, userdata, 0);
+}
+
+/* same return codes as rocksockserver_init, -5 also if the workers
+   couldn't be allocated. */
+int rocksockserver_init_workers(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata,
+                                int nworkers, int pin_cpus) {
+#ifdef RSS_HAVE_WORKERS
+	int i, ret;
+	if(!srv || !listenip || !port) return -1;
+	if(nworkers <= 1) return rocksockserver_init(srv, listenip, port, userdata);
+	memset(srv, 0, sizeof *srv);
+	srv->listensocket = -1;
+	srv->signalfd = -1;
+	srv->pollfd = -1;
+	srv->maxfd = -1;
+	srv->userdata = userdata;
+	srv->qpending = -1;
+	srv->pin_cpus = pin_cpus;
+	srv->wakefd[0] = srv->wakefd[1] = -1;
+	if(!(srv->workers = calloc(nworkers, sizeof(rocksockserver)))) return -5;
+	for(i = 0; i < nworkers; i++) {
+		srv->workers[i].parent = srv;
+		if((ret = rss_init(&srv->workers[i], listenip, port, userdata, 1))) {
+			srv->nworkers = i;
+			rocksockserver_free(srv);
+			return ret;
+		}
+	}
+	srv->nworkers = nworkers;
+	return 0;
 #else
-		close(client);
+	(void) nworkers; (void) pin_cpus;
+	return rocksockserver_init(srv, listenip, port, userdata);
 #endif
-		FD_CLR(client, &srv->master);
-		if(client == srv->maxfd)
-			srv->maxfd--;
-		srv->numfds--;
-		return 0;
+}
+
+char* rocksockserver_buf(rocksockserver* srv) {
+	return rss_self(srv)->buf;
+}
+
+void rocksockserver_free(rocksockserver* srv) {
+	int i;
+	if(srv->workers) {
+		for(i = 0; i < srv->nworkers; i++)
+			rocksockserver_free(&srv->workers[i]);
+		free(srv->workers);
+		srv->workers = 0;
+		srv->nworkers = 0;
+		return;
 	}
-	return 1;
+	if(srv->listensocket != -1) {
+		rss_closesocket(srv->listensocket);
+		srv->listensocket = -1;
+	}
+	for(i = 0; srv->conns && i <= srv->maxfd; i++)
+		if(srv->conns[i].qhead) rss_queue_free(srv, i);
+	rss_pool_free(srv->inpool);
+	srv->inpool = 0;
+	rss_pool_free(srv->ctxpool);
+	srv->ctxpool = 0;
+	if(srv->backend) srv->backend->free(srv);
+	rss_timer_free(srv);
+	free(srv->conns);
+	srv->conns = 0;
+	srv->fdlimit = 0;
+	srv->fdcap = 0;
 }
 
-void rocksockserver_watch_fd(rocksockserver* srv, int newfd) {
-	FD_SET(newfd, &srv->master);
-	if (newfd > srv->maxfd)
-		srv->maxfd = newfd;
+int rocksockserver_disconnect_client(rocksockserver* srv, int client) {
+	srv = rss_self(srv);
+	if(client < 0 || client >= srv->fdlimit) return -1;
+	if(client >= srv->fdcap || !(srv->conns[client].flags & RSS_F_WATCHED)) return 1;
+	srv->backend->del(srv, client);
+	rss_timer_stop_idle(srv, client);
+	rss_queue_free(srv, client);
+	rss_inbuf_release(srv, client);
+	if(srv->conns[client].arena) rss_pool_put(srv->ctxpool, srv->conns[client].arena);
+	srv->conns[client].arena = 0;
+	srv->conns[client].ctx = 0;
+	srv->conns[client].flags &= RSS_F_QPENDING;
+	while(srv->maxfd >= 0 && !(srv->conns[srv->maxfd].flags & RSS_F_WATCHED))
+		srv->maxfd--;
+	srv->numfds--;
+	rss_closesocket(client);
+	return 0;
 }
 
-int rocksockserver_loop(rocksockserver* srv,
-			char* buf, size_t bufsize,
-			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd),
-			int (*on_clientread) (void* userdata, int fd, size_t nread),
-			int (*on_clientwantsdata) (void* userdata, int fd),
-			int (*on_clientdisconnect) (void* userdata, int fd)
-) {
-	fd_set read_fds, write_fds;
-	int newfd, k;
-	int lastfd = 3;
-#ifdef IS_LITTLE_ENDIAN
+int rss_set_interest(rocksockserver* srv, int fd, unsigned flags) {
+	rss_conn* c = &srv->conns[fd];
+	const unsigned mask = RSS_F_WANTWRITE | RSS_F_QWRITE;
+	flags = (c->flags & ~mask) | (flags & mask);
+	if(!(c->flags & mask) != !(flags & mask) &&
+	   srv->backend->mod(srv, fd, RSS_EV_READ | ((flags & mask) ? RSS_EV_WRITE : 0))) {
+		LOGP("want_write");
+		return -1;
+	}
+	c->flags = flags;
+	return 0;
+}
+
+void* rocksockserver_ctx(rocksockserver* srv, int fd) {
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd)) return 0;
+	return srv->conns[fd].ctx;
+}
+
+int rocksockserver_set_ctx(rocksockserver* srv, int fd, void* ctx) {
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd)) return -1;
+	srv->conns[fd].ctx = ctx;
+	return 0;
+}
+
+int rocksockserver_set_ctx_size(rocksockserver* srv, size_t size) {
 	int i;
-	size_t j;
-#endif
-	ptrdiff_t nbytes;
-	struct sockaddr_storage remoteaddr; // client address
-	socklen_t addrlen;
-	char* fdptr;
-	fd_set* setptr;
+	for(i = 0; i < srv->nworkers; i++)
+		if(rocksockserver_set_ctx_size(&srv->workers[i], size)) return -2;
+	if(srv->workers) return 0;
+	rss_pool_free(srv->ctxpool);
+	srv->ctxpool = 0;
+	if(size && !(srv->ctxpool = rss_pool_new(size))) return -2;
+	return 0;
+}
 
-	for(;;) {
+int rocksockserver_set_engine(rocksockserver* srv, const char* name) {
+	const rss_backend* old = srv->backend;
+	size_t i;
+	int fd, limit, ret;
+	for(i = 0; i < RSS_NUM_BACKENDS; i++)
+		if(!strcmp(rss_backends[i]->name, name)) break;
+	if(i == RSS_NUM_BACKENDS) return -1;
+	for(fd = 0; fd < srv->nworkers; fd++)
+		if((ret = rocksockserver_set_engine(&srv->workers[fd], name))) return ret;
+	if(srv->workers || old == rss_backends[i]) return 0;
+	limit = rss_fdlimit(rss_backends[i]);
+	for(fd = limit; fd <= srv->maxfd; fd++)
+		if(srv->conns[fd].flags & RSS_F_WATCHED) return -1;
+	old->free(srv);
+	srv->backend = rss_backends[i];
+	if(srv->backend->init(srv)) {
+		LOGP(srv->backend->name);
+		srv->backend = old;
+		if(old->init(srv)) return -5;
+		limit = srv->fdlimit;
+	}
+	srv->fdlimit = limit;
+	// register everything that was watched with the new engine
+	for(fd = 0; fd <= srv->maxfd; fd++)
+		if((srv->conns[fd].flags & RSS_F_WATCHED) && srv->backend->add(srv, fd, rss_events(&srv->conns[fd]))) {
+			LOGP(srv->backend->name);
+			return -5;
+		}
+	// sends the old engine had in flight went back to the queues
+	for(fd = 0; fd <= srv->maxfd; fd++)
+		if((srv->conns[fd].flags & RSS_F_WATCHED) && srv->conns[fd].qhead) rss_queue_flush(srv, fd);
+	return srv->backend == old ? -5 : 0;
+}
+
+const char* rocksockserver_engine(rocksockserver* srv) {
+	return rss_self(srv)->backend->name;
+}
+
+int rocksockserver_want_write(rocksockserver* srv, int fd, int on) {
+	unsigned flags;
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd)) return -1;
+	flags = srv->conns[fd].flags & ~RSS_F_WANTWRITE;
+	return rss_set_interest(srv, fd, flags | (on ? RSS_F_WANTWRITE : 0));
+}
+
+void rocksockserver_watch_fd(rocksockserver* srv, int newfd) {
+	srv = rss_self(srv);
+	if(rss_watch(srv, newfd, RSS_EV_READ))
+		LOGP("watch_fd");
+}
 
-		read_fds = srv->master;
-		write_fds = srv->master;
-
-		if ((srv->numfds = select(srv->maxfd+1, &read_fds, &write_fds, NULL, NULL)) && srv->numfds == -1)
-			LOGP("select");
-
-		if(!srv->numfds) continue;
-
-		// optimization for the case searched_fd = lastfd, when we only have to handle one connection.
-		// i guess that should be the majority of cases.
-		k = lastfd;
-		setptr = &write_fds;
-		if(FD_ISSET(k, setptr)) goto gotcha;
-		setptr = &read_fds;
-		if(FD_ISSET(k, setptr)) goto gotcha;
-
-		nextfd:
-		setptr = &write_fds;
-		loopstart:
-		fdptr = (char*) setptr;
-#ifdef IS_LITTLE_ENDIAN
-		for(i = 0; i * CHAR_BIT <= srv->maxfd; i+= sizeof(size_t)) { // we assume that sizeof(fd_set) is a multiple of sizeof(size_t)
-			if( *(size_t*)(fdptr + i)) {
-				for(j = 0; j <= sizeof(size_t); j++) {
-					if(fdptr[i + j]) {
-						for(k = (i + j) * CHAR_BIT; k <= srv->maxfd; k++) {
+static int rss_accept_one(rocksockserver* srv, struct sockaddr_storage* remoteaddr) {
+	socklen_t addrlen = sizeof(*remoteaddr);
+	int fd;
+	// the client fd doesn't inherit O_NONBLOCK from the listener on linux,
+	// so it stays blocking like it always was
+#if defined(__linux__) && defined(SOCK_CLOEXEC)
+	fd = accept4(srv->listensocket, (struct sockaddr *)remoteaddr, &addrlen, SOCK_CLOEXEC);
 #else
-						for(k = 0; k <= srv->maxfd; k++) {
+	fd = accept(srv->listensocket, (struct sockaddr *)remoteaddr, &addrlen);
+#ifndef WIN32
+	if(fd != -1) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
 #endif
-							if(FD_ISSET(k, setptr)) {
-								gotcha:
-								srv->numfds--;
-								FD_CLR(k, setptr);
-								if(setptr == &write_fds)
-									goto handlewrite;
-								else
-									goto handleread;
-							}
-						}
-#ifdef IS_LITTLE_ENDIAN
-					}
-				}
-			}
-		}
-
 #endif
+	return fd;
+}
 
-		if(setptr == &write_fds) {
-			setptr = &read_fds;
-			goto loopstart;
-		} else {
-			LOGP("FATAL");
-			/*
-			printf("maxfd %d, k %d, numfds %d, set %d\n", srv->maxfd, k, srv->numfds, *(int*)(fdptr));
-			for(k = 0; k < USER_MAX_FD; k++)
-				if(FD_ISSET(k, setptr))
-					printf("bit set: %d\n", k);
-			*/
-			return 1;
+void rss_accepted(rocksockserver* srv, int newfd, struct sockaddr_storage* remoteaddr) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	// only fds below fdlimit can be handled.
+	if (rss_watch(srv, newfd, RSS_EV_READ | RSS_EV_STREAM)) {
+		rss_closesocket(newfd);
+		return;
+	}
+	if(srv->ctxpool) {
+		if(!(srv->conns[newfd].arena = rss_pool_get(srv->ctxpool))) {
+			LOGP("malloc");
+			rocksockserver_disconnect_client(srv, newfd);
+			return;
 		}
+		memset(srv->conns[newfd].arena, 0, srv->ctxpool->size);
+		srv->conns[newfd].ctx = srv->conns[newfd].arena;
+	}
+	srv->conns[newfd].idle_timeout = srv->idle_timeout;
+	rss_timer_start_idle(srv, newfd);
+	if(!remoteaddr) {
+		memset(&addr, 0, sizeof addr);
+		getpeername(newfd, (struct sockaddr*) &addr, &addrlen);
+		remoteaddr = &addr;
+	}
+	if(srv->on_clientconnect) srv->on_clientconnect(srv->userdata, remoteaddr, newfd);
+}
 
-		handleread:
-		//printf("read_fd %d\n", k);
-		if (k == srv->listensocket) {
-			// new connection available
-			addrlen = sizeof(remoteaddr);
-			newfd = accept(srv->listensocket, (struct sockaddr *)&remoteaddr, &addrlen);
+static void rss_accept(rocksockserver* srv) {
+	struct sockaddr_storage remoteaddr; // client address
+	int i, newfd;
 
-			if (newfd == -1) {
+	// drain the accept queue, but leave the rest of a storm for the next
+	// round so the other clients get served in between.
+	for(i = 0; i < RSS_ACCEPT_BATCH; i++) {
+		if((newfd = rss_accept_one(srv, &remoteaddr)) == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
 				LOGP("accept");
-			} else {
-				if (newfd >= USER_MAX_FD)
-#ifdef WIN32
-					closesocket(newfd);
-#else
-					close(newfd); // only USER_MAX_FD connections can be handled.
+			return;
+		}
+		rss_accepted(srv, newfd, &remoteaddr);
+	}
+}
+
+void rss_dispatch_data(rocksockserver* srv, int fd, const char* data, size_t len) {
+	srv->conns[fd].last_active = rss_timer_now(srv);
+	if(!len) {
+		if(srv->on_clientdisconnect) srv->on_clientdisconnect(srv->userdata, fd);
+		rocksockserver_disconnect_client(srv, fd);
+		return;
+	}
+	memcpy(srv->buf, data, len);
+	if(srv->on_clientread) srv->on_clientread(srv->userdata, fd, len);
+}
+
+void rss_dispatch(rocksockserver* srv, int fd, int events) {
+	ptrdiff_t nbytes;
+	if (fd == srv->listensocket) {
+		// new connection available
+		rss_accept(srv);
+		return;
+	}
+#ifdef RSS_HAVE_WORKERS
+	// the wakeup pipe, rss_run checks the stop flag after every round
+	if(srv->parent && fd == srv->parent->wakefd[0]) return;
 #endif
-				else {
-					FD_SET(newfd, &srv->master);
-					if (newfd > srv->maxfd)
-						srv->maxfd = newfd;
-					if(on_clientconnect) on_clientconnect(srv->userdata, &remoteaddr, newfd);
-				}
+	if((events & RSS_EV_WRITE) && (srv->conns[fd].flags & RSS_F_QWRITE))
+		rss_queue_flush(srv, fd);
+	if((events & RSS_EV_WRITE) && (srv->conns[fd].flags & RSS_F_WANTWRITE)) {
+		if(srv->on_clientwantsdata) srv->on_clientwantsdata(srv->userdata, fd);
+		// the callback may have disconnected the client
+		if(!rss_is_watched(srv, fd)) return;
+	}
+	if(!(events & RSS_EV_READ)) return;
+	srv->conns[fd].last_active = rss_timer_now(srv);
+	if(srv->inpool && fd != srv->signalfd) {
+		rss_inbuf_read(srv, fd);
+	} else if(srv->buf && fd != srv->signalfd) {
+		if ((nbytes = recv(fd, srv->buf, srv->bufsize, 0)) <= 0) {
+			if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				return;
+			} else if (nbytes == 0) {
+				if(srv->on_clientdisconnect) srv->on_clientdisconnect(srv->userdata, fd);
+			} else {
+				LOGP("recv");
 			}
+			rocksockserver_disconnect_client(srv, fd);
 		} else {
-			if(buf && k != srv->signalfd) {
-				if ((nbytes = recv(k, buf, bufsize, 0)) <= 0) {
-					if (nbytes == 0) {
-						if(on_clientdisconnect) on_clientdisconnect(srv->userdata, k);
-					} else {
-						LOGP("recv");
-					}
-					rocksockserver_disconnect_client(srv, k);
-				} else {
-					if(on_clientread) on_clientread(srv->userdata, k, nbytes);
-				}
-			} else {
+			if(srv->on_clientread) srv->on_clientread(srv->userdata, fd, nbytes);
+		}
+	} else {
+		if(srv->on_clientread) srv->on_clientread(srv->userdata, fd, 0);
+	}
+}
 
-				if(on_clientread) on_clientread(srv->userdata, k, 0);
-			}
+static int rss_run(rocksockserver* srv) {
+	for(;;) {
+#ifdef RSS_HAVE_WORKERS
+		if(srv->parent && __atomic_load_n(&srv->parent->stop, __ATOMIC_ACQUIRE)) return 0;
+#endif
+		// send what the callbacks queued during the last round
+		rss_queue_flush_pending(srv);
+		// block until an fd is ready or the next timer is due
+		if(srv->backend->wait(srv, rss_timer_next(srv)) == -1 && errno != EINTR) {
+			LOGP(srv->backend->name);
+			return 1;
 		}
-		goto zzz;
+		rss_timer_run(srv);
+	}
+	return 0;
+}
 
-		handlewrite:
+#ifdef RSS_HAVE_WORKERS
+/* makes the loops of all workers return */
+static void rss_stop_workers(rocksockserver* srv) {
+	__atomic_store_n(&srv->stop, 1, __ATOMIC_RELEASE);
+	// the byte is never read, so the pipe stays readable for every worker
+	write(srv->wakefd[1], "", 1);
+}
 
-		//printf("write_fd %d\n", k);
-		if(on_clientwantsdata) on_clientwantsdata(srv->userdata, k);
+static void* rss_worker_main(void* arg) {
+	rocksockserver* srv = arg;
+	long ncpu;
+	cpu_set_t set;
+	int ret;
+	rss_current_worker = srv;
+	if(srv->parent->pin_cpus && (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+		CPU_ZERO(&set);
+		CPU_SET((srv - srv->parent->workers) % ncpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+			LOGP("pthread_setaffinity_np");
+	}
+	ret = rss_run(srv);
+	rss_stop_workers(srv->parent);
+	rss_current_worker = 0;
+	return ret ? srv : 0;
+}
 
-		zzz:
-		if(srv->numfds > 0) goto nextfd;
-		lastfd = k;
-		microsleep(srv->sleeptime_us);
+static int rss_run_workers(rocksockserver* srv) {
+	pthread_t* threads;
+	rocksockserver* w;
+	void* res;
+	int i, n = 1, ret = 1;
+	if(!(threads = calloc(srv->nworkers, sizeof *threads))) return 1;
+	if(pipe(srv->wakefd)) {
+		srv->wakefd[0] = srv->wakefd[1] = -1;
+		free(threads);
+		return 1;
 	}
-	return 0;
+	fcntl(srv->wakefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(srv->wakefd[1], F_SETFD, FD_CLOEXEC);
+	srv->stop = 0;
+	for(i = 0; i < srv->nworkers; i++) {
+		w = &srv->workers[i];
+		// the first worker runs on the buffer passed to the loop
+		w->buf = i ? 0 : srv->buf;
+		w->bufsize = srv->bufsize;
+		w->on_clientconnect = srv->on_clientconnect;
+		w->on_clientread = srv->on_clientread;
+		w->on_clientwantsdata = srv->on_clientwantsdata;
+		w->on_clientdisconnect = srv->on_clientdisconnect;
+	}
+	for(i = 0; i < srv->nworkers; i++) {
+		w = &srv->workers[i];
+		if(i && srv->buf && !(w->buf = malloc(srv->bufsize))) goto out;
+		if(rss_watch(w, srv->wakefd[0], RSS_EV_READ)) {
+			LOGP("watch_fd");
+			goto out;
+		}
+	}
+	for(; n < srv->nworkers; n++)
+		if(pthread_create(&threads[n], 0, rss_worker_main, &srv->workers[n])) {
+			LOGP("pthread_create");
+			rss_stop_workers(srv);
+			break;
+		}
+	// the first worker runs on the calling thread
+	if(n == srv->nworkers) ret = rss_worker_main(srv->workers) != 0;
+	for(i = 1; i < n; i++)
+		if(!pthread_join(threads[i], &res) && res) ret = 1;
+out:
+	for(i = 0; i < srv->nworkers; i++) {
+		w = &srv->workers[i];
+		if(rss_is_watched(w, srv->wakefd[0])) {
+			w->backend->del(w, srv->wakefd[0]);
+			w->conns[srv->wakefd[0]].flags &= RSS_F_QPENDING;
+			w->numfds--;
+		}
+		if(i) free(w->buf);
+		w->buf = 0;
+	}
+	close(srv->wakefd[0]);
+	close(srv->wakefd[1]);
+	srv->wakefd[0] = srv->wakefd[1] = -1;
+	free(threads);
+	return ret;
+}
+#endif
+
+int rocksockserver_loop(rocksockserver* srv,
+			char* buf, size_t bufsize,
+			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd),
+			int (*on_clientread) (void* userdata, int fd, size_t nread),
+			int (*on_clientwantsdata) (void* userdata, int fd),
+			int (*on_clientdisconnect) (void* userdata, int fd)
+) {
+	srv->buf = buf;
+	srv->bufsize = bufsize;
+	srv->on_clientconnect = on_clientconnect;
+	srv->on_clientread = on_clientread;
+	srv->on_clientwantsdata = on_clientwantsdata;
+	srv->on_clientdisconnect = on_clientdisconnect;
+
+#ifdef RSS_HAVE_WORKERS
+	if(srv->workers) return rss_run_workers(srv);
+#endif
+	return rss_run(srv);
 }
@@ -1,15 +1,17 @@
 /*
- * 
+ *
  * author: rofl0r
- * 
+ *
  * License: LGPL 2.1+ with static linking exception
- * 
- * 
+ *
+ *
  */
 
 
 #ifndef _ROCKSOCKSERVER_H_
 #define _ROCKSOCKSERVER_H_
+#include <stddef.h>
+#include <sys/types.h>
 #ifndef WIN32
 #include <netdb.h>
 #include <sys/socket.h>
@@ -20,32 +22,186 @@
 #include <ws2tcpip.h>
 #endif // !WIN32
 
-#if (! defined(USER_MAX_FD)) || (USER_MAX_FD > FD_SETSIZE)
-#undef USER_MAX_FD
-#define USER_MAX_FD FD_SETSIZE
-#endif
+/* the event engine is picked at init time: io_uring on linux if the kernel
+   supports it (6.0+), epoll on linux otherwise, select() elsewhere.
+   NO_URING and NO_EPOLL leave the respective engine out, the former is needed
+   when building against kernel headers older than 6.0.
+   the select engine can only handle fds < FD_SETSIZE, the others take their
+   limit from RLIMIT_NOFILE. defining USER_MAX_FD lowers either limit. */
+
+struct rss_backend;
+struct rss_conn;
+struct rss_wheel;
+struct rss_pool;
+
+/* node of the timer wheel, embedded in every timer */
+struct rss_tnode {
+	struct rss_tnode *next, **pprev;
+	unsigned long long expires;
+};
+
+/* caller-allocated timer, see rocksockserver_add_timer */
+typedef struct rocksockserver_timer {
+	struct rss_tnode node;
+	unsigned long interval;
+	int (*func) (void* userdata, struct rocksockserver_timer* t);
+} rocksockserver_timer;
 
 typedef void (*perror_func)(const char*);
-typedef struct {
+typedef struct rocksockserver {
 	fd_set master;
+	fd_set wmaster;
 	int listensocket;
 	int maxfd;
 	int numfds;
 	int signalfd;
 	void* userdata;
-	long sleeptime_us;
 	perror_func perr;
+	const struct rss_backend *backend;
+	int pollfd;
+	void *engine;
+	int fdlimit;
+	int fdcap;
+	struct rss_conn *conns;
+	struct rss_wheel *wheel;
+	unsigned long idle_timeout;
+	int qpending;
+	struct rss_pool *inpool;
+	struct rss_pool *ctxpool;
+	/* worker mode, see rocksockserver_init_workers */
+	struct rocksockserver *workers;
+	struct rocksockserver *parent;
+	int nworkers;
+	int pin_cpus;
+	/* set once a worker stopped, the pipe wakes up the others */
+	int stop;
+	int wakefd[2];
+	/* the following are set up by rocksockserver_loop */
+	char* buf;
+	size_t bufsize;
+	int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd);
+	int (*on_clientread) (void* userdata, int fd, size_t nread);
+	int (*on_clientwantsdata) (void* userdata, int fd);
+	int (*on_clientdisconnect) (void* userdata, int fd);
 } rocksockserver;
 
+/* no-op, kept for API compatibility. the loop blocks until an fd is ready
+   or the next timer is due, so there's nothing to tune anymore. */
 void rocksockserver_set_sleeptime(rocksockserver* srv, long microsecs);
+/* arms t to call func from the loop after timeout_ms, and then every
+   interval_ms if interval_ms is non-zero. t is owned by the caller, has to be
+   zeroed before its first use and must stay valid until it fired (one-shot)
+   or was removed with del_timer. re-adding an armed timer re-arms it. */
+void rocksockserver_add_timer(rocksockserver* srv, rocksockserver_timer* t,
+                              unsigned long timeout_ms, unsigned long interval_ms,
+                              int (*func) (void* userdata, rocksockserver_timer* t));
+void rocksockserver_del_timer(rocksockserver* srv, rocksockserver_timer* t);
+/* clients that didn't send anything for timeout_ms get on_clientdisconnect
+   called and are disconnected. fd -1 sets the default for new clients.
+   0 disables the timeout. returns 0 on success, -1 if fd is not watched. */
+int rocksockserver_set_idle_timeout(rocksockserver* srv, int fd, unsigned long timeout_ms);
 int rocksockserver_disconnect_client(rocksockserver* srv, int client);
+/* clients start out without write interest, so on_clientwantsdata is only
+   called for fds that asked for it. enable it when the app has output pending
+   and disable it once everything is sent. returns 0 on success, -1 if fd is
+   not watched. */
+int rocksockserver_want_write(rocksockserver* srv, int fd, int on);
+/* queues len bytes of buf to be sent to fd. queued data goes out at the end
+   of the current loop iteration, batched into as few syscalls as possible,
+   and what the socket doesn't take right away is sent as it becomes writable,
+   without involving on_clientwantsdata.
+   if free_cb is NULL, the data is copied. otherwise buf must stay valid until
+   the library calls free_cb(buf), after it was sent or the client is gone.
+   returns 0 on success, -1 if fd is not watched or a previous send to it
+   failed, -2 if out of memory. on error buf remains owned by the caller. */
+int rocksockserver_queue(rocksockserver* srv, int fd, const void* buf, size_t len, void (*free_cb)(void* buf));
+/* queues len bytes of filefd starting at offset off, or the rest of the file
+   if len is 0, to be sent to fd in order with the data queued with
+   rocksockserver_queue. the data is moved by the kernel with sendfile(),
+   without being copied through the loop's buffers. filefd is duplicated, so
+   the caller may close it right away, the file offset isn't changed. the file
+   must not shrink before it was sent. like write(), sendfile() raises SIGPIPE
+   when the client is gone, so the app should ignore that signal. sendfile()
+   can't be told not to block, so fd is switched to non-blocking mode for
+   each call and back afterwards.
+   returns 0 on success, -1 if fd is not watched, a previous send to it failed
+   or filefd is unusable, -2 if out of memory. */
+int rocksockserver_sendfile(rocksockserver* srv, int fd, int filefd, off_t off, size_t len);
+/* returns the number of bytes queued for fd that were not sent yet */
+size_t rocksockserver_queued(rocksockserver* srv, int fd);
 int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata);
+/* like rocksockserver_init, but rocksockserver_loop will run nworkers event
+   loops, each in its own thread with its own SO_REUSEPORT listener, so the
+   kernel spreads incoming connections over them. if pin_cpus is set, worker
+   i is pinned to cpu i modulo the number of online cpus.
+   the callbacks of a client always run on the thread of the worker that
+   accepted it, and the rocksockserver_* functions called from there act on
+   that worker, so the app can keep passing srv around as usual. shared
+   app state reachable through userdata needs locking though.
+   rocksockserver_loop returns once a worker failed, after stopping the
+   others and waiting for their threads to finish.
+   without SO_REUSEPORT support this falls back to a single loop. */
+int rocksockserver_init_workers(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata,
+                                int nworkers, int pin_cpus);
+/* returns the buffer the loop received into. in worker mode every worker gets
+   its own buffer of bufsize bytes, so on_clientread has to use this instead of
+   the buf passed to rocksockserver_loop. */
+char* rocksockserver_buf(rocksockserver* srv);
+/* per-client context pointer, kept in a table indexed by fd so it can be
+   looked up in O(1) from the callbacks. it starts out as NULL, or pointing to
+   the client's arena if rocksockserver_set_ctx_size was used. */
+void* rocksockserver_ctx(rocksockserver* srv, int fd);
+/* returns 0 on success, -1 if fd is not watched */
+int rocksockserver_set_ctx(rocksockserver* srv, int fd, void* ctx);
+/* gives every accepted client a zeroed arena of size bytes, which is
+   released when the client gets disconnected, after on_clientdisconnect.
+   arenas are recycled through a pool, so accepting doesn't hit malloc once
+   the pool is warm. call it before rocksockserver_loop.
+   returns 0 on success, -2 if out of memory. */
+int rocksockserver_set_ctx_size(rocksockserver* srv, size_t size);
+/* makes the loop read every client into a buffer of its own, so data that
+   isn't consumed stays around for the next read event. on_clientread then
+   gets the number of buffered bytes, which the app accesses through
+   rocksockserver_view and drops with rocksockserver_consume once it is
+   handled, e.g. after a complete message was parsed. the buffer is only held
+   while unconsumed input is left, the loop's buf argument is unused.
+   a client that fills all size bytes without the app consuming anything is
+   disconnected. call it before rocksockserver_loop.
+   returns 0 on success, -1 if size is 0, -2 if out of memory. */
+int rocksockserver_set_inbuf(rocksockserver* srv, size_t size);
+/* returns the unconsumed input of fd and stores its length in len */
+const char* rocksockserver_view(rocksockserver* srv, int fd, size_t* len);
+/* drops the first n bytes of the input of fd */
+void rocksockserver_consume(rocksockserver* srv, int fd, size_t n);
+/* the listening socket is created with a backlog of SOMAXCONN (or
+   RSS_LISTEN_BACKLOG if defined), the loop accepts up to 64 pending
+   connections per wakeup. accepted client fds are close-on-exec and
+   blocking, the loop only reads from them when they are readable and sends
+   queued data with MSG_DONTWAIT.
+   the following tune the listening socket(s) after init, they return 0 on
+   success and -1 with errno set if the option isn't available. */
+int rocksockserver_set_backlog(rocksockserver* srv, int backlog);
+/* only wake up for a new client once it sent data, or after secs seconds.
+   linux only. */
+int rocksockserver_set_defer_accept(rocksockserver* srv, int secs);
+/* accept TCP fast open connections, queuing up to qlen of them whose
+   handshake is still pending. 0 turns it off. */
+int rocksockserver_set_fastopen(rocksockserver* srv, int qlen);
+/* switches to the engine called name ("io_uring", "epoll" or "select"),
+   meant to be called right after init. returns 0 on success, -1 if there is no
+   such engine or it can't take the watched fds, -5 if it failed to start, in
+   which case the old one is kept. */
+int rocksockserver_set_engine(rocksockserver* srv, const char* name);
+/* name of the engine in use */
+const char* rocksockserver_engine(rocksockserver* srv);
+/* closes the listening socket and releases the resources allocated by init. */
+void rocksockserver_free(rocksockserver* srv);
 void rocksockserver_watch_fd(rocksockserver* srv, int newfd);
 void rocksockserver_set_signalfd(rocksockserver* srv, int signalfd);
 void rocksockserver_set_perrorfunc(rocksockserver* srv, perror_func perr);
 int rocksockserver_loop(rocksockserver* srv,
 			char* buf, size_t bufsize,
-			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd), 
+			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd),
 			int (*on_clientread) (void* userdata, int fd, size_t nread),
 			int (*on_clientwantsdata) (void* userdata, int fd),
 			int (*on_clientdisconnect) (void* userdata, int fd)
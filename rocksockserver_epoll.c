@@ -0,0 +1,84 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* epoll based event engine. the cost of a wakeup depends only on the number
+   of ready fds, and the number of fds is only bound by RLIMIT_NOFILE. */
+
+#include "rocksockserver_internal.h"
+
+#ifdef RSS_HAVE_EPOLL
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* max number of events fetched per epoll_wait call */
+#ifndef RSS_EPOLL_BATCH
+#define RSS_EPOLL_BATCH 256
+#endif
+
+static int ep_init(rocksockserver* srv) {
+	srv->pollfd = epoll_create1(EPOLL_CLOEXEC);
+	return srv->pollfd == -1 ? -1 : 0;
+}
+
+static void ep_free(rocksockserver* srv) {
+	if(srv->pollfd != -1) close(srv->pollfd);
+	srv->pollfd = -1;
+}
+
+static int ep_ctl(rocksockserver* srv, int op, int fd, int events) {
+	struct epoll_event ev = {
+		.events = ((events & RSS_EV_READ) ? EPOLLIN : 0) |
+		          ((events & RSS_EV_WRITE) ? EPOLLOUT : 0),
+		/* the generation tag lets ep_wait ignore stale events for reused fds */
+		.data.u64 = ((uint64_t) srv->conns[fd].gen << 32) | (uint32_t) fd,
+	};
+	return epoll_ctl(srv->pollfd, op, fd, &ev);
+}
+
+static int ep_add(rocksockserver* srv, int fd, int events) {
+	return ep_ctl(srv, EPOLL_CTL_ADD, fd, events);
+}
+
+static int ep_mod(rocksockserver* srv, int fd, int events) {
+	return ep_ctl(srv, EPOLL_CTL_MOD, fd, events);
+}
+
+static int ep_del(rocksockserver* srv, int fd) {
+	return epoll_ctl(srv->pollfd, EPOLL_CTL_DEL, fd, 0);
+}
+
+static int ep_wait(rocksockserver* srv, int timeout_ms) {
+	struct epoll_event evs[RSS_EPOLL_BATCH];
+	int i, n, fd, events;
+
+	n = epoll_wait(srv->pollfd, evs, RSS_EPOLL_BATCH, timeout_ms);
+	for(i = 0; i < n; i++) {
+		fd = (int)(uint32_t) evs[i].data.u64;
+		if(!rss_is_watched(srv, fd) || srv->conns[fd].gen != (unsigned)(evs[i].data.u64 >> 32))
+			continue;
+		events = 0;
+		// errors and hangups are reported as readable, so the following recv() picks them up
+		if(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) events |= RSS_EV_READ;
+		if(evs[i].events & EPOLLOUT) events |= RSS_EV_WRITE;
+		rss_dispatch(srv, fd, events);
+	}
+	return n;
+}
+
+const rss_backend rss_backend_epoll = {
+	.name = "epoll",
+	.init = ep_init,
+	.free = ep_free,
+	.add = ep_add,
+	.mod = ep_mod,
+	.del = ep_del,
+	.wait = ep_wait,
+};
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* per-fd input buffers. a client only holds a buffer while it has unconsumed
+   input, buffers are handed out from a pool and go back as soon as the app
+   consumed everything, so idle connections cost no buffer memory.
+   the unconsumed bytes are always kept contiguous, so the app gets a single
+   view of them. they are moved to the front of the buffer only when the free
+   space at the end runs out. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include "rocksockserver_internal.h"
+
+struct rss_inbuf {
+	size_t head; /* offset of the first unconsumed byte */
+	size_t tail;
+	char data[];
+};
+
+#define INBUF_SIZE(P) ((P)->size - offsetof(struct rss_inbuf, data))
+
+/* chunks are laid out back to back, so their size is rounded up to keep
+   the header of the next one aligned */
+#define INBUF_ALIGN (sizeof(size_t))
+#define INBUF_CHUNK(N) ((offsetof(struct rss_inbuf, data) + (N) + INBUF_ALIGN - 1) & ~(INBUF_ALIGN - 1))
+
+static struct rss_inbuf* inbuf_get(rss_pool* p) {
+	struct rss_inbuf* b = rss_pool_get(p);
+	if(b) b->head = b->tail = 0;
+	return b;
+}
+
+void rss_inbuf_release(rocksockserver* srv, int fd) {
+	struct rss_inbuf* b = srv->conns[fd].in;
+	if(!b) return;
+	rss_pool_put(srv->inpool, b);
+	srv->conns[fd].in = 0;
+}
+
+static void overflow(rocksockserver* srv, int fd) {
+	LOGP("input buffer overflow");
+	if(srv->on_clientdisconnect) srv->on_clientdisconnect(srv->userdata, fd);
+	rocksockserver_disconnect_client(srv, fd);
+}
+
+void rss_inbuf_read(rocksockserver* srv, int fd) {
+	rss_pool* p = srv->inpool;
+	rss_conn* c = &srv->conns[fd];
+	struct rss_inbuf* b;
+	ptrdiff_t n;
+	if(!c->in && !(c->in = inbuf_get(p))) {
+		LOGP("malloc");
+		return;
+	}
+	b = c->in;
+	if(b->tail == INBUF_SIZE(p)) {
+		// the app left a full buffer unconsumed, it can't make progress
+		if(!b->head) {
+			overflow(srv, fd);
+			return;
+		}
+		memmove(b->data, b->data + b->head, b->tail - b->head);
+		b->tail -= b->head;
+		b->head = 0;
+	}
+	n = recv(fd, b->data + b->tail, INBUF_SIZE(p) - b->tail, 0);
+	if(n <= 0) {
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) goto out;
+		if(n == 0) {
+			if(srv->on_clientdisconnect) srv->on_clientdisconnect(srv->userdata, fd);
+		} else {
+			LOGP("recv");
+		}
+		rocksockserver_disconnect_client(srv, fd);
+		return;
+	}
+	b->tail += n;
+	if(srv->on_clientread) srv->on_clientread(srv->userdata, fd, b->tail - b->head);
+out:
+	// the callback may have disconnected the client or consumed everything,
+	// and watching another fd may have moved the table
+	c = &srv->conns[fd];
+	if(rss_is_watched(srv, fd) && c->in && c->in->head == c->in->tail)
+		rss_inbuf_release(srv, fd);
+}
+
+int rocksockserver_set_inbuf(rocksockserver* srv, size_t size) {
+	int i;
+	if(!size) return -1;
+	for(i = 0; i < srv->nworkers; i++)
+		if(rocksockserver_set_inbuf(&srv->workers[i], size)) return -2;
+	if(srv->workers) return 0;
+	rss_pool_free(srv->inpool);
+	if(!(srv->inpool = rss_pool_new(INBUF_CHUNK(size)))) return -2;
+	return 0;
+}
+
+const char* rocksockserver_view(rocksockserver* srv, int fd, size_t* len) {
+	struct rss_inbuf* b;
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd) || !(b = srv->conns[fd].in)) {
+		*len = 0;
+		return 0;
+	}
+	*len = b->tail - b->head;
+	return b->data + b->head;
+}
+
+void rocksockserver_consume(rocksockserver* srv, int fd, size_t n) {
+	struct rss_inbuf* b;
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd) || !(b = srv->conns[fd].in)) return;
+	if(n > b->tail - b->head) n = b->tail - b->head;
+	b->head += n;
+	if(b->head == b->tail) b->head = b->tail = 0;
+}
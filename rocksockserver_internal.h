@@ -0,0 +1,198 @@
+#ifndef ROCKSOCKSERVER_INTERNAL_H
+#define ROCKSOCKSERVER_INTERNAL_H
+
+#include <stdint.h>
+#include "rocksockserver.h"
+
+#if defined(__linux__) && !defined(NO_EPOLL) && !defined(WIN32)
+#define RSS_HAVE_EPOLL
+#endif
+
+#if defined(__linux__) && !defined(NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define RSS_HAVE_URING
+#endif
+#endif
+
+#if !defined(WIN32) && defined(SO_REUSEPORT) && !defined(NO_THREADS)
+#define RSS_HAVE_WORKERS
+#endif
+
+/* listen() backlog, see rocksockserver_set_backlog */
+#ifndef RSS_LISTEN_BACKLOG
+#define RSS_LISTEN_BACKLOG SOMAXCONN
+#endif
+
+/* max number of queued segments passed to a single sendmsg call */
+#ifndef RSS_IOV_MAX
+#define RSS_IOV_MAX 64
+#endif
+
+/* max number of connections accepted per wakeup */
+#ifndef RSS_ACCEPT_BATCH
+#define RSS_ACCEPT_BATCH 64
+#endif
+
+#ifdef WIN32
+#define rss_closesocket(X) closesocket(X)
+#else
+#define rss_closesocket(X) close(X)
+#endif
+
+#define LOGP(X) do { if(srv->perr) srv->perr(X); } while(0)
+
+/* event bits passed between the engine and rss_dispatch */
+#define RSS_EV_READ  1
+#define RSS_EV_WRITE 2
+/* passed to add for accepted clients, the engine may receive their data
+   itself and hand it to rss_dispatch_data instead of reporting READ */
+#define RSS_EV_STREAM 4
+
+/* rss_conn.flags */
+#define RSS_F_WATCHED 1
+#define RSS_F_WANTWRITE 2
+/* the output queue needs write readiness */
+#define RSS_F_QWRITE 4
+/* fd is on the list of queues to flush, kept across disconnects until
+   the list is processed so an fd is never linked twice */
+#define RSS_F_QPENDING 8
+/* sending failed, the queue accepts no more data */
+#define RSS_F_QERROR 16
+/* accepted client, see RSS_EV_STREAM */
+#define RSS_F_STREAM 32
+
+/* segment of an output queue, see rocksockserver_queue.c */
+struct rss_qseg;
+
+/* per-fd bookkeeping, indexed by fd. */
+typedef struct rss_conn {
+	unsigned flags;
+	/* bumped every time the fd gets watched, so the engine can drop events
+	   that were queued for a previous owner of the same fd number. */
+	unsigned gen;
+	/* idle timeout bookkeeping. the timer is only moved when it fires, read
+	   activity just updates last_active. */
+	struct rss_tnode idle;
+	unsigned long idle_timeout;
+	unsigned long long last_active;
+	/* output queue */
+	struct rss_qseg *qhead, **qtail;
+	size_t qlen;
+	/* next fd on the flush list */
+	int qnext;
+	/* unconsumed input, see rocksockserver_inbuf.c */
+	struct rss_inbuf *in;
+	/* app context and the arena from srv->ctxpool, if any */
+	void *ctx, *arena;
+	/* engine private */
+	unsigned eflags, eseq;
+} rss_conn;
+
+typedef struct rss_backend {
+	const char* name;
+	/* returns 0 on success, or -1 with errno set */
+	int (*init)(rocksockserver* srv);
+	void (*free)(rocksockserver* srv);
+	int (*add)(rocksockserver* srv, int fd, int events);
+	int (*mod)(rocksockserver* srv, int fd, int events);
+	int (*del)(rocksockserver* srv, int fd);
+	/* waits up to timeout_ms (-1: forever) and calls rss_dispatch for every
+	   ready fd. returns the number of ready fds or -1 on error. */
+	int (*wait)(rocksockserver* srv, int timeout_ms);
+	/* optional, starts sending the output queue of fd. without it the core
+	   flushes the queue itself, see rss_queue_flush. */
+	void (*send)(rocksockserver* srv, int fd);
+} rss_backend;
+
+extern const rss_backend rss_backend_select;
+#ifdef RSS_HAVE_URING
+extern const rss_backend rss_backend_uring;
+#endif
+#ifdef RSS_HAVE_EPOLL
+extern const rss_backend rss_backend_epoll;
+#endif
+
+static inline int rss_is_watched(rocksockserver* srv, int fd) {
+	return fd >= 0 && fd < srv->fdcap && (srv->conns[fd].flags & RSS_F_WATCHED);
+}
+
+void rss_dispatch(rocksockserver* srv, int fd, int events);
+/* hands len bytes the engine received from client fd to the app, like the
+   read path of rss_dispatch does. len 0 means the client hung up. */
+void rss_dispatch_data(rocksockserver* srv, int fd, const char* data, size_t len);
+/* sets up a client the engine accepted. remoteaddr may be NULL. */
+void rss_accepted(rocksockserver* srv, int newfd, struct sockaddr_storage* remoteaddr);
+/* replaces the RSS_F_WANTWRITE and RSS_F_QWRITE bits of fd by those in flags
+   and tells the engine if that changes the write interest. */
+int rss_set_interest(rocksockserver* srv, int fd, unsigned flags);
+
+/* output queues, rocksockserver_queue.c */
+/* sends as much of the queue of fd as the socket takes */
+void rss_queue_flush(rocksockserver* srv, int fd);
+/* flushes the queues that got data since the last call */
+void rss_queue_flush_pending(rocksockserver* srv);
+/* drops the queue of fd, releasing the buffers */
+void rss_queue_free(rocksockserver* srv, int fd);
+#ifndef WIN32
+struct iovec;
+/* for engines sending asynchronously: detaches up to max segments from the
+   front of the queue of fd and describes them in iov. returns the segments
+   and stores their number in n. they still count as queued until they are
+   given back. */
+struct rss_qseg* rss_queue_take(rocksockserver* srv, int fd, struct iovec* iov, int max, int* n);
+/* completes a send of segments taken with rss_queue_take, of which sent
+   bytes went out. the rest is put back in front of the queue of fd if requeue
+   is set, otherwise released along with the sent ones. err != 0 marks the
+   queue as failed. */
+void rss_queue_give(rocksockserver* srv, int fd, struct rss_qseg* segs, size_t sent, int requeue, int err);
+#endif
+
+#ifdef RSS_HAVE_WORKERS
+/* the worker whose loop runs on the current thread */
+extern __thread rocksockserver* rss_current_worker;
+#endif
+
+/* maps the server handle the app passes around to the worker it refers to:
+   the worker running on this thread, or the first one outside of the loop. */
+static inline rocksockserver* rss_self(rocksockserver* srv) {
+	if(!srv->workers) return srv;
+#ifdef RSS_HAVE_WORKERS
+	if(rss_current_worker && rss_current_worker->parent == srv) return rss_current_worker;
+#endif
+	return srv->workers;
+}
+
+/* fixed-size object pool, rocksockserver_pool.c */
+typedef struct rss_pool {
+	size_t size;
+	union rss_slab* slabs;
+	struct rss_pool_obj* free;
+} rss_pool;
+
+/* size gets rounded up to the alignment of the objects */
+rss_pool* rss_pool_new(size_t size);
+void* rss_pool_get(rss_pool* p);
+void rss_pool_put(rss_pool* p, void* obj);
+void rss_pool_free(rss_pool* p);
+
+/* input buffers, rocksockserver_inbuf.c */
+/* reads from fd into its input buffer and passes it to on_clientread */
+void rss_inbuf_read(rocksockserver* srv, int fd);
+/* returns the input buffer of fd to the pool */
+void rss_inbuf_release(rocksockserver* srv, int fd);
+
+/* timer wheel, rocksockserver_timer.c */
+int rss_timer_init(rocksockserver* srv);
+void rss_timer_free(rocksockserver* srv);
+/* monotonic clock in milliseconds */
+unsigned long long rss_timer_now(rocksockserver* srv);
+/* ms until the loop needs to run the wheel again, -1 if no timer is armed */
+int rss_timer_next(rocksockserver* srv);
+/* fires all timers that expired by now */
+void rss_timer_run(rocksockserver* srv);
+void rss_timer_start_idle(rocksockserver* srv, int fd);
+void rss_timer_stop_idle(rocksockserver* srv, int fd);
+/* srv->conns was moved from old, where it held n entries */
+void rss_timer_moved(rocksockserver* srv, uintptr_t old, int n);
+
+#endif
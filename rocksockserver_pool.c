@@ -0,0 +1,70 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* fixed-size object pool. objects are carved from slabs and recycled through
+   a free list, slabs are only released with the pool. */
+
+#include <stdlib.h>
+
+#include "rocksockserver_internal.h"
+
+/* number of objects allocated at once */
+#ifndef RSS_SLAB_OBJS
+#define RSS_SLAB_OBJS 16
+#endif
+
+#define RSS_POOL_ALIGN 16
+
+union rss_slab {
+	union rss_slab* next;
+	char pad[RSS_POOL_ALIGN];
+};
+
+struct rss_pool_obj {
+	struct rss_pool_obj* next;
+};
+
+rss_pool* rss_pool_new(size_t size) {
+	rss_pool* p;
+	if(!(p = calloc(1, sizeof *p))) return 0;
+	p->size = (size + RSS_POOL_ALIGN - 1) & ~(size_t)(RSS_POOL_ALIGN - 1);
+	return p;
+}
+
+void* rss_pool_get(rss_pool* p) {
+	union rss_slab* s;
+	struct rss_pool_obj* o;
+	size_t i;
+	if(!p->free) {
+		if(!(s = malloc(sizeof *s + RSS_SLAB_OBJS * p->size))) return 0;
+		s->next = p->slabs;
+		p->slabs = s;
+		for(i = 0; i < RSS_SLAB_OBJS; i++) {
+			o = (struct rss_pool_obj*) ((char*) (s + 1) + i * p->size);
+			o->next = p->free;
+			p->free = o;
+		}
+	}
+	o = p->free;
+	p->free = o->next;
+	return o;
+}
+
+void rss_pool_put(rss_pool* p, void* obj) {
+	struct rss_pool_obj* o = obj;
+	o->next = p->free;
+	p->free = o;
+}
+
+void rss_pool_free(rss_pool* p) {
+	union rss_slab* s;
+	if(!p) return;
+	while((s = p->slabs)) {
+		p->slabs = s->next;
+		free(s);
+	}
+	free(p);
+}
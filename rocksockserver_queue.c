@@ -0,0 +1,293 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* per-fd output queues. data queued from callbacks is collected until the
+   loop is about to wait again and then sent with one sendmsg() per fd, so a
+   protocol that emits many small pieces per event doesn't pay a syscall for
+   each of them. the remainder is sent when the fd becomes writable, write
+   interest is only registered while something is pending.
+   file segments queued with rocksockserver_sendfile are sent with sendfile()
+   when they reach the front of the queue, so their data never passes through
+   user space. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "rocksockserver_internal.h"
+
+struct rss_qseg {
+	struct rss_qseg* next;
+	const char* data;
+	size_t len;
+	/* buffer owned by the caller, NULL if the data was copied into the
+	   segment */
+	void (*free_cb)(void* buf);
+	void* buf;
+	/* file segment: len bytes of filefd starting at off, -1 otherwise */
+	int filefd;
+	off_t off;
+};
+
+static void qseg_release(struct rss_qseg* s) {
+	if(s->free_cb) s->free_cb(s->buf);
+#ifndef WIN32
+	if(s->filefd != -1) close(s->filefd);
+#endif
+	free(s);
+}
+
+/* removes n sent bytes from the front of the queue */
+static void queue_consume(rss_conn* c, size_t n) {
+	struct rss_qseg* s;
+	c->qlen -= n;
+	while(n) {
+		s = c->qhead;
+		if(n < s->len) {
+			if(s->filefd != -1) s->off += n;
+			else s->data += n;
+			s->len -= n;
+			return;
+		}
+		n -= s->len;
+		c->qhead = s->next;
+		qseg_release(s);
+	}
+}
+
+#ifndef WIN32
+/* sends from the file segment at the front of the queue */
+static ptrdiff_t send_file(int fd, struct rss_qseg* s) {
+	char buf[4096];
+	ptrdiff_t n;
+#ifdef __linux__
+	off_t off = s->off;
+	int fl = fcntl(fd, F_GETFL), err;
+	/* sendfile() has no MSG_DONTWAIT, a full socket must not block the loop.
+	   the fd is only switched for the call, the app's flags are kept. */
+	if(!(fl & O_NONBLOCK)) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+	n = sendfile(fd, s->filefd, &off, s->len);
+	if(!(fl & O_NONBLOCK)) {
+		err = errno;
+		fcntl(fd, F_SETFL, fl);
+		errno = err;
+	}
+	if(n != -1 || (errno != EINVAL && errno != ENOSYS)) return n;
+#endif
+	/* not supported for this file, copy a chunk. what the socket doesn't
+	   take is read again next time. */
+	n = pread(s->filefd, buf, s->len < sizeof buf ? s->len : sizeof buf, s->off);
+	if(n <= 0) return n;
+	return send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#endif
+
+void rss_queue_flush(rocksockserver* srv, int fd) {
+	rss_conn* c = &srv->conns[fd];
+	ptrdiff_t n;
+	size_t want;
+#ifndef WIN32
+	struct iovec iov[RSS_IOV_MAX];
+	struct msghdr mh;
+	struct rss_qseg* s;
+	int i;
+#endif
+	while(c->qhead) {
+#ifndef WIN32
+		if(c->qhead->filefd != -1) {
+			// the copy fallback sends in small chunks, so a short write
+			// doesn't mean the socket is full. only EAGAIN ends the loop.
+			want = 0;
+			n = send_file(fd, c->qhead);
+			// the file got truncated, the queue would never drain
+			if(!n) errno = EIO, n = -1;
+		} else {
+			for(i = 0, want = 0, s = c->qhead; s && s->filefd == -1 && i < RSS_IOV_MAX; s = s->next, i++) {
+				iov[i].iov_base = (void*) s->data;
+				iov[i].iov_len = s->len;
+				want += s->len;
+			}
+			memset(&mh, 0, sizeof mh);
+			mh.msg_iov = iov;
+			mh.msg_iovlen = i;
+			n = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+#else
+		want = c->qhead->len;
+		n = send(fd, c->qhead->data, want, 0);
+#endif
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			// the read side will see the error too and disconnect
+			LOGP("send");
+			rss_queue_free(srv, fd);
+			c->flags |= RSS_F_QERROR;
+			break;
+		}
+		queue_consume(c, n);
+		// short write, the socket buffer is full
+		if((size_t) n < want) break;
+	}
+	rss_set_interest(srv, fd, (c->flags & ~RSS_F_QWRITE) | (c->qhead ? RSS_F_QWRITE : 0));
+}
+
+#ifndef WIN32
+struct rss_qseg* rss_queue_take(rocksockserver* srv, int fd, struct iovec* iov, int max, int* n) {
+	rss_conn* c = &srv->conns[fd];
+	struct rss_qseg *head = c->qhead, *s = 0;
+	int i;
+	// file segments are left to rss_queue_flush
+	for(i = 0; c->qhead && c->qhead->filefd == -1 && i < max; i++) {
+		s = c->qhead;
+		iov[i].iov_base = (void*) s->data;
+		iov[i].iov_len = s->len;
+		c->qhead = s->next;
+	}
+	if(!s) head = 0;
+	else s->next = 0;
+	*n = i;
+	return head;
+}
+
+void rss_queue_give(rocksockserver* srv, int fd, struct rss_qseg* segs, size_t sent, int requeue, int err) {
+	rss_conn* c = &srv->conns[fd];
+	struct rss_qseg *s, **tail;
+	// taken segments count as queued until they come back
+	if(requeue) c->qlen -= sent;
+	while((s = segs) && sent >= s->len) {
+		sent -= s->len;
+		segs = s->next;
+		qseg_release(s);
+	}
+	if(segs && requeue && !err) {
+		segs->data += sent;
+		segs->len -= sent;
+		for(tail = &segs; *tail; tail = &(*tail)->next);
+		if(!(*tail = c->qhead)) c->qtail = tail;
+		c->qhead = segs;
+		return;
+	}
+	while((s = segs)) {
+		segs = s->next;
+		qseg_release(s);
+	}
+	if(requeue && err) {
+		LOGP("send");
+		rss_queue_free(srv, fd);
+		c->flags |= RSS_F_QERROR;
+	}
+}
+#endif
+
+void rss_queue_flush_pending(rocksockserver* srv) {
+	int fd;
+	rss_conn* c;
+	while((fd = srv->qpending) != -1) {
+		c = &srv->conns[fd];
+		srv->qpending = c->qnext;
+		c->flags &= ~RSS_F_QPENDING;
+		// disconnected meanwhile, or already waiting for write readiness
+		if(!(c->flags & RSS_F_WATCHED) || !c->qhead || (c->flags & RSS_F_QWRITE)) continue;
+		if(srv->backend->send) srv->backend->send(srv, fd);
+		else rss_queue_flush(srv, fd);
+	}
+}
+
+void rss_queue_free(rocksockserver* srv, int fd) {
+	rss_conn* c = &srv->conns[fd];
+	struct rss_qseg* s;
+	while((s = c->qhead)) {
+		c->qhead = s->next;
+		qseg_release(s);
+	}
+	c->qlen = 0;
+	c->flags &= ~RSS_F_QERROR;
+}
+
+/* appends s to the queue of fd and schedules the flush */
+static void queue_append(rocksockserver* srv, int fd, struct rss_qseg* s) {
+	rss_conn* c = &srv->conns[fd];
+	s->next = 0;
+	if(!c->qhead) c->qtail = &c->qhead;
+	*c->qtail = s;
+	c->qtail = &s->next;
+	c->qlen += s->len;
+	if(!(c->flags & (RSS_F_QPENDING | RSS_F_QWRITE))) {
+		c->flags |= RSS_F_QPENDING;
+		c->qnext = srv->qpending;
+		srv->qpending = fd;
+	}
+}
+
+int rocksockserver_queue(rocksockserver* srv, int fd, const void* buf, size_t len, void (*free_cb)(void* buf)) {
+	struct rss_qseg* s;
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd) || (srv->conns[fd].flags & RSS_F_QERROR)) return -1;
+	if(!len) {
+		if(free_cb) free_cb((void*) buf);
+		return 0;
+	}
+	if(free_cb) {
+		if(!(s = malloc(sizeof *s))) return -2;
+		s->data = buf;
+		s->buf = (void*) buf;
+	} else {
+		if(!(s = malloc(sizeof *s + len))) return -2;
+		memcpy(s + 1, buf, len);
+		s->data = (const char*) (s + 1);
+		s->buf = 0;
+	}
+	s->free_cb = free_cb;
+	s->len = len;
+	s->filefd = -1;
+	queue_append(srv, fd, s);
+	return 0;
+}
+
+int rocksockserver_sendfile(rocksockserver* srv, int fd, int filefd, off_t off, size_t len) {
+#ifndef WIN32
+	struct rss_qseg* s;
+	struct stat st;
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd) || (srv->conns[fd].flags & RSS_F_QERROR)) return -1;
+	if(!len) {
+		if(fstat(filefd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+		if(st.st_size <= off) return 0;
+		len = st.st_size - off;
+	}
+	if(!(s = malloc(sizeof *s))) return -2;
+	// a private fd, so the caller may close theirs right away
+	if((s->filefd = fcntl(filefd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		free(s);
+		return -1;
+	}
+	s->data = 0;
+	s->buf = 0;
+	s->free_cb = 0;
+	s->off = off;
+	s->len = len;
+	queue_append(srv, fd, s);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+size_t rocksockserver_queued(rocksockserver* srv, int fd) {
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd)) return 0;
+	return srv->conns[fd].qlen;
+}
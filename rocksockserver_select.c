@@ -0,0 +1,109 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* portable select() based event engine. it can only handle fds < FD_SETSIZE
+   and every wakeup costs O(maxfd), so it is only used where epoll is not
+   available. */
+
+#include <errno.h>
+#include <limits.h>
+#ifndef WIN32
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "rocksockserver_internal.h"
+
+static int sel_init(rocksockserver* srv) {
+	FD_ZERO(&srv->master);
+	FD_ZERO(&srv->wmaster);
+	return 0;
+}
+
+static void sel_free(rocksockserver* srv) {
+	sel_init(srv);
+}
+
+static int sel_mod(rocksockserver* srv, int fd, int events) {
+	if(events & RSS_EV_WRITE) FD_SET(fd, &srv->wmaster);
+	else FD_CLR(fd, &srv->wmaster);
+	return 0;
+}
+
+static int sel_add(rocksockserver* srv, int fd, int events) {
+	if(fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+	FD_SET(fd, &srv->master);
+	if (fd > srv->maxfd)
+		srv->maxfd = fd;
+	return sel_mod(srv, fd, events);
+}
+
+static int sel_del(rocksockserver* srv, int fd) {
+	FD_CLR(fd, &srv->master);
+	FD_CLR(fd, &srv->wmaster);
+	while(srv->maxfd >= 0 && !FD_ISSET(srv->maxfd, &srv->master))
+		srv->maxfd--;
+	return 0;
+}
+
+#ifndef WIN32
+/* fd_set is a bitmap of longs on all supported unices, so empty words can be
+   skipped as a whole. */
+#define WORDBITS (sizeof(long) * CHAR_BIT)
+#define WORD(SET, FD) (((long*)(void*)(SET))[(FD) / WORDBITS])
+#endif
+
+static int sel_wait(rocksockserver* srv, int timeout_ms) {
+	fd_set read_fds, write_fds;
+	struct timeval tv, *ptv = 0;
+	int fd, n, ready, events, maxfd = srv->maxfd;
+
+	read_fds = srv->master;
+	write_fds = srv->wmaster;
+	if(timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = 1000 * (timeout_ms % 1000);
+		ptv = &tv;
+	}
+	if((ready = select(maxfd+1, &read_fds, &write_fds, NULL, ptv)) <= 0)
+		return ready;
+
+	for(n = ready, fd = 0; fd <= maxfd && n > 0; fd++) {
+#ifdef WORDBITS
+		if(!(fd % WORDBITS) && !WORD(&read_fds, fd) && !WORD(&write_fds, fd)) {
+			fd += WORDBITS - 1;
+			continue;
+		}
+#endif
+		events = 0;
+		if(FD_ISSET(fd, &read_fds)) {
+			events |= RSS_EV_READ;
+			n--;
+		}
+		if(FD_ISSET(fd, &write_fds)) {
+			events |= RSS_EV_WRITE;
+			n--;
+		}
+		// a previous callback may have disconnected this fd
+		if(events && rss_is_watched(srv, fd))
+			rss_dispatch(srv, fd, events);
+	}
+	return ready;
+}
+
+const rss_backend rss_backend_select = {
+	.name = "select",
+	.init = sel_init,
+	.free = sel_free,
+	.add = sel_add,
+	.mod = sel_mod,
+	.del = sel_del,
+	.wait = sel_wait,
+};
@@ -0,0 +1,12 @@
+#include "rocksockserver.h"
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+// listen() may be called again on a listening socket to resize its queue
+int rocksockserver_set_backlog(rocksockserver* srv, int backlog) {
+	int i;
+	for(i = 0; i < srv->nworkers; i++)
+		if(rocksockserver_set_backlog(&srv->workers[i], backlog)) return -1;
+	if(srv->workers) return 0;
+	return listen(srv->listensocket, backlog);
+}
@@ -0,0 +1,18 @@
+#include "rocksockserver.h"
+#include <errno.h>
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+int rocksockserver_set_defer_accept(rocksockserver* srv, int secs) {
+	int i;
+	for(i = 0; i < srv->nworkers; i++)
+		if(rocksockserver_set_defer_accept(&srv->workers[i], secs)) return -1;
+	if(srv->workers) return 0;
+#ifdef TCP_DEFER_ACCEPT
+	return setsockopt(srv->listensocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
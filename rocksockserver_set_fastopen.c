@@ -0,0 +1,18 @@
+#include "rocksockserver.h"
+#include <errno.h>
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+int rocksockserver_set_fastopen(rocksockserver* srv, int qlen) {
+	int i;
+	for(i = 0; i < srv->nworkers; i++)
+		if(rocksockserver_set_fastopen(&srv->workers[i], qlen)) return -1;
+	if(srv->workers) return 0;
+#ifdef TCP_FASTOPEN
+	return setsockopt(srv->listensocket, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
@@ -1,5 +1,7 @@
 #include "rocksockserver.h"
 void rocksockserver_set_perrorfunc(rocksockserver* srv, perror_func perr) {
+	int i;
 	srv->perr = perr;
+	for(i = 0; i < srv->nworkers; i++)
+		srv->workers[i].perr = perr;
 }
-
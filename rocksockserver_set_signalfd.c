@@ -1,6 +1,8 @@
 #include "rocksockserver.h"
+#include "rocksockserver_internal.h"
 // pass the reading end of a pipe
 void rocksockserver_set_signalfd(rocksockserver* srv, int signalfd) {
+	srv = rss_self(srv);
 	srv->signalfd = signalfd;
 	rocksockserver_watch_fd(srv, signalfd);
 }
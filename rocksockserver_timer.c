@@ -0,0 +1,248 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* hierarchical timer wheel with millisecond ticks. 4 levels of 64 slots
+   cover ~4.6 hours, longer timeouts are parked in the last level and
+   re-inserted when they get cascaded.
+   adding and removing a timer is O(1), the loop only wakes up when a slot
+   with pending timers is reached. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "rocksockserver_internal.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct rss_wheel {
+	/* every tick before now has been run */
+	unsigned long long now;
+	size_t count;
+	struct rss_tnode* slots[WHEEL_LEVELS][WHEEL_SIZE];
+	/* the slot rss_timer_run is firing */
+	struct rss_tnode* firing;
+};
+
+static unsigned long long clock_ms(void) {
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void tnode_link(struct rss_wheel* w, struct rss_tnode* n) {
+	unsigned long long e = n->expires, delta;
+	struct rss_tnode** head;
+	unsigned lvl;
+	if(e < w->now) e = w->now;
+	delta = e - w->now;
+	if(delta >= WHEEL_RANGE) {
+		e = w->now + WHEEL_RANGE - 1;
+		delta = WHEEL_RANGE - 1;
+	}
+	for(lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++)
+		if(delta < 1ULL << (WHEEL_BITS * (lvl + 1))) break;
+	head = &w->slots[lvl][(e >> (WHEEL_BITS * lvl)) & WHEEL_MASK];
+	if((n->next = *head)) n->next->pprev = &n->next;
+	*head = n;
+	n->pprev = head;
+	w->count++;
+}
+
+static void tnode_unlink(struct rss_wheel* w, struct rss_tnode* n) {
+	if(!n->pprev) return;
+	if((*n->pprev = n->next)) n->next->pprev = n->pprev;
+	n->next = 0;
+	n->pprev = 0;
+	w->count--;
+}
+
+/* moves the timers of the current slot of level lvl down to lower levels.
+   returns the slot index, 0 means the next level needs to cascade too. */
+static unsigned cascade(struct rss_wheel* w, unsigned lvl) {
+	unsigned idx = (w->now >> (WHEEL_BITS * lvl)) & WHEEL_MASK;
+	struct rss_tnode *n = w->slots[lvl][idx], *next;
+	w->slots[lvl][idx] = 0;
+	for(; n; n = next) {
+		next = n->next;
+		w->count--;
+		tnode_link(w, n);
+	}
+	return idx;
+}
+
+/* returns the first tick at or after w->now where a non-empty slot is
+   reached, either to fire it (level 0) or to cascade it. */
+static unsigned long long next_tick(struct rss_wheel* w) {
+	unsigned long long best = ULLONG_MAX, t;
+	unsigned lvl, k, cur, shift, first;
+	for(lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+		shift = WHEEL_BITS * lvl;
+		cur = (w->now >> shift) & WHEEL_MASK;
+		/* a slot on the upper levels gets cascaded when the first tick of its
+		   block is run. once that happened the current slot holds timers of
+		   the block one full turn ahead. */
+		first = lvl && (w->now & ((1ULL << shift) - 1));
+		for(k = first; k < WHEEL_SIZE + first; k++) {
+			if(!w->slots[lvl][(cur + k) & WHEEL_MASK]) continue;
+			t = lvl ? ((w->now >> shift) + k) << shift : w->now + k;
+			if(t < best) best = t;
+			break;
+		}
+	}
+	return best;
+}
+
+static void fire(rocksockserver* srv, struct rss_tnode* n, unsigned long long tick) {
+	struct rss_wheel* w = srv->wheel;
+	rss_conn* c = (rss_conn*)((char*) n - offsetof(rss_conn, idle));
+	if((uintptr_t) c >= (uintptr_t) srv->conns && (uintptr_t) c < (uintptr_t) (srv->conns + srv->fdcap)) {
+		int fd = c - srv->conns;
+		if(c->last_active + c->idle_timeout > tick) {
+			n->expires = c->last_active + c->idle_timeout;
+			tnode_link(w, n);
+			return;
+		}
+		if(srv->on_clientdisconnect) srv->on_clientdisconnect(srv->userdata, fd);
+		rocksockserver_disconnect_client(srv, fd);
+	} else {
+		rocksockserver_timer* t = (rocksockserver_timer*) n;
+		if(t->interval) {
+			n->expires += t->interval;
+			if(n->expires <= tick) n->expires = tick + t->interval;
+			tnode_link(w, n);
+		}
+		t->func(srv->userdata, t);
+	}
+}
+
+int rss_timer_init(rocksockserver* srv) {
+	if(!(srv->wheel = calloc(1, sizeof(struct rss_wheel)))) return -1;
+	srv->wheel->now = clock_ms();
+	return 0;
+}
+
+void rss_timer_free(rocksockserver* srv) {
+	free(srv->wheel);
+	srv->wheel = 0;
+}
+
+unsigned long long rss_timer_now(rocksockserver* srv) {
+	(void) srv;
+	return clock_ms();
+}
+
+int rss_timer_next(rocksockserver* srv) {
+	unsigned long long t, now;
+	if(!srv->wheel->count) return -1;
+	t = next_tick(srv->wheel);
+	now = clock_ms();
+	if(t <= now) return 0;
+	return t - now > INT_MAX ? INT_MAX : t - now;
+}
+
+void rss_timer_run(rocksockserver* srv) {
+	struct rss_wheel* w = srv->wheel;
+	unsigned long long tick, target = clock_ms();
+	struct rss_tnode* n;
+	unsigned lvl;
+	while(w->now <= target) {
+		if(!w->count || (tick = next_tick(w)) > target) {
+			w->now = target + 1;
+			break;
+		}
+		/* nothing to do in between, jump ahead */
+		w->now = tick;
+		if(!(tick & WHEEL_MASK))
+			for(lvl = 1; lvl < WHEEL_LEVELS && !cascade(w, lvl); lvl++);
+		w->firing = w->slots[0][tick & WHEEL_MASK];
+		w->slots[0][tick & WHEEL_MASK] = 0;
+		if(w->firing) w->firing->pprev = &w->firing;
+		/* timers re-armed from callbacks must land in the future */
+		w->now = tick + 1;
+		while((n = w->firing)) {
+			tnode_unlink(w, n);
+			fire(srv, n, tick);
+		}
+	}
+}
+
+/* points the links of the list at head into the moved conn table */
+static void relink(struct rss_tnode** pp, uintptr_t old, size_t size, char* base) {
+	uintptr_t off;
+	for(; *pp; pp = &(*pp)->next) {
+		if((off = (uintptr_t) *pp - old) < size) *pp = (struct rss_tnode*)(base + off);
+		(*pp)->pprev = pp;
+	}
+}
+
+void rss_timer_moved(rocksockserver* srv, uintptr_t old, int n) {
+	struct rss_wheel* w = srv->wheel;
+	size_t size = (size_t) n * sizeof(rss_conn);
+	unsigned lvl, i;
+	for(lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+		for(i = 0; i < WHEEL_SIZE; i++)
+			relink(&w->slots[lvl][i], old, size, (char*) srv->conns);
+	relink(&w->firing, old, size, (char*) srv->conns);
+}
+
+void rss_timer_start_idle(rocksockserver* srv, int fd) {
+	rss_conn* c = &srv->conns[fd];
+	tnode_unlink(srv->wheel, &c->idle);
+	if(!c->idle_timeout) return;
+	c->last_active = clock_ms();
+	c->idle.expires = c->last_active + c->idle_timeout;
+	tnode_link(srv->wheel, &c->idle);
+}
+
+void rss_timer_stop_idle(rocksockserver* srv, int fd) {
+	tnode_unlink(srv->wheel, &srv->conns[fd].idle);
+}
+
+void rocksockserver_add_timer(rocksockserver* srv, rocksockserver_timer* t,
+                              unsigned long timeout_ms, unsigned long interval_ms,
+                              int (*func) (void* userdata, rocksockserver_timer* t)) {
+	srv = rss_self(srv);
+	tnode_unlink(srv->wheel, &t->node);
+	t->func = func;
+	t->interval = interval_ms;
+	t->node.expires = clock_ms() + timeout_ms;
+	tnode_link(srv->wheel, &t->node);
+}
+
+void rocksockserver_del_timer(rocksockserver* srv, rocksockserver_timer* t) {
+	srv = rss_self(srv);
+	tnode_unlink(srv->wheel, &t->node);
+}
+
+int rocksockserver_set_idle_timeout(rocksockserver* srv, int fd, unsigned long timeout_ms) {
+	int i;
+	if(fd == -1) {
+		srv->idle_timeout = timeout_ms;
+		for(i = 0; i < srv->nworkers; i++)
+			srv->workers[i].idle_timeout = timeout_ms;
+		return 0;
+	}
+	srv = rss_self(srv);
+	if(!rss_is_watched(srv, fd)) return -1;
+	srv->conns[fd].idle_timeout = timeout_ms;
+	rss_timer_start_idle(srv, fd);
+	return 0;
+}
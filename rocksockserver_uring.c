@@ -0,0 +1,554 @@
+/*
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* io_uring based event engine, talking to the kernel through the raw
+   syscalls. instead of waiting for readiness and then issuing one syscall per
+   operation, it keeps a multishot accept armed on the listener and a
+   multishot recv on every client, which fills buffers from a provided buffer
+   ring. queued output is sent with sendmsg requests. all requests prepared
+   during a loop round are submitted together with the wait for the next
+   completions, so a round costs a single syscall no matter how many clients
+   were served.
+   fds whose reads the core doesn't do itself (signalfd, watch_fd, clients
+   when the loop has no receive buffer or uses per-client input buffers) and
+   write interest are handled with one-shot polls, re-armed after each event
+   to keep the level-triggered behaviour of the other engines.
+   needs linux 6.0, init fails on older kernels so the epoll engine is used. */
+
+#include "rocksockserver_internal.h"
+
+#ifdef RSS_HAVE_URING
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifndef RSS_URING_ENTRIES
+#define RSS_URING_ENTRIES 1024
+#endif
+
+/* number of provided receive buffers, must be a power of 2 */
+#ifndef RSS_URING_BUFS
+#define RSS_URING_BUFS 256
+#endif
+
+#define RSS_URING_MAXBUF 65536
+
+/* user_data layout: op << 56 | tag << 32 | fd, for sends op << 56 | request */
+enum { OP_IGNORE = 0, OP_ACCEPT, OP_RECV, OP_POLL, OP_SEND };
+#define UD(OP, TAG, FD) ((uint64_t) (OP) << 56 | (uint64_t) ((TAG) & 0xffffff) << 32 | (uint32_t) (FD))
+#define UD_OP(U) ((unsigned) ((U) >> 56))
+#define UD_TAG(U) ((unsigned) ((U) >> 32) & 0xffffff)
+#define UD_FD(U) ((int) (uint32_t) (U))
+#define UD_PTR(U) ((void*) (uintptr_t) ((U) & ((1ULL << 56) - 1)))
+
+/* rss_conn.eflags */
+#define UF_RECV 1 /* data arrives through the multishot recv */
+#define UF_POLL 2 /* a poll request is armed */
+#define UF_SEND 4 /* a sendmsg request is in flight */
+#define UF_IN   8 /* poll for readability */
+#define UF_OUT 16 /* poll for writability */
+
+struct ur_send {
+	struct ur_send *next, **pprev;
+	int fd;
+	unsigned gen;
+	struct rss_qseg* segs;
+	struct msghdr mh;
+	struct iovec iov[RSS_IOV_MAX];
+};
+
+struct rss_uring {
+	int fd;
+	unsigned sq_entries, sq_local;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	/* provided buffers for the multishot recvs */
+	struct io_uring_buf_ring* br;
+	char* bufs;
+	unsigned bufsize;
+	unsigned short br_tail;
+	rss_pool* sendpool;
+	struct ur_send* sending;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned nargs) {
+	return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+/* multishot recv can't be probed for, but it came with linux 6.0 just like
+   IORING_OP_SEND_ZC, which can. */
+static int probe(int fd) {
+	struct {
+		struct io_uring_probe p;
+		struct io_uring_probe_op ops[256];
+	} pr;
+	memset(&pr, 0, sizeof pr);
+	if(sys_register(fd, IORING_REGISTER_PROBE, &pr, 256)) return 0;
+	return pr.p.last_op >= IORING_OP_SEND_ZC && (pr.p.ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+}
+
+static unsigned pending(struct rss_uring* ur) {
+	return ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* submits the prepared requests, and waits for a completion if wait is set.
+   returns -1 with errno set on error. */
+static int submit(struct rss_uring* ur, int wait, int timeout_ms) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	__atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+	if(!wait) return sys_enter(ur->fd, pending(ur), 0, 0, 0, 0);
+	memset(&arg, 0, sizeof arg);
+	if(timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+		arg.ts = (uintptr_t) &ts;
+	}
+	return sys_enter(ur->fd, pending(ur), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+static struct io_uring_sqe* get_sqe(struct rss_uring* ur) {
+	struct io_uring_sqe* sqe;
+	unsigned idx;
+	// the ring is full, make room
+	while(pending(ur) >= ur->sq_entries)
+		if(submit(ur, 0, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return 0;
+	idx = ur->sq_local & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	ur->sq_array[idx] = idx;
+	ur->sq_local++;
+	return sqe;
+}
+
+static void unmap_rings(struct rss_uring* ur) {
+	if(ur->sqes) munmap(ur->sqes, ur->sqes_sz);
+	if(ur->cq_ring && ur->cq_ring != ur->sq_ring) munmap(ur->cq_ring, ur->cq_ring_sz);
+	if(ur->sq_ring) munmap(ur->sq_ring, ur->sq_ring_sz);
+}
+
+static int send_finish(rocksockserver* srv, struct ur_send* s, int res);
+
+/* cancels all requests and waits for the completions of the sends, whose
+   segments the kernel may still be reading. the cancellation of everything
+   else completes before the cancel request itself. */
+static void cancel_all(rocksockserver* srv) {
+	struct rss_uring* ur = srv->engine;
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe cqe;
+	unsigned head, tail;
+	int done = 0, timeouts = 0;
+	if(!ur->sqes || !(sqe = get_sqe(ur))) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = UD(OP_IGNORE, 1, 0);
+	while(!done || ur->sending) {
+		if(submit(ur, 1, 1000) == -1) {
+			if(errno == ETIME && ++timeouts == 5) return;
+			if(errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) return;
+		}
+		head = *ur->cq_head;
+		tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			cqe = ur->cqes[head & *ur->cq_mask];
+			__atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+			if(cqe.user_data == UD(OP_IGNORE, 1, 0)) done = 1;
+			else if(UD_OP(cqe.user_data) == OP_SEND) send_finish(srv, UD_PTR(cqe.user_data), cqe.res);
+		}
+	}
+}
+
+static void ur_free(rocksockserver* srv) {
+	struct rss_uring* ur = srv->engine;
+	struct ur_send* s;
+	if(!ur) return;
+	if(ur->fd != -1) {
+		cancel_all(srv);
+		close(ur->fd);
+	}
+	// the ring is gone, sends that didn't complete can't touch their
+	// segments anymore
+	while((s = ur->sending)) {
+		ur->sending = s->next;
+		rss_queue_give(srv, s->fd, s->segs, 0, 0, 0);
+	}
+	unmap_rings(ur);
+	if(ur->br) munmap(ur->br, RSS_URING_BUFS * sizeof(struct io_uring_buf));
+	free(ur->bufs);
+	rss_pool_free(ur->sendpool);
+	free(ur);
+	srv->engine = 0;
+	srv->pollfd = -1;
+}
+
+static int ur_init(rocksockserver* srv) {
+	struct rss_uring* ur;
+	struct io_uring_params p;
+	char* sq;
+	char* cq;
+	if(!(ur = calloc(1, sizeof *ur))) return -1;
+	srv->engine = ur;
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	if((ur->fd = sys_setup(RSS_URING_ENTRIES, &p)) == -1) {
+		memset(&p, 0, sizeof p);
+		ur->fd = sys_setup(RSS_URING_ENTRIES, &p);
+	}
+	if(ur->fd == -1) goto fail;
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) || !probe(ur->fd)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ur->cq_ring_sz > ur->sq_ring_sz) ur->sq_ring_sz = ur->cq_ring_sz;
+		ur->cq_ring_sz = ur->sq_ring_sz;
+	}
+	ur->sq_ring = mmap(0, ur->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if(ur->sq_ring == MAP_FAILED) {
+		ur->sq_ring = 0;
+		goto fail;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) ur->cq_ring = ur->sq_ring;
+	else {
+		ur->cq_ring = mmap(0, ur->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+		if(ur->cq_ring == MAP_FAILED) {
+			ur->cq_ring = 0;
+			goto fail;
+		}
+	}
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(0, ur->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if(ur->sqes == MAP_FAILED) {
+		ur->sqes = 0;
+		goto fail;
+	}
+	sq = ur->sq_ring;
+	cq = ur->cq_ring;
+	ur->sq_entries = p.sq_entries;
+	ur->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ur->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ur->sq_local = *ur->sq_tail;
+	ur->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ur->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	if(!(ur->sendpool = rss_pool_new(sizeof(struct ur_send)))) goto fail;
+	srv->pollfd = ur->fd;
+	return 0;
+fail:
+	ur_free(srv);
+	return -1;
+}
+
+/* registers the provided buffers, sized after the loop's receive buffer */
+static int setup_bufs(rocksockserver* srv) {
+	struct rss_uring* ur = srv->engine;
+	struct io_uring_buf_reg reg;
+	struct io_uring_buf* b;
+	size_t sz = RSS_URING_BUFS * sizeof(struct io_uring_buf);
+	unsigned i;
+	ur->bufsize = srv->bufsize > RSS_URING_MAXBUF ? RSS_URING_MAXBUF : srv->bufsize;
+	if(!ur->bufsize || !(ur->bufs = malloc((size_t) RSS_URING_BUFS * ur->bufsize))) goto fail;
+	ur->br = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(ur->br == MAP_FAILED) {
+		ur->br = 0;
+		goto fail;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t) ur->br;
+	reg.ring_entries = RSS_URING_BUFS;
+	reg.bgid = 0;
+	if(sys_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) goto fail;
+	for(i = 0; i < RSS_URING_BUFS; i++) {
+		b = &ur->br->bufs[i];
+		b->addr = (uintptr_t) (ur->bufs + (size_t) i * ur->bufsize);
+		b->len = ur->bufsize;
+		b->bid = i;
+	}
+	ur->br_tail = RSS_URING_BUFS;
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+	return 0;
+fail:
+	LOGP("io_uring buffers");
+	if(ur->br) munmap(ur->br, sz);
+	ur->br = 0;
+	free(ur->bufs);
+	ur->bufs = 0;
+	return -1;
+}
+
+static void recycle_buf(struct rss_uring* ur, unsigned bid) {
+	struct io_uring_buf* b = &ur->br->bufs[ur->br_tail & (RSS_URING_BUFS - 1)];
+	b->addr = (uintptr_t) (ur->bufs + (size_t) bid * ur->bufsize);
+	b->len = ur->bufsize;
+	b->bid = bid;
+	__atomic_store_n(&ur->br->tail, ++ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(rocksockserver* srv, int fd) {
+	struct io_uring_sqe* sqe = get_sqe(srv->engine);
+	if(!sqe) {
+		LOGP("io_uring accept");
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = UD(OP_ACCEPT, srv->conns[fd].gen, fd);
+}
+
+static void arm_recv(rocksockserver* srv, int fd) {
+	struct io_uring_sqe* sqe = get_sqe(srv->engine);
+	if(!sqe) {
+		LOGP("io_uring recv");
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = UD(OP_RECV, srv->conns[fd].gen, fd);
+}
+
+static void arm_poll(rocksockserver* srv, int fd) {
+	rss_conn* c = &srv->conns[fd];
+	struct io_uring_sqe* sqe;
+	if(!(c->eflags & (UF_IN | UF_OUT)) || !(sqe = get_sqe(srv->engine))) return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = ((c->eflags & UF_IN) ? POLLIN : 0) | ((c->eflags & UF_OUT) ? POLLOUT : 0);
+	sqe->user_data = UD(OP_POLL, c->eseq, fd);
+	c->eflags |= UF_POLL;
+}
+
+static int ur_add(rocksockserver* srv, int fd, int events) {
+	struct rss_uring* ur = srv->engine;
+	rss_conn* c = &srv->conns[fd];
+	c->eflags = 0;
+	c->eseq++;
+	if(fd == srv->listensocket) {
+		arm_accept(srv, fd);
+		return 0;
+	}
+	if((events & RSS_EV_STREAM) && srv->buf && !srv->inpool && fd != srv->signalfd &&
+	   (ur->br || !setup_bufs(srv))) {
+		c->eflags |= UF_RECV;
+		arm_recv(srv, fd);
+	} else c->eflags |= UF_IN;
+	if(events & RSS_EV_WRITE) c->eflags |= UF_OUT;
+	arm_poll(srv, fd);
+	return 0;
+}
+
+static int ur_mod(rocksockserver* srv, int fd, int events) {
+	rss_conn* c = &srv->conns[fd];
+	struct io_uring_sqe* sqe;
+	unsigned want = (events & RSS_EV_WRITE) ? UF_OUT : 0;
+	if((c->eflags & UF_OUT) == want) return 0;
+	c->eflags = (c->eflags & ~UF_OUT) | want;
+	if(c->eflags & UF_POLL) {
+		if(!(sqe = get_sqe(srv->engine))) return -1;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = UD(OP_POLL, c->eseq, fd);
+		sqe->user_data = UD(OP_IGNORE, 0, 0);
+		c->eflags &= ~UF_POLL;
+	}
+	c->eseq++;
+	arm_poll(srv, fd);
+	return 0;
+}
+
+static int ur_del(rocksockserver* srv, int fd) {
+	struct io_uring_sqe* sqe = get_sqe(srv->engine);
+	srv->conns[fd].eflags = 0;
+	if(!sqe) return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = UD(OP_IGNORE, 0, 0);
+	// the cancellation matches the fd number, so it must happen before the
+	// caller closes fd and the number gets reused.
+	return submit(srv->engine, 0, 0) == -1 ? -1 : 0;
+}
+
+static void ur_send(rocksockserver* srv, int fd) {
+	struct rss_uring* ur = srv->engine;
+	rss_conn* c = &srv->conns[fd];
+	struct io_uring_sqe* sqe;
+	struct ur_send* s;
+	int n;
+	if(c->eflags & UF_SEND) return; // the completion sends the rest
+	if(!(s = rss_pool_get(ur->sendpool))) {
+		LOGP("io_uring send");
+		return;
+	}
+	if(!(s->segs = rss_queue_take(srv, fd, s->iov, RSS_IOV_MAX, &n))) {
+		// a file segment is next, it's sent with sendfile from the core
+		rss_pool_put(ur->sendpool, s);
+		rss_queue_flush(srv, fd);
+		return;
+	}
+	if(!(sqe = get_sqe(ur))) {
+		rss_queue_give(srv, fd, s->segs, 0, 1, 0);
+		rss_pool_put(ur->sendpool, s);
+		LOGP("io_uring send");
+		return;
+	}
+	s->fd = fd;
+	s->gen = c->gen;
+	memset(&s->mh, 0, sizeof s->mh);
+	s->mh.msg_iov = s->iov;
+	s->mh.msg_iovlen = n;
+	if((s->next = ur->sending)) s->next->pprev = &s->next;
+	ur->sending = s;
+	s->pprev = &ur->sending;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) &s->mh;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = (uint64_t) OP_SEND << 56 | (uintptr_t) s;
+	c->eflags |= UF_SEND;
+}
+
+/* hands the segments of the completed send s back to the queue and releases
+   s. returns whether the client is still around. */
+static int send_finish(rocksockserver* srv, struct ur_send* s, int res) {
+	struct rss_uring* ur = srv->engine;
+	int fd = s->fd;
+	int alive = rss_is_watched(srv, fd) && srv->conns[fd].gen == s->gen;
+	if((*s->pprev = s->next)) s->next->pprev = s->pprev;
+	if(alive) srv->conns[fd].eflags &= ~UF_SEND;
+	if(res >= 0)
+		rss_queue_give(srv, fd, s->segs, res, alive, 0);
+	else
+		rss_queue_give(srv, fd, s->segs, 0, alive,
+		               res != -EINTR && res != -EAGAIN && res != -ECANCELED);
+	rss_pool_put(ur->sendpool, s);
+	return alive;
+}
+
+static void send_done(rocksockserver* srv, struct ur_send* s, int res) {
+	int fd = s->fd;
+	if(send_finish(srv, s, res) && srv->conns[fd].qhead) ur_send(srv, fd);
+}
+
+static void handle(rocksockserver* srv, uint64_t ud, int res, unsigned flags) {
+	struct rss_uring* ur = srv->engine;
+	int fd = UD_FD(ud), events;
+	rss_conn* c = &srv->conns[fd];
+	const char* data = 0;
+	switch(UD_OP(ud)) {
+	case OP_SEND:
+		send_done(srv, UD_PTR(ud), res);
+		break;
+	case OP_ACCEPT:
+		if(fd != srv->listensocket || (c->gen & 0xffffff) != UD_TAG(ud)) {
+			if(res >= 0) close(res);
+			break;
+		}
+		if(res >= 0) rss_accepted(srv, res, 0);
+		else if(res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+			errno = -res;
+			LOGP("accept");
+		}
+		if(!(flags & IORING_CQE_F_MORE) && res != -ECANCELED) arm_accept(srv, fd);
+		break;
+	case OP_RECV:
+		if(flags & IORING_CQE_F_BUFFER)
+			data = ur->bufs + (size_t) (flags >> IORING_CQE_BUFFER_SHIFT) * ur->bufsize;
+		if(!rss_is_watched(srv, fd) || (c->gen & 0xffffff) != UD_TAG(ud) || !(c->eflags & UF_RECV)) {
+			if(data) recycle_buf(ur, flags >> IORING_CQE_BUFFER_SHIFT);
+			break;
+		}
+		if(res >= 0) rss_dispatch_data(srv, fd, data, res);
+		else if(res != -ENOBUFS && res != -ECANCELED && res != -EINTR) {
+			errno = -res;
+			LOGP("recv");
+			rocksockserver_disconnect_client(srv, fd);
+		}
+		if(data) recycle_buf(ur, flags >> IORING_CQE_BUFFER_SHIFT);
+		// the callbacks may have grown the table
+		c = &srv->conns[fd];
+		if(!(flags & IORING_CQE_F_MORE) && res != -ECANCELED && rss_is_watched(srv, fd) &&
+		   (c->gen & 0xffffff) == UD_TAG(ud) && (c->eflags & UF_RECV))
+			arm_recv(srv, fd);
+		break;
+	case OP_POLL:
+		if(!rss_is_watched(srv, fd) || (c->eseq & 0xffffff) != UD_TAG(ud)) break;
+		c->eflags &= ~UF_POLL;
+		if(res == -ECANCELED) break;
+		if(res < 0) res = POLLERR;
+		events = 0;
+		// errors and hangups are reported as readable, so the following recv() picks them up
+		if((c->eflags & UF_IN) && (res & (POLLIN | POLLHUP | POLLERR))) events |= RSS_EV_READ;
+		if((c->eflags & UF_OUT) && (res & (POLLOUT | POLLHUP | POLLERR))) events |= RSS_EV_WRITE;
+		rss_dispatch(srv, fd, events);
+		c = &srv->conns[fd];
+		// still interested, and the callbacks didn't re-arm it already
+		if(rss_is_watched(srv, fd) && !(c->eflags & UF_POLL)) arm_poll(srv, fd);
+		break;
+	}
+}
+
+static int ur_wait(rocksockserver* srv, int timeout_ms) {
+	struct rss_uring* ur = srv->engine;
+	struct io_uring_cqe cqe;
+	unsigned head, tail;
+	int n = 0;
+	if(submit(ur, 1, timeout_ms) == -1) {
+		if(errno == ETIME) return 0;
+		if(errno != EBUSY && errno != EAGAIN) return -1;
+	}
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail; head++, n++) {
+		cqe = ur->cqes[head & *ur->cq_mask];
+		__atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+		handle(srv, cqe.user_data, cqe.res, cqe.flags);
+	}
+	return n;
+}
+
+const rss_backend rss_backend_uring = {
+	.name = "io_uring",
+	.init = ur_init,
+	.free = ur_free,
+	.add = ur_add,
+	.mod = ur_mod,
+	.del = ur_del,
+	.wait = ur_wait,
+	.send = ur_send,
+};
+
+#endif